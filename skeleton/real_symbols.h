@@ -0,0 +1,58 @@
+/*
+ * Functions testlib intercepts that it also calls the original of, one
+ * REAL_SYMBOL(function) per line. testlib.c includes this file several times
+ * with different definitions of REAL_SYMBOL, so it has no include guard. The
+ * Makefile reads the names from here for the -Wl,--wrap= flags of testlib.a.
+ */
+REAL_SYMBOL(clock_gettime)
+REAL_SYMBOL(nanosleep)
+REAL_SYMBOL(pthread_barrier_destroy)
+REAL_SYMBOL(pthread_barrier_init)
+REAL_SYMBOL(pthread_barrier_wait)
+REAL_SYMBOL(pthread_cancel)
+REAL_SYMBOL(pthread_cond_broadcast)
+REAL_SYMBOL(pthread_cond_signal)
+REAL_SYMBOL(pthread_cond_timedwait)
+REAL_SYMBOL(pthread_cond_wait)
+REAL_SYMBOL(pthread_create)
+REAL_SYMBOL(pthread_detach)
+REAL_SYMBOL(pthread_exit)
+REAL_SYMBOL(pthread_getaffinity_np)
+REAL_SYMBOL(pthread_getattr_np)
+REAL_SYMBOL(pthread_getcpuclockid)
+REAL_SYMBOL(pthread_getname_np)
+REAL_SYMBOL(pthread_getschedparam)
+REAL_SYMBOL(pthread_join)
+REAL_SYMBOL(pthread_kill)
+REAL_SYMBOL(pthread_mutex_destroy)
+REAL_SYMBOL(pthread_mutex_init)
+REAL_SYMBOL(pthread_mutex_lock)
+REAL_SYMBOL(pthread_mutex_timedlock)
+REAL_SYMBOL(pthread_mutex_trylock)
+REAL_SYMBOL(pthread_mutex_unlock)
+REAL_SYMBOL(pthread_once)
+REAL_SYMBOL(pthread_rwlock_rdlock)
+REAL_SYMBOL(pthread_rwlock_timedrdlock)
+REAL_SYMBOL(pthread_rwlock_timedwrlock)
+REAL_SYMBOL(pthread_rwlock_tryrdlock)
+REAL_SYMBOL(pthread_rwlock_trywrlock)
+REAL_SYMBOL(pthread_rwlock_unlock)
+REAL_SYMBOL(pthread_rwlock_wrlock)
+REAL_SYMBOL(pthread_self)
+REAL_SYMBOL(pthread_setaffinity_np)
+REAL_SYMBOL(pthread_setname_np)
+REAL_SYMBOL(pthread_setschedparam)
+REAL_SYMBOL(pthread_setschedprio)
+REAL_SYMBOL(pthread_sigqueue)
+REAL_SYMBOL(pthread_spin_lock)
+REAL_SYMBOL(pthread_spin_trylock)
+REAL_SYMBOL(pthread_spin_unlock)
+REAL_SYMBOL(pthread_timedjoin_np)
+REAL_SYMBOL(pthread_tryjoin_np)
+REAL_SYMBOL(sched_yield)
+REAL_SYMBOL(sem_post)
+REAL_SYMBOL(sem_timedwait)
+REAL_SYMBOL(sem_trywait)
+REAL_SYMBOL(sem_wait)
+REAL_SYMBOL(sleep)
+REAL_SYMBOL(usleep)
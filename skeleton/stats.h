@@ -0,0 +1,53 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Live statistics of a run with STATS=True. testlib.so maps TESTLIB_STATS_PATH
+ * for its pid, fills it while the program runs and unlinks it at exit, and
+ * tools/testlib-top samples it. Every field is written with relaxed atomics, so
+ * a reader sees each value on its own but not a consistent snapshot.
+ */
+#define TESTLIB_STATS_PATH "/dev/shm/testlib-%d"
+#define TESTLIB_STATS_MAGIC 0x31737461746c7400ULL
+#define TESTLIB_STATS_MAX_FUNCTIONS 64
+#define TESTLIB_STATS_NAME_LENGTH 32
+
+struct testlib_stats {
+  uint64_t magic;
+  int32_t pid;
+  int32_t algorithm;
+  char strategy[TESTLIB_STATS_NAME_LENGTH];
+  // CLOCK_MONOTONIC in ns when the page was created
+  uint64_t start_ns;
+  // Set by the destructor, the program is about to exit
+  int32_t finished;
+
+  // Intercepted calls, calls[i] of the function named function_names[i]
+  int32_t function_count;
+  char function_names[TESTLIB_STATS_MAX_FUNCTIONS][TESTLIB_STATS_NAME_LENGTH];
+  uint64_t calls[TESTLIB_STATS_MAX_FUNCTIONS];
+
+  // Scheduling points reached by all threads, the step number of the run
+  uint64_t steps;
+  // Times the turn went to another thread (PCT)
+  uint64_t context_switches;
+  // Thread slots under PCT
+  int32_t runnable_threads;
+  int32_t blocked_threads;
+  // Time spent deciding in the scheduler critical section (PCT), extrapolated from
+  // one decision in 16
+  uint64_t scheduler_ns;
+  // Last decision: the state the calling thread was in, the thread that had the
+  // turn and the one that got it (-1 if none), and the step it was made at
+  int32_t last_state;
+  int32_t last_from;
+  int32_t last_to;
+  uint64_t last_step;
+  // CLOCK_MONOTONIC in ns of the last timed decision, at most 15 decisions before
+  // the last one
+  uint64_t last_decision_ns;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#include "strategy.h"
+
+/*
+ * ROUND ROBIN STRATEGY
+ * Example of a strategy loaded with STRATEGY=./strategies/round_robin.so. Whenever the
+ * PCT model switches threads, the turn goes to the next runnable slot after the thread
+ * that has it, instead of the one with the highest priority, and pthread_cond_signal
+ * wakes the thread that waited longest. The other hooks are left to the PCT model.
+ */
+
+int round_robin_pick_next(void) {
+  int slots = testlib_max_threads();
+  int current = testlib_current_thread();
+  for (int i = 1; i <= slots; i++) {
+    int slot = (current + i + slots) % slots;
+    if (testlib_thread_runnable(slot)) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+int round_robin_pick_waiter(const int *waiters, int waiter_count) {
+  return 0;
+}
+
+struct testlib_strategy testlib_strategy = {
+  .name = "round_robin",
+  .pick_next = round_robin_pick_next,
+  .pick_waiter = round_robin_pick_waiter,
+};
@@ -0,0 +1,49 @@
+#ifndef STRATEGY_H
+#define STRATEGY_H
+
+#include <stdbool.h>
+
+/*
+ * Scheduling strategies of testlib.so. none, random and pct are built in, and
+ * STRATEGY=<path>.so loads another one from a shared object that defines
+ *
+ *   struct testlib_strategy testlib_strategy = { ... };
+ *
+ * A loaded strategy runs on the PCT model: only one thread runs at a time, and
+ * blocked threads are tracked by testlib.so. Hooks left NULL keep the behavior
+ * of pct. Except on_sync_point, the hooks are called while testlib.so holds its
+ * scheduler lock, so they must not call intercepted functions.
+ */
+struct testlib_strategy {
+  const char *name;
+  // pthread_create gave the thread in slot thread_index its slot, it did not start yet
+  void (*on_thread_create)(int thread_index);
+  // The thread in slot thread_index is about to run its start routine
+  void (*on_thread_start)(int thread_index);
+  // The calling thread reached a scheduling point. state tells testlib_sync_point()
+  // what the thread is doing, a strategy that replaces this hook has to pass it on.
+  void (*on_sync_point)(int state);
+  // Returns the runnable slot that gets the turn, -1 if no thread is runnable. A thread
+  // that yields is not runnable while this picks the thread it yields to.
+  int (*pick_next)(void);
+  // The thread in slot thread_index waits for another thread, or may run again
+  void (*on_block)(int thread_index);
+  void (*on_unblock)(int thread_index);
+  // The thread in slot thread_index terminated
+  void (*on_exit)(int thread_index);
+  // Returns the position in waiters of the thread pthread_cond_signal wakes, waiters
+  // holds the slots of the waiting threads in the order they started waiting
+  int (*pick_waiter)(const int *waiters, int waiter_count);
+};
+
+// Exported by testlib.so for loaded strategies
+
+// Runs the PCT model for a scheduling point, the default on_sync_point
+void testlib_sync_point(int state);
+// Number of thread slots
+int testlib_max_threads(void);
+bool testlib_thread_runnable(int thread_index);
+// Slot of the thread that has the turn, -1 if none has
+int testlib_current_thread(void);
+
+#endif
@@ -7,7 +7,9 @@
 #include <sys/syscall.h>
 #define gettid() syscall(SYS_gettid)
 
+#include <pthread.h>
 #include <semaphore.h>
+#include <setjmp.h>
 #include <string.h>
 
 #define UNW_LOCAL_ONLY
@@ -15,14 +17,24 @@
 #include <stdio.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "stats.h"
+#include "strategy.h"
 #include "testlib.h"
 #include "utils.h"
 
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
 typedef void (*start_routine_type)();
 typedef int (*pthread_create_type)();
-typedef void (*pthread_exit_type)();
+typedef void (*pthread_exit_type)() __attribute__((noreturn));
 typedef int (*pthread_yield_type)();
 typedef int (*pthread_cond_wait_type)();
 typedef int (*pthread_cond_signal_type)();
@@ -30,11 +42,114 @@ typedef int (*pthread_cond_broadcast_type)();
 typedef int (*pthread_mutex_lock_type)();
 typedef int (*pthread_mutex_unlock_type)();
 typedef int (*pthread_mutex_trylock_type)();
+typedef int (*pthread_mutex_init_type)();
+typedef int (*pthread_mutex_destroy_type)();
+typedef int (*pthread_join_type)();
+typedef int (*pthread_tryjoin_np_type)();
+typedef int (*pthread_timedjoin_np_type)();
+typedef int (*pthread_cond_timedwait_type)();
+typedef int (*pthread_mutex_timedlock_type)();
+typedef int (*clock_gettime_type)();
+typedef unsigned int (*sleep_type)();
+typedef int (*usleep_type)();
+typedef int (*nanosleep_type)();
+typedef int (*pthread_rwlock_lock_type)();
+typedef int (*pthread_rwlock_unlock_type)();
+typedef int (*pthread_detach_type)();
+typedef pthread_t (*pthread_self_type)();
+typedef int (*sem_wait_type)();
+typedef int (*sem_post_type)();
+typedef int (*sem_trywait_type)();
+typedef int (*sem_timedwait_type)();
+typedef int (*pthread_spin_lock_type)();
+typedef int (*pthread_spin_unlock_type)();
+typedef int (*pthread_spin_trylock_type)();
+typedef int (*pthread_barrier_init_type)();
+typedef int (*pthread_barrier_wait_type)();
+typedef int (*pthread_barrier_destroy_type)();
+typedef int (*pthread_once_type)();
+typedef int (*pthread_kill_type)();
+typedef int (*pthread_sigqueue_type)();
+typedef int (*pthread_cancel_type)();
+typedef int (*pthread_name_np_type)();
+typedef int (*pthread_getattr_np_type)();
+typedef int (*pthread_schedparam_type)();
+typedef int (*pthread_setschedprio_type)();
+typedef int (*pthread_affinity_np_type)();
+typedef int (*pthread_getcpuclockid_type)();
+
+// testlib.so intercepts the sem_* functions of the target, but its own sem_t
+// locks must not go through those wrappers. Every sem_* call in this file
+// reaches the original function through these, see the Semaphores wrappers.
+int internal_sem_wait(sem_t *sem);
+int internal_sem_post(sem_t *sem);
+int internal_sem_trywait(sem_t *sem);
+int internal_sem_timedwait(sem_t *sem, const struct timespec *abstime);
+#define sem_wait internal_sem_wait
+#define sem_post internal_sem_post
+#define sem_trywait internal_sem_trywait
+#define sem_timedwait internal_sem_timedwait
+
+#ifdef TESTLIB_STATIC
+// testlib.a: the program is linked with -Wl,--wrap=<function>, which sends its
+// calls to __wrap_<function>, see real_symbols.h
+#define WRAPPER(function) __wrap_##function
+#else
+#define WRAPPER(function) function
+#endif
+
+// ALGORITHM and STACKTRACES are only read from the environment once. The
+// testlib-<algorithm>.so targets of the Makefile fix them at compile time with
+// TESTLIB_ALGORITHM and TESTLIB_STACKTRACES, so the other paths are optimized out.
+#ifdef TESTLIB_ALGORITHM
+#define algorithm_ID() (TESTLIB_ALGORITHM)
+#else
+int algorithm_ID();
+#endif
+#ifdef TESTLIB_STACKTRACES
+#define stacktraces_enabled() (TESTLIB_STACKTRACES)
+#else
+int stacktraces_enabled();
+#endif
+
+// Strategy scheduling the threads, see SCHEDULING ALGORITHMS. The fixed builds
+// cannot load one from STRATEGY.
+extern const struct testlib_strategy g_none_strategy;
+extern const struct testlib_strategy g_random_strategy;
+extern const struct testlib_strategy g_pct_strategy;
+#ifdef TESTLIB_ALGORITHM
+#define current_strategy() \
+  (algorithm_ID() == kAlgorithmPCT ? &g_pct_strategy : \
+   algorithm_ID() == kAlgorithmRandom ? &g_random_strategy : &g_none_strategy)
+#else
+const struct testlib_strategy *current_strategy();
+#endif
 
 // Needed for PCT
 #define DEBUG false
 #define MAX_THREADS 64
 
+// Needed for deadlock detection
+#define MAX_HELD_MUTEXES 16
+#define MAX_STACK_DEPTH 32
+// Distinct from the 1 returned by failing tests and the framework timeout
+#define DEADLOCK_EXIT_CODE 3
+
+// Needed for lock order checking
+#define MAX_LOCK_ORDER_EDGES 256
+#define LOCK_ORDER_EXIT_CODE 4
+
+// Needed for race detection
+#define RACE_EXIT_CODE 5
+#define MAX_RACE_FRAMES 8
+#define RACE_SHADOW_CELLS 4
+#define RACE_SHADOW_WORDS (1 << 15)
+#define RACE_SHADOW_PROBES 64
+#define RACE_SYNC_OBJECTS 1024
+#define RACE_LOCK_STRIPES 64
+#define MAX_SHADOW_STACK 64
+#define MAX_REPORTED_RACES 64
+
 sem_t g_count_lock;
 sem_t g_print_lock;
 // General lock used mostly in PCT
@@ -43,23 +158,29 @@ sem_t g_general_lock;
 // General lock used mostly in PCT
 sem_t g_general_lock;
 sem_t g_PCT_lock;
+// Scheduler critical section of PCT. PCT() takes it exactly once per scheduling
+// decision and calls the PCT_* handler for the state while holding it, so the
+// handlers, find_highest_priority(), find_next_available_thread(),
+// run_highest_priority() and the strategy hooks never take it themselves. They
+// may take g_deadlock_lock, g_general_lock and g_print_lock inside it, never the
+// other way around. Nothing may wait on g_semaphores while holding it, see
+// t_PCT_must_wait.
 sem_t g_PCT_main_lock;
-sem_t g_PCT_main_init_lock;
-sem_t g_PCT_thread_start_lock;
-sem_t g_PCT_thread_after_create_lock;
-sem_t g_PCT_thread_before_create_lock;
-sem_t g_PCT_thread_terminate_lock;
-sem_t g_PCT_thread_yield_lock;
-sem_t g_PCT_thread_lock_lock;
-sem_t g_PCT_thread_unlock_lock;
-sem_t g_PCT_thread_trylock_lock;
-sem_t g_PCT_find_highest_priority_lock;
-sem_t g_PCT_run_highest_priority_lock;
-sem_t g_PCT_find_next_available_thread;
 
 // Total number of threads that are active
 int g_thread_count = 0;
 int STACKTRACE_THREAD_ID = -1;
+// Set once the thread returned from its start routine or called pthread_exit. glibc
+// runs the TLS destructors after that, and the one of libunwind locks its mutex.
+__thread bool t_thread_finished = false;
+
+// libunwind locks mutexes internally, they go straight to the original functions while
+// the calling thread prints a stacktrace and after it finished. Otherwise a thread
+// holding the mutex of libunwind could wait for g_print_lock or the scheduler while
+// another thread unwinds with them held.
+bool use_original_functions() {
+  return STACKTRACE_THREAD_ID == gettid() || t_thread_finished;
+}
 
 // Keeps track of thread counts - index is gettid()
 // We were told that there will only be up to 64 threads ever run
@@ -72,6 +193,13 @@ typedef struct arg_struct {
   void *struct_arg;
   // Needed for PCT
   int thread_index;
+  // Needed for race detection
+  uint32_t creator_clock[MAX_THREADS];
+  bool detached;
+  // Random stream of the new thread, see RANDOM STREAMS
+  uint64_t random_stream;
+  // Free list of the ARENA
+  struct arg_struct *next_free;
 } arg_struct;
 
 // PCT thread state
@@ -87,6 +215,25 @@ typedef struct arg_struct {
 #define PCT_THREAD_UNLOCK 8
 #define PCT_DO_NOTHING 9
 #define PCT_THREAD_TRY_LOCK 10
+#define PCT_THREAD_PREEMPT 11
+#define PCT_THREAD_JOIN 12
+#define PCT_THREAD_TRY_JOIN 13
+#define PCT_THREAD_DETACH 14
+#define PCT_THREAD_COND_WAIT 15
+#define PCT_THREAD_COND_SIGNAL 16
+#define PCT_THREAD_COND_BROADCAST 17
+#define PCT_THREAD_SLEEP 18
+#define PCT_THREAD_RWLOCK 19
+#define PCT_THREAD_RWLOCK_TRY 20
+#define PCT_THREAD_RWLOCK_UNLOCK 21
+#define PCT_THREAD_SEM_WAIT 22
+#define PCT_THREAD_SEM_POST 23
+#define PCT_THREAD_SPIN_LOCK 24
+#define PCT_THREAD_SPIN_UNLOCK 25
+#define PCT_THREAD_BARRIER_WAIT 26
+#define PCT_THREAD_ONCE 27
+#define PCT_THREAD_ONCE_DONE 28
+#define PCT_THREAD_SPIN 29
 
 // A thread can have any of the following states
 // - does not currently exist (never created or terminated)
@@ -101,13 +248,52 @@ struct thread_struct {
   pthread_t thread_id;
   int state;
   int thread_number;
+  // Mutexes the thread currently holds (one entry per recursive lock)
+  pthread_mutex_t *held_mutexes[MAX_HELD_MUTEXES];
+  // Mutex the thread waits for, NULL if it is not waiting, and the next thread
+  // waiting for it (-1 if none), see MUTEX REGISTRY
+  pthread_mutex_t *waiting_mutex;
+  int next_mutex_waiter;
+  // Stack captured when the thread started waiting on waiting_mutex
+  void *wait_stack[MAX_STACK_DEPTH];
+  int wait_stack_depth;
+  // Handle pthread_create returned for the thread, needed to model pthread_join under PCT
+  pthread_t handle;
+  bool detached;
+  // Slot of the thread this one waits for in pthread_join, -1 if it is not joining
+  int join_target;
+  // A timed wait gives up (timed_out) instead of deadlocking when no other thread can run
+  bool timed_wait;
+  bool timed_out;
+  // Virtual time the timed wait runs out, 0 if virtual time is off
+  uint64_t deadline;
+  // Condition variable the thread waits on under PCT, NULL if it is not waiting
+  pthread_cond_t *waiting_cond;
+  // Read-write lock the thread waits for under PCT, and whether it wants to write
+  pthread_rwlock_t *waiting_rwlock;
+  bool waiting_write;
+  // Semaphore, spin lock or barrier the thread waits on under PCT, and which of them it is
+  void *waiting_object;
+  const char *waiting_kind;
+  // Failed try-lock calls and yields in a row, see FAIR SCHEDULING
+  int spin_count;
+  // Whether the thread was demoted for spinning, the priority it had before and the one it got
+  bool demoted;
+  int undemoted_priority;
+  int demoted_priority;
+  // Start routine of the thread (NULL for main), the argument it was given (struct_arg)
+  // and its number of calls into PCT(), two threads with the same of all three are symmetric
+  void *(*start_routine) (void *);
+  void *start_arg;
+  unsigned long steps;
 };
 
-// g_current_thread is the index of the current thread
-// Used this in PCT_thread_start() to know that
-// PCT_thread_create() was done
+// g_current_thread is the index of the thread that currently has its turn under PCT
 int g_current_thread = -1;
 
+// Index into g_threads of the calling thread (-1 if it is not tracked)
+__thread int t_thread_index = -1;
+
 int g_runnable_threads = 0;
 int g_block_threads = 0;
 
@@ -118,21 +304,460 @@ struct thread_struct *g_threads = NULL;
 // Array of semaphores for each thread mapped to the g_runnable array
 sem_t *g_semaphores = NULL;
 
-// Array of currently active mutexes (incomplete)
-pthread_mutex_t *g_thread_mutexes[MAX_THREADS];
-
-pthread_mutex_t *g_current_mutex = NULL;
+// Arguments of the call a thread is making while it runs PCT(). They are per
+// thread since a blocked call is retried after other threads made theirs.
+__thread pthread_mutex_t *t_current_mutex = NULL;
+__thread pthread_cond_t *t_current_cond = NULL;
+__thread pthread_t t_current_join_thread;
+__thread void *(*t_current_start_routine) (void *) = NULL;
+__thread void *t_current_start_arg = NULL;
+__thread pthread_rwlock_t *t_current_rwlock = NULL;
+__thread bool t_current_rwlock_write = false;
+// Semaphore, spin lock or barrier of the call
+__thread void *t_current_object = NULL;
+// Whether the call has a timeout, and its virtual deadline (0 if virtual time is off)
+__thread bool t_current_timed = false;
+__thread uint64_t t_current_deadline = 0;
 
 int g_mutex_locked = 1;
 
-// Mutex lock used in the PCT algorithm
-pthread_mutex_lock_type g_orig_mutex_lock;
-pthread_mutex_unlock_type g_orig_mutex_unlock;
+////////////////////////////////////////////////////
+/////////////////// REAL SYMBOLS ///////////////////
+////////////////////////////////////////////////////
+
+// The functions testlib.so intercepts, looked up with dlsym(RTLD_NEXT) once by
+// resolve_real_symbols() instead of on every call. dlsym takes the loader lock.
+enum real_symbol {
+#define REAL_SYMBOL(function) REAL_##function,
+#include "real_symbols.h"
+#undef REAL_SYMBOL
+  REAL_SYMBOL_COUNT
+};
+
+// STATS counts the calls of every intercepted function in its own cell
+_Static_assert(REAL_SYMBOL_COUNT <= TESTLIB_STATS_MAX_FUNCTIONS,
+               "raise TESTLIB_STATS_MAX_FUNCTIONS in stats.h");
+
+const char *g_real_symbol_names[REAL_SYMBOL_COUNT] = {
+#define REAL_SYMBOL(function) #function,
+#include "real_symbols.h"
+#undef REAL_SYMBOL
+};
+
+#ifdef TESTLIB_STATIC
+// testlib.a is linked with -Wl,--wrap=<function>, so the originals are
+// __real_<function> and known at link time
+#define REAL_SYMBOL(function) extern void __real_##function(void);
+#include "real_symbols.h"
+#undef REAL_SYMBOL
+
+void *g_real_symbols[REAL_SYMBOL_COUNT] = {
+#define REAL_SYMBOL(function) (void *)__real_##function,
+#include "real_symbols.h"
+#undef REAL_SYMBOL
+};
+#else
+void *g_real_symbols[REAL_SYMBOL_COUNT];
+#endif
+
+// Calls can arrive before the constructor ran, for example from the constructor
+// of another preloaded library, so a missing entry is looked up on the spot.
+// Looking it up twice from two threads is harmless.
+void *real_symbol(enum real_symbol symbol) {
+  void *function = __atomic_load_n(&g_real_symbols[symbol], __ATOMIC_ACQUIRE);
+  if (function == NULL) {
+    function = dlsym(RTLD_NEXT, g_real_symbol_names[symbol]);
+    __atomic_store_n(&g_real_symbols[symbol], function, __ATOMIC_RELEASE);
+  }
+  return function;
+}
+
+#ifndef TESTLIB_STATIC
+// Runs before init_utils() and init_testlib(), which already take locks
+static __attribute__((constructor (101))) void resolve_real_symbols(void) {
+  for (int i = 0; i < REAL_SYMBOL_COUNT; i++) {
+    real_symbol(i);
+  }
+}
+#endif
+
+// The original pthread_mutex_lock and unlock, used by PCT around condition variables
+int real_mutex_lock(pthread_mutex_t *mutex) {
+  return ((pthread_mutex_lock_type)real_symbol(REAL_pthread_mutex_lock))(mutex);
+}
+
+int real_mutex_unlock(pthread_mutex_t *mutex) {
+  return ((pthread_mutex_unlock_type)real_symbol(REAL_pthread_mutex_unlock))(mutex);
+}
+
+////////////////////////////////////////////////////
+////////////// OVERHEAD ACCOUNTING /////////////////
+////////////////////////////////////////////////////
+
+// OVERHEAD=True charges the time of every thread to one kind at a time, switching
+// with CLOCK_MONOTONIC timestamps at the borders: program code, blocked in an original
+// function, or inside a wrapper deciding who runs, parked until the scheduler gives the
+// turn back, printing, walking stacks, or the rest of the wrapper (bookkeeping). Nested
+// kinds are exclusive, time printing inside the scheduler is logging. Each thread only
+// writes its own record, and fini_testlib() prints them with the time per wrapper.
+// OVERHEAD_FILE=<path> also writes them as JSON.
+#define MAX_OVERHEAD_THREADS 256
+
+enum overhead_kind {
+  OVERHEAD_USER,
+  OVERHEAD_ORIGINAL,
+  OVERHEAD_WRAPPER,
+  OVERHEAD_SCHEDULING,
+  OVERHEAD_WAITING,
+  OVERHEAD_LOGGING,
+  OVERHEAD_STACKS,
+  OVERHEAD_KINDS
+};
+
+const char *g_overhead_kind_names[OVERHEAD_KINDS] = {
+  "user", "original", "wrapper", "scheduling", "waiting", "logging", "stacks"
+};
+
+struct overhead_record {
+  int thread_number;
+  long int thread_id;
+  uint64_t ns[OVERHEAD_KINDS];
+};
+
+bool g_overhead = false;
+struct overhead_record g_overhead_records[MAX_OVERHEAD_THREADS];
+int g_overhead_record_count = 0;
+// Threads that got no record, their time is not accounted
+int g_overhead_dropped = 0;
+// Outermost calls of each wrapper and the time spent in them, all kinds included
+uint64_t g_wrapper_calls[REAL_SYMBOL_COUNT];
+uint64_t g_wrapper_ns[REAL_SYMBOL_COUNT];
+
+// Record of the calling thread (NULL if it is not accounted), the kind its time goes
+// to and since when
+__thread struct overhead_record *t_overhead = NULL;
+__thread int t_overhead_kind = OVERHEAD_USER;
+__thread uint64_t t_overhead_since = 0;
+// When the outermost wrapper of the calling thread was entered
+__thread uint64_t t_overhead_wrapper_start = 0;
+// Kind to go back to when the calling thread releases g_print_lock
+__thread int t_overhead_before_print = OVERHEAD_USER;
+
+// See VIRTUAL TIME
+uint64_t real_clock_ns(clockid_t clock);
+
+// Charges the time since the last switch and makes kind current. Returns the
+// previous kind for overhead_leave(), -1 if the thread is not accounted.
+int overhead_enter(int kind) {
+  if (t_overhead == NULL) {
+    return -1;
+  }
+  uint64_t now = real_clock_ns(CLOCK_MONOTONIC);
+  t_overhead->ns[t_overhead_kind] += now - t_overhead_since;
+  t_overhead_since = now;
+  int previous = t_overhead_kind;
+  t_overhead_kind = kind;
+  return previous;
+}
+
+void overhead_leave(int previous) {
+  if (previous != -1) {
+    overhead_enter(previous);
+  }
+}
+
+// Gives the calling thread a record, its time goes to kind from now on
+void overhead_thread_start(int kind) {
+  if (!g_overhead) {
+    return;
+  }
+  // A pooled OS thread starts a record for every start routine it runs
+  overhead_enter(OVERHEAD_WRAPPER);
+  int index = __atomic_fetch_add(&g_overhead_record_count, 1, __ATOMIC_RELAXED);
+  if (index >= MAX_OVERHEAD_THREADS) {
+    __atomic_fetch_add(&g_overhead_dropped, 1, __ATOMIC_RELAXED);
+    t_overhead = NULL;
+    return;
+  }
+  t_overhead = &g_overhead_records[index];
+  t_overhead->thread_number = -1;
+  t_overhead->thread_id = gettid();
+  t_overhead_kind = kind;
+  t_overhead_since = real_clock_ns(CLOCK_MONOTONIC);
+}
+
+void overhead_thread_number(int thread_number) {
+  if (t_overhead != NULL) {
+    t_overhead->thread_number = thread_number;
+  }
+}
+
+// Closes the record of the calling thread, called right before it exits
+void overhead_thread_exit() {
+  overhead_enter(OVERHEAD_WRAPPER);
+  t_overhead = NULL;
+}
+
+// Returns symbol if this is the outermost wrapper of an accounted thread, -1 otherwise
+int overhead_enter_wrapper(enum real_symbol symbol) {
+  if (t_overhead == NULL || t_overhead_kind != OVERHEAD_USER) {
+    return -1;
+  }
+  overhead_enter(OVERHEAD_WRAPPER);
+  t_overhead_wrapper_start = t_overhead_since;
+  return symbol;
+}
+
+// Cleanup of the variable ENTER_WRAPPER() declares, runs when the wrapper returns
+void overhead_leave_wrapper(int *symbol) {
+  if (*symbol == -1 || t_overhead == NULL) {
+    return;
+  }
+  overhead_enter(OVERHEAD_USER);
+  __atomic_fetch_add(&g_wrapper_calls[*symbol], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&g_wrapper_ns[*symbol], t_overhead_since - t_overhead_wrapper_start,
+                     __ATOMIC_RELAXED);
+}
+
+// Called by internal_sem_wait() and internal_sem_post() for g_print_lock
+void overhead_print_lock(bool taken) {
+  if (t_overhead == NULL) {
+    return;
+  }
+  if (taken) {
+    t_overhead_before_print = overhead_enter(OVERHEAD_LOGGING);
+  } else {
+    overhead_leave(t_overhead_before_print);
+  }
+}
+
+// Only a call made by the wrapper itself is charged to original, the sleeps of the
+// random algorithm stay waiting
+int overhead_enter_original() {
+  return t_overhead_kind == OVERHEAD_WRAPPER ? overhead_enter(OVERHEAD_ORIGINAL) : -1;
+}
+
+// Evaluates call, an original function that can block, charged to original
+#define BLOCKING_ORIGINAL(call) ({ \
+  int overhead_previous = overhead_enter_original(); \
+  __typeof__(call) overhead_result = (call); \
+  overhead_leave(overhead_previous); \
+  overhead_result; })
+
+// testlib-none.so neither schedules nor reports anything, its wrappers go straight
+// to the original function without counting, logging or unwinding
+#ifdef TESTLIB_ALGORITHM
+#define fixed_algorithm_none() (algorithm_ID() == kAlgorithmNone)
+#else
+#define fixed_algorithm_none() false
+#endif
+
+// First statement of every wrapper, calls the original function with the arguments
+// of the wrapper in testlib-none.so
+#define PASS_THROUGH(function, ...) \
+  if (fixed_algorithm_none()) { \
+    return ((__typeof__(&WRAPPER(function)))real_symbol(REAL_##function))(__VA_ARGS__); \
+  }
+
+// Follows PASS_THROUGH() in every wrapper: counts the call for STATS, and with OVERHEAD
+// charges the time until the wrapper returns to it
+#define ENTER_WRAPPER(symbol) \
+  stats_count_call(symbol); \
+  __attribute__((cleanup(overhead_leave_wrapper))) int overhead_symbol = \
+    overhead_enter_wrapper(symbol)
+
+void init_overhead() {
+  char *overhead_var = getenv("OVERHEAD");
+  if (overhead_var == NULL || strcmp(overhead_var, "True") != 0) {
+    return;
+  }
+  g_overhead = true;
+  // main is thread 0 and runs program code once init_testlib() returns
+  overhead_thread_start(OVERHEAD_WRAPPER);
+  overhead_thread_number(0);
+}
+
+// Writes the records and the wrapper times to OVERHEAD_FILE as JSON. Every process
+// that loads testlib.so writes it, a %d in the path is replaced with the pid.
+void write_overhead_file(int record_count) {
+  char *path_var = getenv("OVERHEAD_FILE");
+  if (path_var == NULL) {
+    return;
+  }
+  char path[PATH_MAX];
+  char *pid_field = strstr(path_var, "%d");
+  if (pid_field == NULL) {
+    snprintf(path, sizeof(path), "%s", path_var);
+  } else {
+    snprintf(path, sizeof(path), "%.*s%d%s", (int)(pid_field - path_var), path_var,
+             (int)getpid(), pid_field + 2);
+  }
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    INFO("Cannot create %s: %s\n", path, strerror(errno));
+    return;
+  }
+  fprintf(file, "{\"pid\": %d, \"algorithm\": %d, \"strategy\": \"%s\", \"dropped_threads\": %d,\n",
+          (int)getpid(), algorithm_ID(), current_strategy()->name, g_overhead_dropped);
+  fprintf(file, " \"threads\": [");
+  for (int i = 0; i < record_count; i++) {
+    struct overhead_record *record = &g_overhead_records[i];
+    fprintf(file, "%s\n  {\"thread\": %d, \"tid\": %ld", i == 0 ? "" : ",",
+            record->thread_number, record->thread_id);
+    for (int kind = 0; kind < OVERHEAD_KINDS; kind++) {
+      fprintf(file, ", \"%s_ns\": %lu", g_overhead_kind_names[kind], record->ns[kind]);
+    }
+    fprintf(file, "}");
+  }
+  fprintf(file, "],\n \"wrappers\": [");
+  bool first = true;
+  for (int i = 0; i < REAL_SYMBOL_COUNT; i++) {
+    if (g_wrapper_calls[i] == 0) {
+      continue;
+    }
+    fprintf(file, "%s\n  {\"function\": \"%s\", \"calls\": %lu, \"ns\": %lu}", first ? "" : ",",
+            g_real_symbol_names[i], g_wrapper_calls[i], g_wrapper_ns[i]);
+    first = false;
+  }
+  fprintf(file, "]}\n");
+  fclose(file);
+}
+
+// Prints one row of the table in ms, first the total and the time testlib added, all
+// kinds but user and original.
+// The caller must hold g_print_lock.
+void print_overhead_row(const char *label, const uint64_t *ns) {
+  uint64_t total = 0;
+  for (int kind = 0; kind < OVERHEAD_KINDS; kind++) {
+    total += ns[kind];
+  }
+  INFO("OVERHEAD: %-18s %10.3f %10.3f", label, total / 1e6,
+       (total - ns[OVERHEAD_USER] - ns[OVERHEAD_ORIGINAL]) / 1e6);
+  for (int kind = 0; kind < OVERHEAD_KINDS; kind++) {
+    INFO(" %10.3f", ns[kind] / 1e6);
+  }
+  INFO("\n");
+}
+
+// Called by fini_testlib(), threads still running are reported up to their last switch
+void report_overhead() {
+  if (!g_overhead) {
+    return;
+  }
+  // Charge the calling thread up to now, the report itself is left out
+  overhead_enter(t_overhead_kind);
+  int record_count = g_overhead_record_count < MAX_OVERHEAD_THREADS ?
+                     g_overhead_record_count : MAX_OVERHEAD_THREADS;
+
+  sem_wait(&g_print_lock);
+  INFO("OVERHEAD: %-18s %10s %10s", "thread (ms)", "total", "testlib");
+  for (int kind = 0; kind < OVERHEAD_KINDS; kind++) {
+    INFO(" %10s", g_overhead_kind_names[kind]);
+  }
+  INFO("\n");
+  uint64_t sums[OVERHEAD_KINDS] = { 0 };
+  for (int i = 0; i < record_count; i++) {
+    struct overhead_record *record = &g_overhead_records[i];
+    char label[32];
+    snprintf(label, sizeof(label), "(%d, %ld)", record->thread_number, record->thread_id);
+    print_overhead_row(label, record->ns);
+    for (int kind = 0; kind < OVERHEAD_KINDS; kind++) {
+      sums[kind] += record->ns[kind];
+    }
+  }
+  print_overhead_row("all threads", sums);
+  if (g_overhead_dropped > 0) {
+    INFO("OVERHEAD: %d threads not accounted\n", g_overhead_dropped);
+  }
+
+  INFO("OVERHEAD: %-28s %10s %10s %10s\n", "wrapper", "calls", "total ms", "us/call");
+  for (int i = 0; i < REAL_SYMBOL_COUNT; i++) {
+    if (g_wrapper_calls[i] == 0) {
+      continue;
+    }
+    INFO("OVERHEAD: %-28s %10lu %10.3f %10.2f\n", g_real_symbol_names[i], g_wrapper_calls[i],
+         g_wrapper_ns[i] / 1e6, g_wrapper_ns[i] / 1e3 / g_wrapper_calls[i]);
+  }
+  write_overhead_file(record_count);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+}
 
 ////////////////////////////////////////////////////
 ///////////////////// HELPERS //////////////////////
 ////////////////////////////////////////////////////
 
+int internal_sem_wait(sem_t *sem) {
+  sem_wait_type orig_sem_wait;
+  orig_sem_wait = (sem_wait_type)real_symbol(REAL_sem_wait);
+  if (sem == &g_print_lock) {
+    overhead_print_lock(true);
+  }
+  return orig_sem_wait(sem);
+}
+
+int internal_sem_post(sem_t *sem) {
+  sem_post_type orig_sem_post;
+  orig_sem_post = (sem_post_type)real_symbol(REAL_sem_post);
+  if (sem == &g_print_lock) {
+    overhead_print_lock(false);
+  }
+  return orig_sem_post(sem);
+}
+
+int internal_sem_trywait(sem_t *sem) {
+  sem_trywait_type orig_sem_trywait;
+  orig_sem_trywait = (sem_trywait_type)real_symbol(REAL_sem_trywait);
+  return orig_sem_trywait(sem);
+}
+
+int internal_sem_timedwait(sem_t *sem, const struct timespec *abstime) {
+  sem_timedwait_type orig_sem_timedwait;
+  orig_sem_timedwait = (sem_timedwait_type)real_symbol(REAL_sem_timedwait);
+  return orig_sem_timedwait(sem, abstime);
+}
+
+#ifndef TESTLIB_ALGORITHM
+// -1 until the first call read ALGORITHM
+int g_algorithm_ID = -1;
+
+int algorithm_ID() {
+  int algorithm = __atomic_load_n(&g_algorithm_ID, __ATOMIC_RELAXED);
+  if (algorithm == -1) {
+    // Loaded strategies run on the PCT model
+    algorithm = getenv("STRATEGY") != NULL ? kAlgorithmPCT : get_algorithm_ID();
+    __atomic_store_n(&g_algorithm_ID, algorithm, __ATOMIC_RELAXED);
+  }
+  return algorithm;
+}
+#endif
+
+#ifndef TESTLIB_STACKTRACES
+// -1 until the first call read STACKTRACES
+int g_stacktraces = -1;
+
+int stacktraces_enabled() {
+  int stacktraces = __atomic_load_n(&g_stacktraces, __ATOMIC_RELAXED);
+  if (stacktraces == -1) {
+    stacktraces = get_stacktraces();
+    __atomic_store_n(&g_stacktraces, stacktraces, __ATOMIC_RELAXED);
+  }
+  return stacktraces;
+}
+#endif
+
+// Whether return_address is inside testlib.so. libunwind is linked in and calls
+// intercepted functions like pthread_once while testlib.so holds its own locks.
+bool called_from_testlib(void *return_address) {
+  Dl_info self;
+  Dl_info caller;
+  if (dladdr((void *)called_from_testlib, &self) == 0 ||
+      dladdr(return_address, &caller) == 0) {
+    return false;
+  }
+  return self.dli_fbase == caller.dli_fbase;
+}
+
 // Used to find the thread's thread number (assigned via g_thread_count)
 int find_thread_number(long int tid) {
   int thread_ids_size = sizeof(g_thread_ids) / sizeof(g_thread_ids[0]);
@@ -144,19 +769,159 @@ int find_thread_number(long int tid) {
   return -1;
 }
 
+// Forget the mutexes a previous user of the thread slot held or waited for
+void reset_thread_slot(int thread_index) {
+  memset(g_threads[thread_index].held_mutexes, 0, sizeof(g_threads[thread_index].held_mutexes));
+  g_threads[thread_index].wait_stack_depth = 0;
+  g_threads[thread_index].handle = 0;
+  g_threads[thread_index].detached = false;
+  g_threads[thread_index].join_target = -1;
+  g_threads[thread_index].timed_wait = false;
+  g_threads[thread_index].timed_out = false;
+  g_threads[thread_index].deadline = 0;
+  g_threads[thread_index].waiting_cond = NULL;
+  g_threads[thread_index].waiting_rwlock = NULL;
+  g_threads[thread_index].waiting_write = false;
+  g_threads[thread_index].waiting_object = NULL;
+  g_threads[thread_index].waiting_kind = NULL;
+  g_threads[thread_index].spin_count = 0;
+  g_threads[thread_index].demoted = false;
+  g_threads[thread_index].start_routine = NULL;
+  g_threads[thread_index].start_arg = NULL;
+  g_threads[thread_index].steps = 0;
+  g_threads[thread_index].waiting_mutex = NULL;
+  g_threads[thread_index].next_mutex_waiter = -1;
+}
+
+////////////////////////////////////////////////////
+////////////////////// ARENA ///////////////////////
+////////////////////////////////////////////////////
+
+// The state of testlib.so comes from one anonymous mapping instead of malloc, so
+// no intercepted function allocates. malloc may take pthread mutexes of its own,
+// which would come right back into this library. The mapping is reserved up front
+// and its pages are only backed once they are touched.
+#define ARENA_SIZE (64 << 20)
+#define ARENA_ALIGNMENT 64
+
+char *g_arena = NULL;
+size_t g_arena_used = 0;
+sem_t g_arena_lock;
+
+// arg_structs of exited threads, reused by the next pthread_create
+struct arg_struct *g_free_arg_structs = NULL;
+// arg_struct of the calling thread, released when it terminates
+__thread struct arg_struct *t_arg_struct = NULL;
+
+void init_arena() {
+  if (g_arena != NULL) {
+    return;
+  }
+  void *arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (arena == MAP_FAILED) {
+    INFO("Cannot map the testlib arena: %s\n", strerror(errno));
+    fflush(stdout);
+    exit(1);
+  }
+  sem_init(&g_arena_lock, 0, 1);
+  g_arena = arena;
+}
+
+// Returns zeroed memory that lives as long as the process. Called from the
+// constructors before any thread is created, and by pthread_create when no
+// arg_struct can be reused.
+void *arena_alloc(size_t size) {
+  // __tsan_init() of an instrumented program can run before init_testlib()
+  init_arena();
+
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  sem_wait(&g_arena_lock);
+  if (g_arena_used + size > ARENA_SIZE) {
+    sem_post(&g_arena_lock);
+    INFO("The testlib arena is exhausted\n");
+    fflush(stdout);
+    exit(1);
+  }
+  void *memory = g_arena + g_arena_used;
+  g_arena_used += size;
+  sem_post(&g_arena_lock);
+  return memory;
+}
+
+struct arg_struct *alloc_arg_struct() {
+  init_arena();
+  sem_wait(&g_arena_lock);
+  struct arg_struct *args = g_free_arg_structs;
+  if (args != NULL) {
+    g_free_arg_structs = args->next_free;
+  }
+  sem_post(&g_arena_lock);
+
+  if (args == NULL) {
+    return arena_alloc(sizeof(struct arg_struct));
+  }
+  memset(args, 0, sizeof(struct arg_struct));
+  return args;
+}
+
+void free_arg_struct(struct arg_struct *args) {
+  if (args == NULL) {
+    return;
+  }
+  sem_wait(&g_arena_lock);
+  args->next_free = g_free_arg_structs;
+  g_free_arg_structs = args;
+  sem_post(&g_arena_lock);
+}
+
+// Called by a thread that is about to exit, the thread slot itself is recycled by
+// PCT_thread_terminate()
+void release_thread_arg_struct() {
+  free_arg_struct(t_arg_struct);
+  t_arg_struct = NULL;
+  t_thread_finished = true;
+}
+
 ////////////////////////////////////////////////////
 //////////////////// STACKTRACE ////////////////////
 ////////////////////////////////////////////////////
 
 // String array of functions to omit from stack trace
-char omit_functions[4][25] = {
+char omit_functions[26][25] = {
   "interpose_start_routine",
   "omit",
   "stacktrace",
-  "find_thread_number"
+  "find_thread_number",
+  "capture_stacktrace",
+  "lock_graph_begin_wait",
+  "lock_order_check",
+  "PCT_thread_lock",
+  "PCT_thread_join",
+  "PCT_thread_cond_wait",
+  "PCT_cond_wait",
+  "PCT_thread_sleep",
+  "PCT_thread_rwlock",
+  "block_on_object",
+  "PCT_thread_sem_wait",
+  "PCT_thread_spin_lock",
+  "PCT_thread_barrier_wait",
+  "PCT_thread_once",
+  "once_trampoline",
+  "virtual_sleep",
+  "PCT",
+  "run_scheduling_algorithm",
+  "report_race",
+  "race_check_word",
+  "race_check_access",
+  "profile_lock_acquired"
 };
 
 bool omit(char * func) {
+  // The race detection entry points called by instrumented code
+  if (strncmp(func, "__tsan_", strlen("__tsan_")) == 0) {
+    return true;
+  }
   int arr_size = sizeof(omit_functions) / sizeof(omit_functions)[0];
   for (int i = 0; i < arr_size; i++) {
     if (strcmp((char *)func, (char *)omit_functions[i]) == 0) {
@@ -167,7 +932,9 @@ bool omit(char * func) {
 }
 
 void stacktrace() {
-  if (get_stacktraces()) {
+  if (stacktraces_enabled()) {
+    // Printing the frames is part of the walk, all of it is charged to stacks
+    int previous = overhead_enter(OVERHEAD_STACKS);
     unw_cursor_t cursor;
     unw_context_t context;
     
@@ -196,956 +963,5792 @@ void stacktrace() {
             fflush(stdout);
         }
     }
+    overhead_leave(previous);
   }
   STACKTRACE_THREAD_ID = -1;
 }
 
+// Saves the return addresses of the calling thread so they can be printed later,
+// possibly by another thread. Returns the number of frames saved.
+int capture_stacktrace(void **frames, int max_depth) {
+  sem_wait(&g_print_lock);
+  // libunwind locks mutexes internally, let them through to the original functions
+  STACKTRACE_THREAD_ID = gettid();
+  int previous = overhead_enter(OVERHEAD_STACKS);
+  int depth = unw_backtrace(frames, max_depth);
+  overhead_leave(previous);
+  STACKTRACE_THREAD_ID = -1;
+  sem_post(&g_print_lock);
+  return depth < 0 ? 0 : depth;
+}
+
+// Prints frames saved by capture_stacktrace() in the same format as stacktrace().
+// The caller must hold g_print_lock.
+void print_saved_stacktrace(void **frames, int depth) {
+  unw_accessors_t *accessors = unw_get_accessors(unw_local_addr_space);
+  INFO("Stacktrace: \n");
+  for (int i = 0; i < depth; i++) {
+    unw_word_t offset;
+    unw_word_t pc = (unw_word_t)frames[i];
+    char sym[256];
+    if (accessors->get_proc_name(unw_local_addr_space, pc, sym, sizeof(sym), &offset, NULL) == 0) {
+      if (!omit(sym)) {
+        INFO("  0x%lx: (%s+0x%lx)\n", pc, sym, offset);
+      }
+    } else {
+      INFO("  0x%lx: -- ERROR: unable to obtain symbol name for this frame\n", pc);
+    }
+  }
+  fflush(stdout);
+}
+
 ////////////////////////////////////////////////////
-//////////////////// PCT ///////////////////////////
+///////////////// MUTEX REGISTRY ///////////////////
 ////////////////////////////////////////////////////
 
-int find_highest_priority() {
-  sem_wait(&g_PCT_find_highest_priority_lock);
-
-  // Find the highest priority thread available to be active
-  int highest_priorty = -1;
-  int thread_index = -1;
+// Every mutex a tracked thread locked or waited for has an entry in an open addressing
+// table keyed by its address, with its owner and the threads waiting for it in FIFO
+// order, so neither needs a scan over all threads. pthread_mutex_destroy and
+// pthread_mutex_init leave a tombstone in the entry, which the next insertion on its
+// probe sequence reuses. The registry is protected by g_deadlock_lock.
+#define MUTEX_REGISTRY_SIZE 1024
+// A lookup gives up after this many slots, the callers then fall back to a scan
+#define MUTEX_REGISTRY_PROBES 32
+#define MUTEX_TOMBSTONE ((pthread_mutex_t *)1)
+// glibc keeps PTHREAD_MUTEX_NORMAL, _RECURSIVE or _ERRORCHECK in the low bits of __kind
+#define MUTEX_KIND_MASK 3
+
+struct mutex_entry {
+  // NULL if the entry is free, MUTEX_TOMBSTONE if its mutex was destroyed
+  pthread_mutex_t *mutex;
+  // Slot of the thread holding the mutex, -1 if it is free or held by an untracked thread
+  int owner;
+  // Times the owner locked it
+  int recursion;
+  // Slots of the first and last waiting thread, linked through next_mutex_waiter
+  int first_waiter;
+  int last_waiter;
+};
 
-  for (int i = 0; i < MAX_THREADS; i++) {
-    if ((g_threads[i].state == THREAD_RUNNABLE) && (get_priorities()[i] > highest_priorty)) {
-      thread_index = i;
-      highest_priorty = get_priorities()[thread_index];
-    } 
+sem_t g_deadlock_lock;
+struct mutex_entry g_mutex_registry[MUTEX_REGISTRY_SIZE];
+
+// Finds the entry of mutex, or inserts it if insert is set. NULL if it is not there,
+// or if all MUTEX_REGISTRY_PROBES slots are taken. The caller must hold g_deadlock_lock.
+struct mutex_entry *lookup_mutex_entry(pthread_mutex_t *mutex, bool insert) {
+  size_t slot = (((uintptr_t)mutex >> 3) * 0x9E3779B97F4A7C15ull >> 32) % MUTEX_REGISTRY_SIZE;
+  struct mutex_entry *free_entry = NULL;
+  for (int probe = 0; probe < MUTEX_REGISTRY_PROBES; probe++) {
+    struct mutex_entry *entry = &g_mutex_registry[(slot + probe) % MUTEX_REGISTRY_SIZE];
+    if (entry->mutex == mutex) {
+      return entry;
+    }
+    if (entry->mutex == MUTEX_TOMBSTONE && free_entry == NULL) {
+      free_entry = entry;
+    }
+    if (entry->mutex == NULL) {
+      if (free_entry == NULL) {
+        free_entry = entry;
+      }
+      break;
+    }
   }
-
-  sem_post(&g_PCT_find_highest_priority_lock);
-  return thread_index;
+  if (!insert || free_entry == NULL) {
+    return NULL;
+  }
+  free_entry->mutex = mutex;
+  free_entry->owner = -1;
+  free_entry->recursion = 0;
+  free_entry->first_waiter = -1;
+  free_entry->last_waiter = -1;
+  return free_entry;
 }
 
-void run_highest_priority() {
-  sem_wait(&g_PCT_run_highest_priority_lock);
+// Finds or inserts the entry of mutex. The caller must hold g_deadlock_lock.
+struct mutex_entry *find_mutex_entry(pthread_mutex_t *mutex) {
+  return lookup_mutex_entry(mutex, true);
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER run_highest_priority() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Tombstones the entry of mutex once it was destroyed or initialized again, unless
+// threads are still queued on it
+void forget_mutex(pthread_mutex_t *mutex) {
+  sem_wait(&g_deadlock_lock);
+  struct mutex_entry *entry = lookup_mutex_entry(mutex, false);
+  if (entry != NULL && entry->first_waiter == -1) {
+    entry->mutex = MUTEX_TOMBSTONE;
   }
+  sem_post(&g_deadlock_lock);
+}
 
-  // Mark the g_current_thread as stopped
-  sem_init(&(g_semaphores[g_current_thread]), 0, 0);
-  // Unblock the highest priority thread
-  g_current_thread = find_highest_priority();
-
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXIT run_highest_priority() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Queues the thread in slot thread_index on mutex. The caller must hold g_deadlock_lock.
+void mutex_add_waiter(int thread_index, pthread_mutex_t *mutex) {
+  struct thread_struct *thread = &g_threads[thread_index];
+  thread->waiting_mutex = mutex;
+  thread->next_mutex_waiter = -1;
+  struct mutex_entry *entry = find_mutex_entry(mutex);
+  if (entry == NULL) {
+    return;
+  }
+  if (entry->last_waiter == -1) {
+    entry->first_waiter = thread_index;
+  } else {
+    g_threads[entry->last_waiter].next_mutex_waiter = thread_index;
   }
+  entry->last_waiter = thread_index;
+}
 
-  if (g_runnable_threads > 0) {
-    if (DEBUG) {
-      sem_wait(&g_print_lock);
-      INFO("POSTING THREAD: %d\n",g_current_thread);
-      fflush(stdout);
-      sem_post(&g_print_lock);
+// Takes the thread in slot thread_index off the queue of the mutex it waits for.
+// The caller must hold g_deadlock_lock.
+void mutex_remove_waiter(int thread_index) {
+  struct thread_struct *thread = &g_threads[thread_index];
+  if (thread->waiting_mutex == NULL) {
+    return;
+  }
+  struct mutex_entry *entry = find_mutex_entry(thread->waiting_mutex);
+  thread->waiting_mutex = NULL;
+  if (entry == NULL) {
+    return;
+  }
+  int previous = -1;
+  for (int i = entry->first_waiter; i != -1; i = g_threads[i].next_mutex_waiter) {
+    if (i == thread_index) {
+      if (previous == -1) {
+        entry->first_waiter = thread->next_mutex_waiter;
+      } else {
+        g_threads[previous].next_mutex_waiter = thread->next_mutex_waiter;
+      }
+      if (entry->last_waiter == thread_index) {
+        entry->last_waiter = previous;
+      }
+      break;
     }
-    // Let PCT_thread_start() know that this thread can run
-    sem_post(&(g_semaphores[g_current_thread]));
+    previous = i;
   }
-  sem_post(&g_PCT_run_highest_priority_lock);
-  return;
+  thread->next_mutex_waiter = -1;
 }
 
-int find_next_available_thread() {
-  sem_wait(&g_PCT_find_next_available_thread);
+////////////////////////////////////////////////////
+/////////////// DEADLOCK DETECTION /////////////////
+////////////////////////////////////////////////////
 
-  // Find the highest priority thread available to be active
-  int highest_priorty = -1;
-  int thread_index = -1;
+// Wait-for graph: thread -> waiting_mutex of the thread -> owner of that mutex.
+// Edges are added right before a thread blocks, so the thread closing a cycle
+// finds it immediately and the run exits with DEADLOCK_EXIT_CODE instead of
+// hanging until the framework timeout.
 
-  for (int i = 0; i < MAX_THREADS; i++) {
-    if ((g_threads[i].state == THREAD_DEAD) && (get_priorities()[i] > highest_priorty)) {
-      thread_index = i;
-      highest_priorty = get_priorities()[i];
-    } 
+// Mutexes still held by threads that already exited, nobody can unlock them anymore
+struct orphaned_mutex {
+  pthread_mutex_t *mutex;
+  int thread_number;
+  long int thread_id;
+};
+struct orphaned_mutex g_orphaned_mutexes[MAX_THREADS];
+int g_orphaned_count = 0;
+
+// Returns the index into g_orphaned_mutexes, -1 if mutex is not orphaned.
+// The caller must hold g_deadlock_lock.
+int find_orphaned_mutex(pthread_mutex_t *mutex) {
+  for (int i = 0; i < g_orphaned_count; i++) {
+    if (g_orphaned_mutexes[i].mutex == mutex) {
+      return i;
+    }
   }
-
-  sem_post(&g_PCT_find_next_available_thread);
-  return thread_index;
+  return -1;
 }
 
-void PCT_init_main() {
-  sem_wait(&g_PCT_main_init_lock);
+// The caller must hold g_deadlock_lock
+void forget_orphaned_mutex(pthread_mutex_t *mutex) {
+  int orphan = find_orphaned_mutex(mutex);
+  if (orphan != -1) {
+    g_orphaned_mutexes[orphan] = g_orphaned_mutexes[--g_orphaned_count];
+  }
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_init_main() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Returns the index of the thread holding mutex, -1 if no tracked thread does.
+// The caller must hold g_deadlock_lock.
+int find_mutex_owner(pthread_mutex_t *mutex) {
+  if (mutex == NULL) {
+    return -1;
+  }
+  struct mutex_entry *entry = find_mutex_entry(mutex);
+  if (entry != NULL) {
+    return entry->owner;
+  }
+  // The registry is full, look through the mutexes the threads hold
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if (g_threads[i].state == THREAD_DEAD) {
+      continue;
+    }
+    for (int j = 0; j < MAX_HELD_MUTEXES; j++) {
+      if (g_threads[i].held_mutexes[j] == mutex) {
+        return i;
+      }
+    }
   }
+  return -1;
+}
 
-  // Randomly choose priority for the main thread per a piazza post -
-  // Therefore choosing thread index 0
-  int thread_index = 0;
-  // This is the thread_id for the main thread
-  g_threads[thread_index].thread_id = gettid();
-  g_threads[thread_index].state = THREAD_RUNNABLE;
-  g_threads[thread_index].thread_number = 0;
-  g_current_thread = thread_index;
+// Called after the calling thread acquired mutex
+void lock_graph_acquired(pthread_mutex_t *mutex) {
+  if (t_thread_index == -1) {
+    return;
+  }
+  sem_wait(&g_deadlock_lock);
+  forget_orphaned_mutex(mutex);
+  for (int j = 0; j < MAX_HELD_MUTEXES; j++) {
+    if (g_threads[t_thread_index].held_mutexes[j] == NULL) {
+      g_threads[t_thread_index].held_mutexes[j] = mutex;
+      break;
+    }
+  }
+  struct mutex_entry *entry = find_mutex_entry(mutex);
+  if (entry != NULL) {
+    if (entry->owner == t_thread_index) {
+      entry->recursion++;
+    } else {
+      entry->owner = t_thread_index;
+      entry->recursion = 1;
+    }
+  }
+  sem_post(&g_deadlock_lock);
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("POSTING thread: %d \n", g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Called before the calling thread releases mutex
+void lock_graph_released(pthread_mutex_t *mutex) {
+  if (t_thread_index == -1) {
+    return;
+  }
+  sem_wait(&g_deadlock_lock);
+  bool found = false;
+  for (int j = 0; j < MAX_HELD_MUTEXES && !found; j++) {
+    if (g_threads[t_thread_index].held_mutexes[j] == mutex) {
+      g_threads[t_thread_index].held_mutexes[j] = NULL;
+      found = true;
+    }
+  }
+  if (!found) {
+    forget_orphaned_mutex(mutex);
   }
+  struct mutex_entry *entry = find_mutex_entry(mutex);
+  if (found && entry != NULL && entry->owner == t_thread_index && --entry->recursion == 0) {
+    entry->owner = -1;
+  }
+  sem_post(&g_deadlock_lock);
+}
 
-  sem_post(&(g_semaphores[g_current_thread]));
-  // thread count = 0 per section 4.2 top of page 6
-  g_runnable_threads++;
+// Prints the threads in cycle, each waiting for a mutex held by the next one, and exits.
+// The caller must hold g_deadlock_lock.
+void report_deadlock(const char *reason, int *cycle, int cycle_length);
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_init_main() - g_runnable_threads = %d - g_current_thread = %d - priority = %d - proccess id = %ld - thread_number = %d\n", 
-         g_runnable_threads,
-         g_current_thread,
-         get_priorities()[g_current_thread],
-         g_threads[g_current_thread].thread_id,
-         g_threads[g_current_thread].thread_number);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Called when the calling thread terminates, whatever it still holds stays locked.
+// Threads already blocked on one of those mutexes can never get it, they are reported
+// here since check_wait_for_cycle() only runs when a wait starts.
+void lock_graph_thread_exit() {
+  if (t_thread_index == -1) {
+    return;
   }
-
-  sem_post(&g_PCT_main_init_lock);
-  return;
-}
-
-void PCT_thread_start() {
-  sem_wait(&g_PCT_thread_start_lock);
-
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_thread_start() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+  sem_wait(&g_deadlock_lock);
+  struct thread_struct *self = &g_threads[t_thread_index];
+  pthread_mutex_t *orphaned[MAX_HELD_MUTEXES];
+  int orphaned_count = 0;
+  for (int j = 0; j < MAX_HELD_MUTEXES; j++) {
+    if (self->held_mutexes[j] != NULL) {
+      orphaned[orphaned_count++] = self->held_mutexes[j];
+    }
+    if (self->held_mutexes[j] != NULL && g_orphaned_count < MAX_THREADS) {
+      g_orphaned_mutexes[g_orphaned_count].mutex = self->held_mutexes[j];
+      g_orphaned_mutexes[g_orphaned_count].thread_number = self->thread_number;
+      g_orphaned_mutexes[g_orphaned_count].thread_id = (long int)self->thread_id;
+      g_orphaned_count++;
+    }
+    if (self->held_mutexes[j] != NULL) {
+      struct mutex_entry *entry = find_mutex_entry(self->held_mutexes[j]);
+      if (entry != NULL && entry->owner == t_thread_index) {
+        entry->owner = -1;
+        entry->recursion = 0;
+      }
+    }
+    self->held_mutexes[j] = NULL;
   }
-
-  // Store the thread_id for the current thread for later use maybe in mutexes
-  g_threads[g_current_thread].thread_id = gettid();
-  // Wait until you are posted
-  sem_wait(&(g_semaphores[g_current_thread]));
-
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_thread_start() - g_runnable_threads = %d - new_thread = %d - priority = %d - proccess id = %ld - thread_number = %d\n", 
-         g_runnable_threads,
-         g_current_thread,
-         get_priorities()[g_current_thread],
-         g_threads[g_current_thread].thread_id,
-         g_threads[g_current_thread].thread_number);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+  for (int j = 0; j < orphaned_count; j++) {
+    struct mutex_entry *entry = find_mutex_entry(orphaned[j]);
+    if (entry != NULL && entry->first_waiter != -1) {
+      int cycle[1] = { entry->first_waiter };
+      report_deadlock("mutex held by a thread that exited", cycle, 1);
+    }
   }
-
-  sem_post(&g_PCT_thread_start_lock);
-  return;
+  sem_post(&g_deadlock_lock);
 }
 
-void PCT_thread_after_create() {
-  sem_wait(&g_PCT_thread_after_create_lock);
+// Removes the statistics page, see LIVE STATISTICS
+void fini_stats();
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_thread_after_create() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    INFO("POSTING thread: %d\n", g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+void report_deadlock(const char *reason, int *cycle, int cycle_length) {
+  sem_wait(&g_print_lock);
+  INFO("DEADLOCK DETECTED: %s\n", reason);
+  for (int i = 0; i < cycle_length; i++) {
+    struct thread_struct *thread = &g_threads[cycle[i]];
+    pthread_mutex_t *mutex = thread->waiting_mutex;
+    int owner = find_mutex_owner(mutex);
+    int orphan = find_orphaned_mutex(mutex);
+    if (thread->join_target != -1) {
+      INFO("THREAD (%d, %ld) joins THREAD (%d, %ld)\n",
+           thread->thread_number, (long int)thread->thread_id,
+           g_threads[thread->join_target].thread_number,
+           (long int)g_threads[thread->join_target].thread_id);
+    } else if (thread->waiting_cond != NULL) {
+      INFO("THREAD (%d, %ld) waits on condition variable %p\n",
+           thread->thread_number, (long int)thread->thread_id, thread->waiting_cond);
+    } else if (thread->waiting_object != NULL) {
+      INFO("THREAD (%d, %ld) waits on %s %p\n",
+           thread->thread_number, (long int)thread->thread_id,
+           thread->waiting_kind, thread->waiting_object);
+    } else if (thread->waiting_rwlock != NULL) {
+      INFO("THREAD (%d, %ld) waits to %s read-write lock %p\n",
+           thread->thread_number, (long int)thread->thread_id,
+           thread->waiting_write ? "write" : "read", thread->waiting_rwlock);
+    } else if (owner == -1 && orphan != -1) {
+      INFO("THREAD (%d, %ld) waits for %p held by exited THREAD (%d, %ld)\n",
+           thread->thread_number, (long int)thread->thread_id, mutex,
+           g_orphaned_mutexes[orphan].thread_number, g_orphaned_mutexes[orphan].thread_id);
+    } else if (owner == -1) {
+      INFO("THREAD (%d, %ld) waits for %p\n",
+           thread->thread_number, (long int)thread->thread_id, mutex);
+    } else {
+      INFO("THREAD (%d, %ld) waits for %p held by THREAD (%d, %ld)\n",
+           thread->thread_number, (long int)thread->thread_id, mutex,
+           g_threads[owner].thread_number, (long int)g_threads[owner].thread_id);
+    }
+    print_saved_stacktrace(thread->wait_stack, thread->wait_stack_depth);
   }
+  fflush(stdout);
+  fini_stats();
+  // The other threads of the cycle never return, don't wait for them
+  _exit(DEADLOCK_EXIT_CODE);
+}
 
-  // Unblock highest priority thread
-  g_current_thread = find_highest_priority();
-  sem_post(&(g_semaphores[g_current_thread]));
-  
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_thread_after_create() - g_runnable_threads = %d - new_thread = %d - priority = %d \n", 
-         g_runnable_threads, g_current_thread, get_priorities()[g_current_thread]);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Follows the wait-for edges starting at the mutex the calling thread waits for.
+// The caller must hold g_deadlock_lock.
+void check_wait_for_cycle() {
+  int cycle[MAX_THREADS];
+  int cycle_length = 0;
+  int thread = t_thread_index;
+
+  while (cycle_length < MAX_THREADS) {
+    cycle[cycle_length++] = thread;
+    pthread_mutex_t *mutex = g_threads[thread].waiting_mutex;
+    int owner = find_mutex_owner(mutex);
+    if (owner == -1) {
+      if (find_orphaned_mutex(mutex) != -1) {
+        report_deadlock("mutex held by a thread that exited", cycle, cycle_length);
+      }
+      return;
+    }
+    if (owner == t_thread_index) {
+      // Relocking an error checking mutex fails with EDEADLK instead of blocking
+      if (cycle_length == 1 &&
+          (mutex->__data.__kind & MUTEX_KIND_MASK) == PTHREAD_MUTEX_ERRORCHECK) {
+        return;
+      }
+      report_deadlock("lock cycle", cycle, cycle_length);
+    }
+    if (g_threads[owner].waiting_mutex == NULL) {
+      // The owner is not waiting, it will eventually release the mutex
+      return;
+    }
+    thread = owner;
   }
-
-  sem_post(&g_PCT_thread_after_create_lock);
-  return;
 }
 
-void PCT_thread_before_create() {
-  sem_wait(&g_PCT_thread_before_create_lock);
-
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_thread_before_create() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Called when mutex is taken, right before the calling thread blocks on it
+void lock_graph_begin_wait(pthread_mutex_t *mutex) {
+  if (t_thread_index == -1) {
+    return;
   }
+  struct thread_struct *self = &g_threads[t_thread_index];
+  self->wait_stack_depth = capture_stacktrace(self->wait_stack, MAX_STACK_DEPTH);
 
-  // Mark thread is runnable
-  // Find the priority for this thread - from highest priority where thread is not active yet (ie DEAD)
-  g_current_thread = find_next_available_thread();
-  g_threads[g_current_thread].state = THREAD_RUNNABLE;
-  g_threads[g_current_thread].thread_number = g_thread_count;
-  // the thread_id cannot be assigned until PCT_thread_start() when the thread has actually start
-  // PCT_thread_start is called indirectly from interpose start routine through run_algorithm()
-  g_runnable_threads++;
+  sem_wait(&g_deadlock_lock);
+  mutex_add_waiter(t_thread_index, mutex);
+  check_wait_for_cycle();
+  sem_post(&g_deadlock_lock);
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_thread_before_create() - g_runnable_threads = %d - g_current_thread = %d - priority = %d - thread_number = %d\n", 
-         g_runnable_threads,
-         g_current_thread,
-         get_priorities()[g_current_thread],
-         g_threads[g_current_thread].thread_number);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+void lock_graph_end_wait() {
+  if (t_thread_index == -1) {
+    return;
   }
-
-  sem_post(&g_PCT_thread_before_create_lock);
-  return;
+  sem_wait(&g_deadlock_lock);
+  mutex_remove_waiter(t_thread_index);
+  sem_post(&g_deadlock_lock);
 }
 
-void PCT_thread_terminate() {
-  sem_wait(&g_PCT_thread_terminate_lock);
-
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_thread_terminate() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// PCT assigns thread slots in PCT_thread_before_create(), the other algorithms
+// only need one so the deadlock detection can track the thread
+void register_thread(int thread_number) {
+  sem_wait(&g_general_lock);
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if (g_threads[i].state == THREAD_DEAD) {
+      reset_thread_slot(i);
+      g_threads[i].state = THREAD_RUNNABLE;
+      g_threads[i].thread_id = gettid();
+      g_threads[i].thread_number = thread_number;
+      t_thread_index = i;
+      break;
+    }
   }
+  sem_post(&g_general_lock);
+}
 
-  // pthread_exit - or termination of thread
-  // set g_current thread to be the next runnable thread
-  g_threads[g_current_thread].state = THREAD_DEAD;
-  g_threads[g_current_thread].thread_number = 0;
-  g_runnable_threads--;
-
-  run_highest_priority();
-
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_thread_terminate() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+void unregister_thread() {
+  if (t_thread_index == -1) {
+    return;
   }
-
-  sem_post(&g_PCT_thread_terminate_lock);
-  return;
+  lock_graph_thread_exit();
+  sem_wait(&g_general_lock);
+  g_threads[t_thread_index].state = THREAD_DEAD;
+  sem_post(&g_general_lock);
+  t_thread_index = -1;
 }
 
-void PCT_thread_yield() {
-  sem_wait(&g_PCT_thread_yield_lock);
+////////////////////////////////////////////////////
+//////////////////// LOCK ORDER ////////////////////
+////////////////////////////////////////////////////
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_thread_yield() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
-  }
+// Lockdep-style lock order graph: an edge A -> B means some thread locked B while
+// holding A. An edge closing a cycle means two threads can deadlock on those
+// mutexes even if this run did not interleave them that way. Cycles are reported
+// when they appear and the exit status is overridden at exit.
+struct lock_order_edge {
+  pthread_mutex_t *from;
+  pthread_mutex_t *to;
+  int thread_number;
+  long int thread_id;
+  // Stack of the pthread_mutex_lock call that locked 'to' while holding 'from'
+  void *stack[MAX_STACK_DEPTH];
+  int stack_depth;
+};
 
-  // Current thread is stopped - no threads should be running
-  // Find the highest priority thread that is not the current thread
-  int highest_priorty = -1;
-  int thread_index = -1;
+sem_t g_lock_order_lock;
+struct lock_order_edge g_lock_order_edges[MAX_LOCK_ORDER_EDGES];
+int g_lock_order_edge_count = 0;
+int g_lock_order_cycles = 0;
 
-  for (int i = 0; i < MAX_THREADS; i++) {
-    if ((g_threads[i].state == THREAD_RUNNABLE) &&
-        (get_priorities()[i] > highest_priorty) &&
-        (i != g_current_thread)) {
-      thread_index = i;
-      highest_priorty = get_priorities()[thread_index];
-    } 
+// The caller must hold g_lock_order_lock
+bool lock_order_edge_exists(pthread_mutex_t *from, pthread_mutex_t *to) {
+  for (int i = 0; i < g_lock_order_edge_count; i++) {
+    if (g_lock_order_edges[i].from == from && g_lock_order_edges[i].to == to) {
+      return true;
+    }
   }
+  return false;
+}
 
-  // Check that no other thread is able to run
-  if (thread_index != -1) {
-    // start the second highest thread
-    int old_thread = g_current_thread;
-    g_current_thread = thread_index;
-    sem_post(&(g_semaphores[g_current_thread]));
-    // suspend the old thread
-    sem_wait(&(g_semaphores[old_thread]));
+// Depth first search for a chain of edges leading from 'from' to 'to'. Stores the
+// edge indices in path and returns the chain length, 0 if there is no such chain.
+// The caller must hold g_lock_order_lock.
+int find_lock_order_path(pthread_mutex_t *from, pthread_mutex_t *to,
+                         int *path, int depth, bool *visited) {
+  for (int i = 0; i < g_lock_order_edge_count; i++) {
+    if (visited[i] || g_lock_order_edges[i].from != from) {
+      continue;
+    }
+    visited[i] = true;
+    path[depth] = i;
+    if (g_lock_order_edges[i].to == to) {
+      return depth + 1;
+    }
+    int length = find_lock_order_path(g_lock_order_edges[i].to, to, path, depth + 1, visited);
+    if (length > 0) {
+      return length;
+    }
   }
+  return 0;
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("g_current_thread = %d \n", g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// The caller must hold g_lock_order_lock
+void report_lock_order_cycle(int *cycle, int cycle_length) {
+  sem_wait(&g_print_lock);
+  INFO("POTENTIAL DEADLOCK: lock order cycle\n");
+  for (int i = 0; i < cycle_length; i++) {
+    struct lock_order_edge *edge = &g_lock_order_edges[cycle[i]];
+    INFO("THREAD (%d, %ld) locked %p while holding %p\n",
+         edge->thread_number, edge->thread_id, edge->to, edge->from);
+    print_saved_stacktrace(edge->stack, edge->stack_depth);
   }
+  fflush(stdout);
+  sem_post(&g_print_lock);
+  g_lock_order_cycles++;
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_thread_yield() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Called before the calling thread blocks on mutex, adds an edge from every mutex it
+// already holds. pthread_mutex_trylock never blocks, so it only adds the mutex to
+// the held set (through lock_graph_acquired) and never closes a cycle.
+void lock_order_check(pthread_mutex_t *mutex) {
+  if (t_thread_index == -1) {
+    return;
   }
+  struct thread_struct *self = &g_threads[t_thread_index];
+  bool stack_captured = false;
+
+  sem_wait(&g_lock_order_lock);
+  for (int j = 0; j < MAX_HELD_MUTEXES; j++) {
+    pthread_mutex_t *held = self->held_mutexes[j];
+    if (held == NULL || held == mutex || lock_order_edge_exists(held, mutex)) {
+      continue;
+    }
+    if (g_lock_order_edge_count == MAX_LOCK_ORDER_EDGES) {
+      // Graph is full, keep checking the edges we already know
+      break;
+    }
 
-  sem_post(&g_PCT_thread_yield_lock);
-  return;
+    struct lock_order_edge *edge = &g_lock_order_edges[g_lock_order_edge_count];
+    edge->from = held;
+    edge->to = mutex;
+    edge->thread_number = self->thread_number;
+    edge->thread_id = gettid();
+    if (!stack_captured) {
+      edge->stack_depth = capture_stacktrace(edge->stack, MAX_STACK_DEPTH);
+      stack_captured = true;
+    } else {
+      memcpy(edge->stack, g_lock_order_edges[g_lock_order_edge_count - 1].stack, sizeof(edge->stack));
+      edge->stack_depth = g_lock_order_edges[g_lock_order_edge_count - 1].stack_depth;
+    }
+    g_lock_order_edge_count++;
+
+    // A chain mutex -> ... -> held plus the new edge held -> mutex is a cycle
+    int cycle[MAX_LOCK_ORDER_EDGES];
+    bool visited[MAX_LOCK_ORDER_EDGES] = { false };
+    int cycle_length = find_lock_order_path(mutex, held, cycle, 1, visited);
+    if (cycle_length > 0) {
+      cycle[0] = g_lock_order_edge_count - 1;
+      report_lock_order_cycle(cycle, cycle_length);
+    }
+  }
+  sem_post(&g_lock_order_lock);
 }
 
-void PCT_thread_lock() {
-  sem_wait(&g_PCT_thread_lock_lock);
 
-  // pthread_mutex_trylock_type orig_mutex_trylock;
-  //orig_mutex_trylock = (pthread_mutex_trylock_type)dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+////////////////////////////////////////////////////
+////////////////// RACE DETECTION //////////////////
+////////////////////////////////////////////////////
 
-  // pthread_mutex_trylock_type orig_mutex_trylock;
-  //orig_mutex_trylock = (pthread_mutex_trylock_type)dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+// Runtime for programs compiled with -fsanitize=thread (see the tsan_tests target).
+// The compiler calls __tsan_read*/__tsan_write* before every memory access; testlib
+// checks them against a happens-before relation built from vector clocks, fed by
+// the thread and sync events the wrappers already intercept. Like ThreadSanitizer,
+// each 8 byte word remembers its last RACE_SHADOW_CELLS accesses. Memory touched by
+// uninstrumented code (libc, testlib itself) is not checked, and heap reuse after
+// free() is not tracked. Once the RACE_SHADOW_PROBES entries a word hashes to are
+// taken, one of them is handed over and the accesses it remembered are forgotten, as
+// a word of the direct-mapped shadow of ThreadSanitizer overwrites older accesses.
+struct race_access {
+  // Clock of the accessing thread at the time of the access, 0 for an empty cell
+  uint32_t clock;
+  uint8_t thread;
+  uint8_t offset;
+  uint8_t size;
+  bool is_write;
+  int thread_number;
+  long int thread_id;
+  void *frames[MAX_RACE_FRAMES];
+  int depth;
+};
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_thread_lock() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
-  }
-  // pthread_mutex_lock algorithm defined on page 9
-  if (pthread_mutex_trylock(g_current_mutex) == 0) {
-    // 1. Store the mutex object used by the pthread_mutex_lock function in a global array, but do not call the original
-    // pthread function at this point.
-    g_thread_mutexes[g_current_thread] = g_current_mutex;
-  
-    // 2. Identify which is the thread that should be allowed to run next.
-    g_threads[g_current_thread].state = THREAD_BLOCKED;
+struct race_shadow_word {
+  // 8 byte aligned address, 0 if the entry is free
+  uintptr_t address;
+  struct race_access cells[RACE_SHADOW_CELLS];
+};
 
-    // 4. Block the current thread using a per-thread testing semaphore (e.g., sem_wait).
-    sem_wait(&(g_semaphores[g_current_thread]));
+// Clock released by unlocks, signals and atomics on a sync object
+struct race_sync_object {
+  uintptr_t address;
+  uint32_t clock[MAX_THREADS];
+};
 
-    // 3. Unblock the thread that should run next (e.g., sem_post).
-    g_current_thread = find_highest_priority();
-    sem_post(&(g_semaphores[g_current_thread]));
-    
-    // 5. Call the original pthread_mutex_lock functions.
-    // completed in pthread_mutex_lock
-  }
+// Clock of a thread that terminated, picked up by pthread_join. A detached thread
+// records none, pthread_detach of a running thread leaves an entry with detached set
+// that the thread removes when it exits. glibc reuses the handle of a detached thread,
+// so an entry left behind would be joined in place of the new thread.
+struct race_exit_clock {
+  pthread_t thread;
+  bool used;
+  bool detached;
+  uint32_t clock[MAX_THREADS];
+};
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_thread_lock() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
-  }
+// NULL until the program calls __tsan_init(), which means it is not instrumented
+struct race_shadow_word *g_race_shadow = NULL;
+struct race_sync_object *g_race_sync_objects = NULL;
+struct race_exit_clock g_race_exit_clocks[MAX_THREADS];
+// g_race_clocks[i] is the vector clock of the thread in slot i
+uint32_t g_race_clocks[MAX_THREADS][MAX_THREADS];
+sem_t g_race_stripes[RACE_LOCK_STRIPES];
+sem_t g_race_sync_lock;
+sem_t g_race_report_lock;
+
+// Pairs of (previous, current) access pcs already reported
+void *g_race_reported[MAX_REPORTED_RACES][2];
+int g_races_reported = 0;
+
+// Return addresses pushed by __tsan_func_entry()
+__thread void *t_race_stack[MAX_SHADOW_STACK];
+__thread int t_race_stack_depth = 0;
+__thread unsigned int t_race_evict = 0;
+// Threads share a slot once its previous thread exited. Accesses of earlier threads
+// in the slot up to t_race_slot_base happen before this thread, clock values from
+// t_race_slot_start on are this thread's own.
+__thread uint32_t t_race_slot_base = 0;
+__thread uint32_t t_race_slot_start = 1;
+
+bool race_enabled() {
+  return g_race_shadow != NULL && t_thread_index != -1;
+}
 
-  sem_post(&g_PCT_thread_lock_lock);
-  return;
+size_t race_shadow_slot(uintptr_t address) {
+  return (address >> 3) * 0x9E3779B97F4A7C15ull >> 49;
 }
 
-void PCT_thread_unlock() {
-  sem_wait(&g_PCT_thread_unlock_lock);
+// Lock of the cells of a shadow entry, whichever word it currently holds
+sem_t *race_shadow_stripe(struct race_shadow_word *shadow) {
+  return &g_race_stripes[(shadow - g_race_shadow) % RACE_LOCK_STRIPES];
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_thread_unlock() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Finds or inserts the shadow entry of an 8 byte aligned address, NULL if all the
+// entries it may use hold other words
+struct race_shadow_word *race_find_shadow(uintptr_t address) {
+  size_t slot = race_shadow_slot(address);
+  for (int probe = 0; probe < RACE_SHADOW_PROBES; probe++) {
+    struct race_shadow_word *shadow = &g_race_shadow[(slot + probe) % RACE_SHADOW_WORDS];
+    uintptr_t current = __atomic_load_n(&shadow->address, __ATOMIC_ACQUIRE);
+    if (current == address) {
+      return shadow;
+    }
+    if (current == 0) {
+      uintptr_t expected = 0;
+      if (__atomic_compare_exchange_n(&shadow->address, &expected, address, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+          expected == address) {
+        return shadow;
+      }
+    }
   }
+  return NULL;
+}
 
-  // Remove the mutex from the g_thread_mutex array
-  if (g_thread_mutexes[g_current_thread] == g_current_mutex) {
-    g_thread_mutexes[g_current_thread] = NULL;
+// The caller must hold g_race_sync_lock
+struct race_sync_object *race_find_sync_object(void *address) {
+  size_t slot = ((uintptr_t)address >> 3) % RACE_SYNC_OBJECTS;
+  for (int probe = 0; probe < RACE_SYNC_OBJECTS; probe++) {
+    struct race_sync_object *sync = &g_race_sync_objects[(slot + probe) % RACE_SYNC_OBJECTS];
+    if (sync->address == (uintptr_t)address) {
+      return sync;
+    }
+    if (sync->address == 0) {
+      sync->address = (uintptr_t)address;
+      return sync;
+    }
   }
+  return NULL;
+}
 
-  // Unblock all threads that were locking on g_current_mutex
+void race_clock_join(uint32_t *into, const uint32_t *from) {
   for (int i = 0; i < MAX_THREADS; i++) {
-    if ((g_threads[i].state == THREAD_BLOCKED) &&
-        (g_thread_mutexes[i] == g_current_mutex)) {
-        g_thread_mutexes[i] = NULL;
-        g_threads[i].state = THREAD_RUNNABLE;
-    } 
+    if (from[i] > into[i]) {
+      into[i] = from[i];
+    }
   }
+}
 
-  // find the highest priority thread to run
-  run_highest_priority();
-
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_thread_unlock() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Everything recorded in clock happens before the calling thread's next access
+void race_acquire_clock(const uint32_t *from) {
+  race_clock_join(g_race_clocks[t_thread_index], from);
+  uint32_t slot_clock = from[t_thread_index];
+  if (slot_clock < t_race_slot_start && slot_clock > t_race_slot_base) {
+    t_race_slot_base = slot_clock;
   }
-
-  sem_post(&g_PCT_thread_unlock_lock);
-  return;
 }
 
-void PCT_thread_trylock() {
-  sem_wait(&g_PCT_thread_trylock_lock);
+// Everything the calling thread did so far happens before a later race_acquire(address)
+void race_release(void *address) {
+  if (!race_enabled()) {
+    return;
+  }
+  sem_wait(&g_race_sync_lock);
+  struct race_sync_object *sync = race_find_sync_object(address);
+  if (sync != NULL) {
+    race_clock_join(sync->clock, g_race_clocks[t_thread_index]);
+  }
+  sem_post(&g_race_sync_lock);
+  g_race_clocks[t_thread_index][t_thread_index]++;
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_thread_trylock() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+void race_acquire(void *address) {
+  if (!race_enabled()) {
+    return;
+  }
+  sem_wait(&g_race_sync_lock);
+  struct race_sync_object *sync = race_find_sync_object(address);
+  if (sync != NULL) {
+    race_acquire_clock(sync->clock);
   }
+  sem_post(&g_race_sync_lock);
+}
 
-  if (g_thread_mutexes[g_current_thread] == g_current_mutex) {
-    g_mutex_locked = 0;
-  } else {
-    g_mutex_locked = 1;
+// Called by the creator, the new thread starts with everything its creator did so far
+void race_thread_create(struct arg_struct *args, const pthread_attr_t *attr) {
+  if (!race_enabled()) {
+    return;
   }
+  memcpy(args->creator_clock, g_race_clocks[t_thread_index], sizeof(args->creator_clock));
+  g_race_clocks[t_thread_index][t_thread_index]++;
+  int detach_state = PTHREAD_CREATE_JOINABLE;
+  if (attr != NULL) {
+    pthread_attr_getdetachstate(attr, &detach_state);
+  }
+  args->detached = detach_state == PTHREAD_CREATE_DETACHED;
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_thread_trylock() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Stack of the calling thread, looked up when it starts because pthread_getattr_np()
+// allocates and exiting threads should not
+__thread uintptr_t t_race_stack_low = 0;
+__thread uintptr_t t_race_stack_high = 0;
+
+void race_record_stack() {
+  pthread_self_type orig_self;
+  orig_self = (pthread_self_type)real_symbol(REAL_pthread_self);
+  pthread_getattr_np_type orig_getattr;
+  orig_getattr = (pthread_getattr_np_type)real_symbol(REAL_pthread_getattr_np);
+  pthread_attr_t attr;
+  void *stack_address;
+  size_t stack_size;
+  if (orig_getattr(orig_self(), &attr) != 0) {
+    return;
   }
+  pthread_attr_getstack(&attr, &stack_address, &stack_size);
+  pthread_attr_destroy(&attr);
 
-  sem_post(&g_PCT_thread_trylock_lock);
-  return;
+  t_race_stack_low = (uintptr_t)stack_address;
+  t_race_stack_high = t_race_stack_low + stack_size;
 }
 
-void PCT_thread_trylock() {
-  sem_t PCT_lock;
-  sem_init(&PCT_lock, 0, 1);
-  sem_wait(&PCT_lock);
+// Whether the calling thread was created detached
+__thread bool t_race_detached = false;
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER PCT_thread_trylock() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// The caller must hold g_race_sync_lock
+struct race_exit_clock *race_find_exit_clock(pthread_t thread) {
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if (g_race_exit_clocks[i].used && pthread_equal(g_race_exit_clocks[i].thread, thread)) {
+      return &g_race_exit_clocks[i];
+    }
   }
+  return NULL;
+}
 
-  if (g_thread_mutexes[g_current_thread] == g_current_mutex) {
-    g_mutex_locked = 0;
-  } else {
-    g_mutex_locked = 1;
+// Called by the new thread once it has its slot
+void race_thread_start(struct arg_struct *args) {
+  t_race_stack_depth = 0;
+  if (!race_enabled()) {
+    return;
   }
+  t_race_detached = args->detached;
+  // The thread cannot have exited yet, a clock under its handle belongs to an earlier
+  // thread nobody joined. A detached entry may already be its own.
+  pthread_t self = pthread_self();
+  sem_wait(&g_race_sync_lock);
+  struct race_exit_clock *stale = race_find_exit_clock(self);
+  if (stale != NULL && !stale->detached) {
+    stale->used = false;
+  }
+  sem_post(&g_race_sync_lock);
+  uint32_t *clock = g_race_clocks[t_thread_index];
+  // A reused slot keeps counting up so accesses of its previous thread stay distinguishable
+  uint32_t own = clock[t_thread_index];
+  t_race_slot_base = args->creator_clock[t_thread_index];
+  memcpy(clock, args->creator_clock, sizeof(args->creator_clock));
+  clock[t_thread_index] = (own > clock[t_thread_index] ? own : clock[t_thread_index]) + 1;
+  t_race_slot_start = clock[t_thread_index];
+  race_record_stack();
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("EXITING PCT_thread_trylock() - g_runnable_threads = %d - g_current_thread = %d \n", 
-         g_runnable_threads, g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Drops the shadow of the exiting thread's stack, the next thread reusing it did not race with it
+void race_forget_stack() {
+  if (t_race_stack_high == 0) {
+    // main and threads that started before race detection was enabled
+    race_record_stack();
+  }
+  uintptr_t low = t_race_stack_low;
+  uintptr_t high = t_race_stack_high;
+  for (int i = 0; i < RACE_SHADOW_WORDS; i++) {
+    struct race_shadow_word *shadow = &g_race_shadow[i];
+    uintptr_t address = __atomic_load_n(&shadow->address, __ATOMIC_ACQUIRE);
+    if (address >= low && address < high) {
+      sem_t *stripe = race_shadow_stripe(shadow);
+      sem_wait(stripe);
+      // The entry may have been handed to another word meanwhile
+      if (__atomic_load_n(&shadow->address, __ATOMIC_ACQUIRE) == address) {
+        memset(shadow->cells, 0, sizeof(shadow->cells));
+      }
+      sem_post(stripe);
+    }
   }
+}
 
-  sem_post(&PCT_lock);
-  return;
+void race_thread_exit() {
+  if (!race_enabled()) {
+    return;
+  }
+  race_forget_stack();
+  pthread_t self = pthread_self();
+  sem_wait(&g_race_sync_lock);
+  struct race_exit_clock *detached = race_find_exit_clock(self);
+  if (detached != NULL) {
+    // Detached while it was running, nobody joins it
+    detached->used = false;
+  } else if (!t_race_detached) {
+    for (int i = 0; i < MAX_THREADS; i++) {
+      if (!g_race_exit_clocks[i].used) {
+        g_race_exit_clocks[i].used = true;
+        g_race_exit_clocks[i].detached = false;
+        g_race_exit_clocks[i].thread = self;
+        memcpy(g_race_exit_clocks[i].clock, g_race_clocks[t_thread_index],
+               sizeof(g_race_exit_clocks[i].clock));
+        break;
+      }
+    }
+  }
+  sem_post(&g_race_sync_lock);
 }
 
-void PCT(int pct_thread_state) {
-  sem_wait(&g_PCT_main_lock);
+// Called after pthread_detach succeeded, thread will never be joined
+void race_thread_detach(pthread_t thread) {
+  if (!race_enabled()) {
+    return;
+  }
+  sem_wait(&g_race_sync_lock);
+  struct race_exit_clock *exited = race_find_exit_clock(thread);
+  if (exited != NULL) {
+    // The thread already exited, its handle may be reused right away
+    exited->used = false;
+  } else {
+    for (int i = 0; i < MAX_THREADS; i++) {
+      if (!g_race_exit_clocks[i].used) {
+        g_race_exit_clocks[i].used = true;
+        g_race_exit_clocks[i].detached = true;
+        g_race_exit_clocks[i].thread = thread;
+        break;
+      }
+    }
+  }
+  sem_post(&g_race_sync_lock);
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("======================================================\n");
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Called after pthread_join returned, everything thread did happens before now
+void race_thread_join(pthread_t thread) {
+  if (!race_enabled()) {
+    return;
   }
+  sem_wait(&g_race_sync_lock);
+  struct race_exit_clock *exited = race_find_exit_clock(thread);
+  if (exited != NULL && !exited->detached) {
+    race_acquire_clock(exited->clock);
+    exited->used = false;
+  }
+  sem_post(&g_race_sync_lock);
+}
 
-  if (pct_thread_state == PCT_INIT_MAIN) {
-    // Create thread for main and give it a random priority
-    PCT_init_main();
-  } else if (pct_thread_state == PCT_THREAD_BEFORE_CREATE) {
-    // Call before orig_pthread_create 
-    PCT_thread_before_create();
-  } else if (pct_thread_state == PCT_THREAD_AFTER_CREATE) {
-    // Call after orig_pthread_create 
-    PCT_thread_after_create();
-  } else if (pct_thread_state == PCT_THREAD_START) {
-    // Call when interpose start routine begins
-    PCT_thread_start();
-  } else if (pct_thread_state == PCT_THREAD_TERMINATE) {
-    // Called when thread terminates or exit has been called
-    PCT_thread_terminate();
-  } else if (pct_thread_state == PCT_THREAD_YIELD) {
-    // Called when pthread_yield is called
-    PCT_thread_yield();
-  } else if (pct_thread_state == PCT_THREAD_LOCK) {
-    // Called when pthread_mutex_lock is called
-    PCT_thread_lock();
-  } else if (pct_thread_state == PCT_THREAD_UNLOCK) {
-    // Called when pthread_mutex_unlock is called
-    PCT_thread_unlock();
-  } else if (pct_thread_state == PCT_THREAD_TRY_LOCK) {
-    // Called when pthread_mutex_unlock is called
-    PCT_thread_trylock();
-  }
-  else {
-    if (DEBUG) {
-      sem_wait(&g_print_lock);
-      INFO("PCT_DO_NOTHING\n");
-      fflush(stdout);
-      sem_post(&g_print_lock);
+void report_race(void *address, struct race_access *previous, struct race_access *current) {
+  sem_wait(&g_race_report_lock);
+  for (int i = 0; i < g_races_reported && i < MAX_REPORTED_RACES; i++) {
+    if (g_race_reported[i][0] == previous->frames[0] && g_race_reported[i][1] == current->frames[0]) {
+      sem_post(&g_race_report_lock);
+      return;
     }
   }
-  // else if pct_thread_state == PCT_THREAD_DO_NOTHING
+  if (g_races_reported < MAX_REPORTED_RACES) {
+    g_race_reported[g_races_reported][0] = previous->frames[0];
+    g_race_reported[g_races_reported][1] = current->frames[0];
+  }
+  g_races_reported++;
+  sem_post(&g_race_report_lock);
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("======================================================\n");
-    fflush(stdout);
-    sem_post(&g_print_lock);
+  void *frames[MAX_STACK_DEPTH];
+  int depth = capture_stacktrace(frames, MAX_STACK_DEPTH);
+
+  sem_wait(&g_print_lock);
+  INFO("DATA RACE on %p\n", address);
+  INFO("THREAD (%d, %ld) %s of size %d\n", current->thread_number, current->thread_id,
+       current->is_write ? "write" : "read", current->size);
+  print_saved_stacktrace(frames, depth);
+  INFO("Previous %s of size %d by THREAD (%d, %ld)\n", previous->is_write ? "write" : "read",
+       previous->size, previous->thread_number, previous->thread_id);
+  print_saved_stacktrace(previous->frames, previous->depth);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+}
+
+void race_check_word(uintptr_t word, int offset, int size, bool is_write, void *pc) {
+  struct race_shadow_word *shadow = race_find_shadow(word);
+  bool evict = shadow == NULL;
+  if (evict) {
+    // Every entry of the probe holds another word, take over one of them in turn
+    size_t slot = race_shadow_slot(word) + t_race_evict++ % RACE_SHADOW_PROBES;
+    shadow = &g_race_shadow[slot % RACE_SHADOW_WORDS];
+  }
+  uint32_t *clock = g_race_clocks[t_thread_index];
+
+  struct race_access current;
+  current.clock = clock[t_thread_index];
+  current.thread = t_thread_index;
+  current.offset = offset;
+  current.size = size;
+  current.is_write = is_write;
+  current.thread_number = g_threads[t_thread_index].thread_number;
+  current.thread_id = (long int)g_threads[t_thread_index].thread_id;
+  current.frames[0] = pc;
+  current.depth = 1;
+  for (int i = t_race_stack_depth - 1; i >= 0 && current.depth < MAX_RACE_FRAMES; i--) {
+    if (i < MAX_SHADOW_STACK) {
+      current.frames[current.depth++] = t_race_stack[i];
+    }
   }
 
-  sem_post(&g_PCT_main_lock);
-  return;
+  bool racy = false;
+  struct race_access previous;
+  int replace = -1;
+
+  sem_t *stripe = race_shadow_stripe(shadow);
+  sem_wait(stripe);
+  if (evict) {
+    memset(shadow->cells, 0, sizeof(shadow->cells));
+    __atomic_store_n(&shadow->address, word, __ATOMIC_RELEASE);
+  } else if (__atomic_load_n(&shadow->address, __ATOMIC_ACQUIRE) != word) {
+    // Another thread took the entry over since the lookup, this access is not checked
+    sem_post(stripe);
+    return;
+  }
+  for (int i = 0; i < RACE_SHADOW_CELLS; i++) {
+    struct race_access *cell = &shadow->cells[i];
+    if (cell->clock == 0) {
+      if (replace == -1) {
+        replace = i;
+      }
+      continue;
+    }
+    bool overlap = cell->offset < offset + size && offset < cell->offset + cell->size;
+    bool same_slot = cell->thread == t_thread_index;
+    if (same_slot && cell->thread_id == current.thread_id) {
+      // A write of ours must not be replaced by a later read, others may still race with it
+      if (cell->offset == offset && cell->size == size && (is_write || !cell->is_write)) {
+        replace = i;
+      }
+      continue;
+    }
+    if (!overlap || (!cell->is_write && !is_write)) {
+      continue;
+    }
+    uint32_t known = same_slot ? t_race_slot_base : clock[cell->thread];
+    if (cell->clock > known && !racy) {
+      // The other access does not happen before this one
+      racy = true;
+      previous = *cell;
+    }
+  }
+  if (replace == -1) {
+    replace = t_race_evict++ % RACE_SHADOW_CELLS;
+  }
+  shadow->cells[replace] = current;
+  sem_post(stripe);
+
+  if (racy) {
+    report_race((void *)(word + offset), &previous, &current);
+  }
+}
+
+void race_check_access(void *address, int size, bool is_write, void *pc) {
+  if (!race_enabled()) {
+    return;
+  }
+  uintptr_t current = (uintptr_t)address;
+  // An unaligned access can straddle two words
+  while (size > 0) {
+    int offset = current & 7;
+    int length = size < 8 - offset ? size : 8 - offset;
+    race_check_word(current & ~(uintptr_t)7, offset, length, is_write, pc);
+    current += length;
+    size -= length;
+  }
+}
+
+// ThreadSanitizer instrumentation ABI
+
+void __tsan_init() {
+  // Without the wrappers testlib-none.so would see none of the synchronization
+  if (g_race_shadow != NULL || fixed_algorithm_none()) {
+    return;
+  }
+  for (int i = 0; i < RACE_LOCK_STRIPES; i++) {
+    sem_init(&g_race_stripes[i], 0, 1);
+  }
+  sem_init(&g_race_sync_lock, 0, 1);
+  sem_init(&g_race_report_lock, 0, 1);
+  for (int i = 0; i < MAX_THREADS; i++) {
+    g_race_clocks[i][i] = 1;
+  }
+  g_race_sync_objects = arena_alloc(RACE_SYNC_OBJECTS * sizeof(struct race_sync_object));
+  g_race_shadow = arena_alloc(RACE_SHADOW_WORDS * sizeof(struct race_shadow_word));
+}
+
+void __tsan_func_entry(void *pc) {
+  if (t_race_stack_depth < MAX_SHADOW_STACK) {
+    t_race_stack[t_race_stack_depth] = pc;
+  }
+  t_race_stack_depth++;
+}
+
+void __tsan_func_exit() {
+  if (t_race_stack_depth > 0) {
+    t_race_stack_depth--;
+  }
+}
+
+#define TSAN_ACCESS(size) \
+  void __tsan_read##size(void *address) { \
+    race_check_access(address, size, false, __builtin_return_address(0)); \
+  } \
+  void __tsan_write##size(void *address) { \
+    race_check_access(address, size, true, __builtin_return_address(0)); \
+  } \
+  void __tsan_unaligned_read##size(void *address) { \
+    race_check_access(address, size, false, __builtin_return_address(0)); \
+  } \
+  void __tsan_unaligned_write##size(void *address) { \
+    race_check_access(address, size, true, __builtin_return_address(0)); \
+  } \
+  void __tsan_volatile_read##size(void *address) { \
+    race_check_access(address, size, false, __builtin_return_address(0)); \
+  } \
+  void __tsan_volatile_write##size(void *address) { \
+    race_check_access(address, size, true, __builtin_return_address(0)); \
+  }
+
+TSAN_ACCESS(1)
+TSAN_ACCESS(2)
+TSAN_ACCESS(4)
+TSAN_ACCESS(8)
+TSAN_ACCESS(16)
+
+void __tsan_read_range(void *address, unsigned long size) {
+  race_check_access(address, size, false, __builtin_return_address(0));
+}
+
+void __tsan_write_range(void *address, unsigned long size) {
+  race_check_access(address, size, true, __builtin_return_address(0));
+}
+
+void __tsan_vptr_read(void **vptr) {
+  race_check_access(vptr, sizeof(void *), false, __builtin_return_address(0));
+}
+
+void __tsan_vptr_update(void **vptr, void *new_value) {
+  if (*vptr != new_value) {
+    race_check_access(vptr, sizeof(void *), true, __builtin_return_address(0));
+  }
+}
+
+// Atomics are sync objects: a store with release semantics publishes the clock
+// of the thread, a load with acquire semantics picks it up. They run under
+// g_race_sync_lock so the clock and the value change together.
+#define TSAN_MO_ACQUIRE(mo) ((mo) == __ATOMIC_CONSUME || (mo) == __ATOMIC_ACQUIRE || \
+                             (mo) == __ATOMIC_ACQ_REL || (mo) == __ATOMIC_SEQ_CST)
+#define TSAN_MO_RELEASE(mo) ((mo) == __ATOMIC_RELEASE || (mo) == __ATOMIC_ACQ_REL || \
+                             (mo) == __ATOMIC_SEQ_CST)
+
+void race_atomic_begin(const volatile void *address, int mo, bool is_write) {
+  if (!race_enabled()) {
+    return;
+  }
+  sem_wait(&g_race_sync_lock);
+  struct race_sync_object *sync = race_find_sync_object((void *)address);
+  if (sync == NULL) {
+    return;
+  }
+  if (TSAN_MO_ACQUIRE(mo)) {
+    race_acquire_clock(sync->clock);
+  }
+  if (is_write && TSAN_MO_RELEASE(mo)) {
+    race_clock_join(sync->clock, g_race_clocks[t_thread_index]);
+  }
+}
+
+void race_atomic_end(int mo, bool is_write) {
+  if (!race_enabled()) {
+    return;
+  }
+  sem_post(&g_race_sync_lock);
+  if (is_write && TSAN_MO_RELEASE(mo)) {
+    g_race_clocks[t_thread_index][t_thread_index]++;
+  }
+}
+
+#define TSAN_ATOMIC_RMW(bits, type, name, builtin) \
+  type __tsan_atomic##bits##_##name(volatile type *a, type v, int mo) { \
+    race_atomic_begin(a, mo, true); \
+    type old = builtin(a, v, __ATOMIC_SEQ_CST); \
+    race_atomic_end(mo, true); \
+    return old; \
+  }
+
+#define TSAN_ATOMIC(bits, type) \
+  type __tsan_atomic##bits##_load(const volatile type *a, int mo) { \
+    race_atomic_begin(a, mo, false); \
+    type v = __atomic_load_n(a, __ATOMIC_SEQ_CST); \
+    race_atomic_end(mo, false); \
+    return v; \
+  } \
+  void __tsan_atomic##bits##_store(volatile type *a, type v, int mo) { \
+    race_atomic_begin(a, mo, true); \
+    __atomic_store_n(a, v, __ATOMIC_SEQ_CST); \
+    race_atomic_end(mo, true); \
+  } \
+  TSAN_ATOMIC_RMW(bits, type, exchange, __atomic_exchange_n) \
+  TSAN_ATOMIC_RMW(bits, type, fetch_add, __atomic_fetch_add) \
+  TSAN_ATOMIC_RMW(bits, type, fetch_sub, __atomic_fetch_sub) \
+  TSAN_ATOMIC_RMW(bits, type, fetch_and, __atomic_fetch_and) \
+  TSAN_ATOMIC_RMW(bits, type, fetch_or, __atomic_fetch_or) \
+  TSAN_ATOMIC_RMW(bits, type, fetch_xor, __atomic_fetch_xor) \
+  TSAN_ATOMIC_RMW(bits, type, fetch_nand, __atomic_fetch_nand) \
+  int __tsan_atomic##bits##_compare_exchange_strong(volatile type *a, type *c, type v, \
+                                                    int mo, int fail_mo) { \
+    race_atomic_begin(a, mo, true); \
+    int success = __atomic_compare_exchange_n(a, c, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+    race_atomic_end(mo, true); \
+    return success; \
+  } \
+  int __tsan_atomic##bits##_compare_exchange_weak(volatile type *a, type *c, type v, \
+                                                  int mo, int fail_mo) { \
+    return __tsan_atomic##bits##_compare_exchange_strong(a, c, v, mo, fail_mo); \
+  } \
+  type __tsan_atomic##bits##_compare_exchange_val(volatile type *a, type c, type v, \
+                                                  int mo, int fail_mo) { \
+    __tsan_atomic##bits##_compare_exchange_strong(a, &c, v, mo, fail_mo); \
+    return c; \
+  }
+
+TSAN_ATOMIC(8, uint8_t)
+TSAN_ATOMIC(16, uint16_t)
+TSAN_ATOMIC(32, uint32_t)
+TSAN_ATOMIC(64, uint64_t)
+
+void __tsan_atomic_thread_fence(int mo) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void __tsan_atomic_signal_fence(int mo) {
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
 }
 
 ////////////////////////////////////////////////////
-/////////////// SCHEDULING ALGORITHMS //////////////
+/////////////////// VIRTUAL TIME ///////////////////
 ////////////////////////////////////////////////////
 
-void run_scheduling_algorithm(int pct_thread_state) {
-  int algorithm = get_algorithm_ID();
-  if (algorithm == kAlgorithmRandom) {
-    // run random scheduling algorithm
-    rsleep();
+// With VIRTUAL_TIME=True, CLOCK_REALTIME and CLOCK_MONOTONIC show a virtual clock
+// that only moves when threads sleep or time out. Under PCT sleeping threads and
+// timed waiters are blocked with a deadline; the blocked slots with a deadline
+// form the timer queue, and once no thread is runnable the clock jumps to the
+// earliest deadline. The other algorithms run threads concurrently, so a sleep
+// there returns right away after moving the clock forward, and timed waits wait
+// for the real time left until their virtual deadline.
+
+// Every clock read moves the clock a little, so polling it always makes progress
+#define VIRTUAL_TIME_TICK_NS 1000
+#define NS_PER_SECOND 1000000000ull
+
+bool g_virtual_time = false;
+// Virtual nanoseconds since init_virtual_time()
+uint64_t g_virtual_elapsed = 0;
+// Real clocks at init_virtual_time(), the virtual clocks start from them
+uint64_t g_virtual_base_realtime = 0;
+uint64_t g_virtual_base_monotonic = 0;
+// Set while the random algorithm sleeps, those sleeps have to stay real
+__thread bool t_real_sleep = false;
+
+uint64_t timespec_to_ns(const struct timespec *time) {
+  return (uint64_t)time->tv_sec * NS_PER_SECOND + time->tv_nsec;
+}
+
+void ns_to_timespec(uint64_t ns, struct timespec *time) {
+  time->tv_sec = ns / NS_PER_SECOND;
+  time->tv_nsec = ns % NS_PER_SECOND;
+}
+
+uint64_t real_clock_ns(clockid_t clock) {
+  clock_gettime_type orig_clock_gettime;
+  orig_clock_gettime = (clock_gettime_type)real_symbol(REAL_clock_gettime);
+  struct timespec now;
+  orig_clock_gettime(clock, &now);
+  return timespec_to_ns(&now);
+}
+
+void init_virtual_time() {
+  char *virtual_time_var = getenv("VIRTUAL_TIME");
+  g_virtual_time = virtual_time_var != NULL && strcmp(virtual_time_var, "True") == 0;
+  g_virtual_base_realtime = real_clock_ns(CLOCK_REALTIME);
+  g_virtual_base_monotonic = real_clock_ns(CLOCK_MONOTONIC);
+}
+
+uint64_t virtual_now() {
+  return __atomic_load_n(&g_virtual_elapsed, __ATOMIC_ACQUIRE);
+}
+
+// The clock never goes back, concurrent sleepers move it to the latest wake up time
+void virtual_time_advance_to(uint64_t time) {
+  uint64_t now = virtual_now();
+  while (now < time &&
+         !__atomic_compare_exchange_n(&g_virtual_elapsed, &now, time, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+// Virtual time of an absolute CLOCK_REALTIME timeout, at least 1 since 0 means no deadline
+uint64_t virtual_deadline(const struct timespec *abstime) {
+  uint64_t time = timespec_to_ns(abstime);
+  if (time <= g_virtual_base_realtime) {
+    return 1;
+  }
+  return time - g_virtual_base_realtime;
+}
+
+// Deadline of a timed wait in the PCT model, 0 if virtual time is off
+uint64_t timed_wait_deadline(const struct timespec *abstime) {
+  return g_virtual_time ? virtual_deadline(abstime) : 0;
+}
+
+// Timeout for the original timed functions. Under virtual time it is a real
+// CLOCK_REALTIME timeout as far away as the virtual one, stored in real.
+const struct timespec *real_abstime(const struct timespec *abstime, struct timespec *real) {
+  if (!g_virtual_time) {
+    return abstime;
   }
-  else if (algorithm == kAlgorithmPCT) {
-    // run pct scheduling algorithm
-    PCT(pct_thread_state);
+  uint64_t deadline = virtual_deadline(abstime);
+  uint64_t now = virtual_now();
+  uint64_t left = deadline > now ? deadline - now : 0;
+  ns_to_timespec(real_clock_ns(CLOCK_REALTIME) + left, real);
+  return real;
+}
+
+// The original timed function gave up, the virtual clock catches up with its deadline
+void virtual_timeout_expired(const struct timespec *abstime) {
+  if (g_virtual_time) {
+    virtual_time_advance_to(virtual_deadline(abstime));
   }
-  // else algorithm = none, do nothing special
 }
 
 ////////////////////////////////////////////////////
+//////////////////// PCT ///////////////////////////
 ////////////////////////////////////////////////////
 
-// Thread Management
-void *interpose_start_routine(void *argument) {
-  // Deconstruct the struct into [ function to execute, arg ]
-  sem_wait(&g_general_lock);
-  struct arg_struct *arguments = argument;
-  void *(*start_routine) (void *) = arguments->struct_func;
-  void *arg = arguments->struct_arg;
-  // Tell which semaphore this thread should wait on
-  int thread_index = arguments->thread_index;
-  sem_post(&g_general_lock);
-  
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("ENTER interpose_start_routine() - thread_index = %d - thread_id = %ld - thread_number = %d - waiting on semaphore\n", 
-         thread_index, 
-         g_threads[thread_index].thread_id,
-         g_threads[thread_index].thread_number);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+// Only the thread at g_current_thread runs program code under PCT. A PCT_* handler
+// that hands the turn to another thread sets t_PCT_must_wait, and PCT() parks the
+// caller on its semaphore only after releasing g_PCT_main_lock. Parking while still
+// holding the PCT locks left no thread able to hand the turn back.
+__thread bool t_PCT_must_wait = false;
+
+// Slot PCT_thread_before_create() picked for the thread the calling thread creates, and
+// its handle once created, for PCT_thread_after_create(). Both are per thread so
+// pthread_create needs no lock besides g_PCT_main_lock to pass them on.
+__thread int t_new_thread_index = -1;
+__thread pthread_t t_new_thread_handle = 0;
+
+void report_PCT_deadlock() {
+  int blocked[MAX_THREADS];
+  int blocked_count = 0;
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if (g_threads[i].state == THREAD_BLOCKED) {
+      blocked[blocked_count++] = i;
+    }
   }
+  sem_wait(&g_deadlock_lock);
+  report_deadlock("no runnable thread", blocked, blocked_count);
+}
 
-  // Needs to tell pthread_start what semaphores to wait on
-  sem_wait(&g_general_lock);
-  g_current_thread = thread_index;
-  sem_post(&g_general_lock);
+////////////////////////////////////////////////////
+///////////////// LIVE STATISTICS //////////////////
+////////////////////////////////////////////////////
 
-  run_scheduling_algorithm(PCT_THREAD_START);
+// STATS=True maps a struct testlib_stats (stats.h) at /dev/shm/testlib-<pid> for
+// tools/testlib-top. g_stats stays NULL otherwise, so every counter below costs
+// one branch when it is off.
+struct testlib_stats *g_stats = NULL;
+char g_stats_path[64];
+
+// Reading the clock twice per decision would cost as much as the decision, so
+// only one decision in STATS_TIMING_INTERVAL is timed and scheduler_ns is scaled
+#define STATS_TIMING_INTERVAL 16
+
+// State of the scheduling point the calling thread is deciding in, and when PCT()
+// started deciding (0 if this decision is not timed)
+__thread int t_stats_state = -1;
+__thread uint64_t t_stats_decision_start = 0;
+__thread unsigned t_stats_decisions = 0;
+
+void stats_begin_decision(int state) {
+  t_stats_state = state;
+  t_stats_decision_start = t_stats_decisions++ % STATS_TIMING_INTERVAL == 0 ?
+                           real_clock_ns(CLOCK_MONOTONIC) : 0;
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("interpose_start_routine() - start_routine = %p - thread_number = %d\n",
-         start_routine,
-         g_threads[g_current_thread].thread_number);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+void stats_end_decision(int runnable, int blocked) {
+  __atomic_store_n(&g_stats->runnable_threads, runnable, __ATOMIC_RELAXED);
+  __atomic_store_n(&g_stats->blocked_threads, blocked, __ATOMIC_RELAXED);
+  if (t_stats_decision_start != 0) {
+    uint64_t elapsed = real_clock_ns(CLOCK_MONOTONIC) - t_stats_decision_start;
+    __atomic_fetch_add(&g_stats->scheduler_ns, elapsed * STATS_TIMING_INTERVAL,
+                       __ATOMIC_RELAXED);
+  }
+}
+
+void init_stats() {
+  char *stats_var = getenv("STATS");
+  if (stats_var == NULL || strcmp(stats_var, "True") != 0) {
+    return;
   }
 
-  sem_wait(&g_count_lock);
-  if (get_algorithm_ID() != kAlgorithmPCT) {
-    g_thread_count++;
+  snprintf(g_stats_path, sizeof(g_stats_path), TESTLIB_STATS_PATH, (int)getpid());
+  int fd = open(g_stats_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1 || ftruncate(fd, sizeof(struct testlib_stats)) != 0) {
+    INFO("Cannot create %s: %s\n", g_stats_path, strerror(errno));
+    fflush(stdout);
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+  void *page = mmap(NULL, sizeof(struct testlib_stats), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    INFO("Cannot map %s: %s\n", g_stats_path, strerror(errno));
+    fflush(stdout);
+    unlink(g_stats_path);
+    return;
   }
-  g_thread_ids[g_thread_count] = gettid();
-  sem_post(&g_count_lock);
 
-  sem_wait(&g_print_lock);
-  int thread_number;
-  if (get_algorithm_ID() == kAlgorithmPCT) {
-    thread_number = g_threads[g_current_thread].thread_number;
-  } else {
-    thread_number = find_thread_number(gettid());
+  struct testlib_stats *stats = page;
+  stats->pid = getpid();
+  stats->algorithm = algorithm_ID();
+  strncpy(stats->strategy, current_strategy()->name, TESTLIB_STATS_NAME_LENGTH - 1);
+  stats->start_ns = real_clock_ns(CLOCK_MONOTONIC);
+  stats->function_count = REAL_SYMBOL_COUNT;
+  for (int i = 0; i < REAL_SYMBOL_COUNT; i++) {
+    strncpy(stats->function_names[i], g_real_symbol_names[i], TESTLIB_STATS_NAME_LENGTH - 1);
   }
-  INFO("THREAD CREATED (%d, %ld)\n", thread_number, gettid());
+  stats->last_from = -1;
+  stats->last_to = -1;
+  // The reader checks the magic last, the page is complete once it is there
+  __atomic_store_n(&stats->magic, TESTLIB_STATS_MAGIC, __ATOMIC_RELEASE);
+  g_stats = stats;
+
+  INFO("Statistics in %s\n", g_stats_path);
   fflush(stdout);
+}
+
+// Called by fini_testlib(), a reader that still has the page mapped sees finished
+void fini_stats() {
+  if (g_stats == NULL) {
+    return;
+  }
+  __atomic_store_n(&g_stats->finished, 1, __ATOMIC_RELAXED);
+  unlink(g_stats_path);
+}
+
+void stats_count_call(enum real_symbol symbol) {
+  if (g_stats != NULL) {
+    __atomic_fetch_add(&g_stats->calls[symbol], 1, __ATOMIC_RELAXED);
+  }
+}
+
+void stats_count_step() {
+  if (g_stats != NULL) {
+    __atomic_fetch_add(&g_stats->steps, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Called with g_PCT_main_lock held, so the fields of one decision are written together
+void stats_decision(int from, int to) {
+  if (g_stats == NULL) {
+    return;
+  }
+  if (to != -1 && to != from) {
+    __atomic_fetch_add(&g_stats->context_switches, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&g_stats->last_state, t_stats_state, __ATOMIC_RELAXED);
+  __atomic_store_n(&g_stats->last_from, from, __ATOMIC_RELAXED);
+  __atomic_store_n(&g_stats->last_to, to, __ATOMIC_RELAXED);
+  __atomic_store_n(&g_stats->last_step,
+                   __atomic_load_n(&g_stats->steps, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  if (t_stats_decision_start != 0) {
+    __atomic_store_n(&g_stats->last_decision_ns, t_stats_decision_start, __ATOMIC_RELAXED);
+  }
+}
+
+////////////////////////////////////////////////////
+////////////////// LOCK PROFILER ///////////////////
+////////////////////////////////////////////////////
+
+// LOCK_PROFILE=True times every mutex acquisition: from the call of pthread_mutex_lock,
+// _timedlock or _trylock (request) to the moment it holds the mutex (grant), and from
+// there to pthread_mutex_unlock (release). Both are kept per mutex and per pair of
+// mutex and call site, the return address of the wrapper, with the stack of the first
+// acquisition from that site. At exit the LOCK_PROFILE_TOP (10) mutexes the threads
+// waited longest for are printed. Under PCT the wait includes the time the scheduler
+// kept the thread parked. The tables are protected by g_profile_lock.
+#define PROFILE_MUTEXES 1024
+#define PROFILE_CALLSITES 4096
+// Bucket b counts durations in [2^b, 2^(b+1)) ns, the last one everything longer
+#define PROFILE_BUCKETS 32
+
+struct lock_histogram {
+  uint64_t count[PROFILE_BUCKETS];
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+
+struct callsite_profile {
+  // NULL if the entry is free
+  void *callsite;
+  pthread_mutex_t *mutex;
+  uint64_t acquisitions;
+  uint64_t contended;
+  uint64_t failed;
+  struct lock_histogram wait;
+  struct lock_histogram hold;
+  void *stack[MAX_STACK_DEPTH];
+  int stack_depth;
+};
+
+struct lock_profile {
+  // NULL if the entry is free
+  pthread_mutex_t *mutex;
+  uint64_t acquisitions;
+  // Acquisitions that found the mutex held by another thread
+  uint64_t contended;
+  // Trylock and timedlock calls that did not get it
+  uint64_t failed;
+  struct lock_histogram wait;
+  struct lock_histogram hold;
+  // Levels the holder locked, the hold time runs while it is above 0
+  int depth;
+  uint64_t hold_start_ns;
+  // Call site of the acquisition the hold time is charged to
+  struct callsite_profile *holder_site;
+};
+
+bool g_lock_profile = false;
+int g_lock_profile_top = 10;
+sem_t g_profile_lock;
+struct lock_profile *g_lock_profiles = NULL;
+struct callsite_profile *g_callsite_profiles = NULL;
+// Entries that did not fit into the tables
+uint64_t g_profile_dropped = 0;
+
+// When the calling thread asked for the mutex it is acquiring, and whether another
+// thread held it then
+__thread uint64_t t_profile_request_ns = 0;
+__thread bool t_profile_contended = false;
+
+void init_lock_profile() {
+  char *profile_var = getenv("LOCK_PROFILE");
+  if (profile_var == NULL || strcmp(profile_var, "True") != 0) {
+    return;
+  }
+  char *top_var = getenv("LOCK_PROFILE_TOP");
+  if (top_var != NULL && atoi(top_var) > 0) {
+    g_lock_profile_top = atoi(top_var);
+  }
+  sem_init(&g_profile_lock, 0, 1);
+  g_lock_profiles = arena_alloc(PROFILE_MUTEXES * sizeof(struct lock_profile));
+  g_callsite_profiles = arena_alloc(PROFILE_CALLSITES * sizeof(struct callsite_profile));
+  g_lock_profile = true;
+}
+
+size_t profile_hash(const void *a, const void *b) {
+  return ((((uintptr_t)a ^ ((uintptr_t)b << 7)) >> 3) * 0x9E3779B97F4A7C15ull) >> 32;
+}
+
+// Finds or inserts the entry of mutex, NULL if the table is full.
+// The caller must hold g_profile_lock.
+struct lock_profile *find_lock_profile(pthread_mutex_t *mutex) {
+  size_t slot = profile_hash(mutex, NULL) % PROFILE_MUTEXES;
+  for (int probe = 0; probe < PROFILE_MUTEXES; probe++) {
+    struct lock_profile *profile = &g_lock_profiles[(slot + probe) % PROFILE_MUTEXES];
+    if (profile->mutex == mutex) {
+      return profile;
+    }
+    if (profile->mutex == NULL) {
+      profile->mutex = mutex;
+      return profile;
+    }
+  }
+  g_profile_dropped++;
+  return NULL;
+}
+
+// Finds or inserts the entry of mutex locked from callsite, NULL if the table is full.
+// A new entry has no stack yet. The caller must hold g_profile_lock.
+struct callsite_profile *find_callsite_profile(pthread_mutex_t *mutex, void *callsite) {
+  size_t slot = profile_hash(mutex, callsite) % PROFILE_CALLSITES;
+  for (int probe = 0; probe < PROFILE_CALLSITES; probe++) {
+    struct callsite_profile *site = &g_callsite_profiles[(slot + probe) % PROFILE_CALLSITES];
+    if (site->callsite == callsite && site->mutex == mutex) {
+      return site;
+    }
+    if (site->callsite == NULL) {
+      site->callsite = callsite;
+      site->mutex = mutex;
+      return site;
+    }
+  }
+  g_profile_dropped++;
+  return NULL;
+}
+
+void histogram_add(struct lock_histogram *histogram, uint64_t ns) {
+  int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+  histogram->count[bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1]++;
+  histogram->total_ns += ns;
+  if (ns > histogram->max_ns) {
+    histogram->max_ns = ns;
+  }
+}
+
+// Called when the calling thread starts acquiring mutex
+void profile_lock_request(pthread_mutex_t *mutex) {
+  if (!g_lock_profile) {
+    return;
+  }
+  t_profile_contended = false;
+  if (t_thread_index != -1) {
+    sem_wait(&g_deadlock_lock);
+    int owner = find_mutex_owner(mutex);
+    sem_post(&g_deadlock_lock);
+    t_profile_contended = owner != -1 && owner != t_thread_index;
+  }
+  t_profile_request_ns = real_clock_ns(CLOCK_MONOTONIC);
+}
+
+// Called after the calling thread acquired mutex from callsite. busy is set if the
+// mutex turned out to be taken when the thread tried it.
+void profile_lock_acquired(pthread_mutex_t *mutex, void *callsite, bool busy) {
+  if (!g_lock_profile) {
+    return;
+  }
+  uint64_t now = real_clock_ns(CLOCK_MONOTONIC);
+  uint64_t wait = now - t_profile_request_ns;
+  bool contended = busy || t_profile_contended;
+
+  sem_wait(&g_profile_lock);
+  struct lock_profile *profile = find_lock_profile(mutex);
+  struct callsite_profile *site = find_callsite_profile(mutex, callsite);
+  if (profile != NULL) {
+    profile->acquisitions++;
+    profile->contended += contended;
+    histogram_add(&profile->wait, wait);
+    if (profile->depth++ == 0) {
+      profile->hold_start_ns = now;
+      profile->holder_site = site;
+    }
+  }
+  if (site != NULL) {
+    site->acquisitions++;
+    site->contended += contended;
+    histogram_add(&site->wait, wait);
+    if (site->stack_depth == 0) {
+      site->stack_depth = capture_stacktrace(site->stack, MAX_STACK_DEPTH);
+    }
+  }
+  sem_post(&g_profile_lock);
+}
+
+// Called when a trylock or timedlock of mutex from callsite returned without it
+void profile_lock_failed(pthread_mutex_t *mutex, void *callsite) {
+  if (!g_lock_profile) {
+    return;
+  }
+  sem_wait(&g_profile_lock);
+  struct lock_profile *profile = find_lock_profile(mutex);
+  struct callsite_profile *site = find_callsite_profile(mutex, callsite);
+  if (profile != NULL) {
+    profile->failed++;
+  }
+  if (site != NULL) {
+    site->failed++;
+  }
+  sem_post(&g_profile_lock);
+}
+
+// Called before the calling thread releases mutex, the hold time ends with the last level
+void profile_lock_released(pthread_mutex_t *mutex) {
+  if (!g_lock_profile) {
+    return;
+  }
+  uint64_t now = real_clock_ns(CLOCK_MONOTONIC);
+  sem_wait(&g_profile_lock);
+  struct lock_profile *profile = find_lock_profile(mutex);
+  if (profile != NULL && profile->depth > 0 && --profile->depth == 0) {
+    uint64_t hold = now - profile->hold_start_ns;
+    histogram_add(&profile->hold, hold);
+    if (profile->holder_site != NULL) {
+      histogram_add(&profile->holder_site->hold, hold);
+    }
+  }
+  sem_post(&g_profile_lock);
+}
+
+// Called when pthread_cond_wait got mutex back. It is no new acquisition, the hold
+// time is charged to the site that locked the mutex before the wait.
+void profile_lock_reacquired(pthread_mutex_t *mutex) {
+  if (!g_lock_profile) {
+    return;
+  }
+  uint64_t now = real_clock_ns(CLOCK_MONOTONIC);
+  sem_wait(&g_profile_lock);
+  struct lock_profile *profile = find_lock_profile(mutex);
+  if (profile != NULL && profile->depth++ == 0) {
+    profile->hold_start_ns = now;
+  }
+  sem_post(&g_profile_lock);
+}
+
+// Writes ns with a unit that keeps it short
+void format_ns(uint64_t ns, char *buffer, size_t size) {
+  if (ns < 1000) {
+    snprintf(buffer, size, "%luns", ns);
+  } else if (ns < 1000000) {
+    snprintf(buffer, size, "%.1fus", ns / 1e3);
+  } else if (ns < 1000000000) {
+    snprintf(buffer, size, "%.1fms", ns / 1e6);
+  } else {
+    snprintf(buffer, size, "%.2fs", ns / 1e9);
+  }
+}
+
+// Prints the non-empty buckets, each labelled with its upper bound.
+// The caller must hold g_print_lock.
+void print_histogram(const char *name, struct lock_histogram *histogram) {
+  char total[16], max[16];
+  format_ns(histogram->total_ns, total, sizeof(total));
+  format_ns(histogram->max_ns, max, sizeof(max));
+  INFO("    %s total %s max %s:", name, total, max);
+  for (int b = 0; b < PROFILE_BUCKETS; b++) {
+    if (histogram->count[b] == 0) {
+      continue;
+    }
+    char bound[16];
+    if (b == PROFILE_BUCKETS - 1) {
+      format_ns(1ull << b, bound, sizeof(bound));
+      INFO(" >=%s %lu", bound, histogram->count[b]);
+    } else {
+      format_ns(1ull << (b + 1), bound, sizeof(bound));
+      INFO(" <%s %lu", bound, histogram->count[b]);
+    }
+  }
+  INFO("\n");
+}
+
+// More time waited first, then more contended acquisitions, then more acquisitions
+bool hotter(uint64_t wait_ns, uint64_t contended, uint64_t acquisitions,
+            uint64_t other_wait_ns, uint64_t other_contended, uint64_t other_acquisitions) {
+  if (wait_ns != other_wait_ns) {
+    return wait_ns > other_wait_ns;
+  }
+  if (contended != other_contended) {
+    return contended > other_contended;
+  }
+  return acquisitions > other_acquisitions;
+}
+
+// Prints the call sites of profile, hottest first, at most g_lock_profile_top of them.
+// The caller must hold g_profile_lock and g_print_lock.
+void print_callsite_profiles(struct lock_profile *profile) {
+  bool shown[PROFILE_CALLSITES] = { false };
+  for (int row = 0; row < g_lock_profile_top; row++) {
+    struct callsite_profile *best = NULL;
+    for (int i = 0; i < PROFILE_CALLSITES; i++) {
+      struct callsite_profile *site = &g_callsite_profiles[i];
+      if (shown[i] || site->callsite == NULL || site->mutex != profile->mutex) {
+        continue;
+      }
+      if (best == NULL || hotter(site->wait.total_ns, site->contended, site->acquisitions,
+                                 best->wait.total_ns, best->contended, best->acquisitions)) {
+        best = site;
+      }
+    }
+    if (best == NULL) {
+      break;
+    }
+    shown[best - g_callsite_profiles] = true;
+    INFO("  FROM %p: %lu acquisitions, %lu contended, %lu failed\n",
+         best->callsite, best->acquisitions, best->contended, best->failed);
+    print_histogram("wait", &best->wait);
+    print_histogram("hold", &best->hold);
+    print_saved_stacktrace(best->stack, best->stack_depth);
+  }
+}
+
+// Called by fini_testlib(), prints the g_lock_profile_top mutexes with the most time waited
+void report_lock_profile() {
+  if (!g_lock_profile) {
+    return;
+  }
+  sem_wait(&g_profile_lock);
+  sem_wait(&g_print_lock);
+  int mutex_count = 0;
+  for (int i = 0; i < PROFILE_MUTEXES; i++) {
+    mutex_count += g_lock_profiles[i].mutex != NULL;
+  }
+  INFO("LOCK PROFILE: %d mutexes, top %d by time waited\n", mutex_count, g_lock_profile_top);
+  if (g_profile_dropped > 0) {
+    INFO("LOCK PROFILE: %lu acquisitions not recorded, the tables are full\n", g_profile_dropped);
+  }
+
+  bool shown[PROFILE_MUTEXES] = { false };
+  for (int row = 0; row < g_lock_profile_top; row++) {
+    struct lock_profile *best = NULL;
+    for (int i = 0; i < PROFILE_MUTEXES; i++) {
+      struct lock_profile *profile = &g_lock_profiles[i];
+      if (shown[i] || profile->mutex == NULL) {
+        continue;
+      }
+      if (best == NULL || hotter(profile->wait.total_ns, profile->contended, profile->acquisitions,
+                                 best->wait.total_ns, best->contended, best->acquisitions)) {
+        best = profile;
+      }
+    }
+    if (best == NULL) {
+      break;
+    }
+    shown[best - g_lock_profiles] = true;
+    INFO("LOCK %p: %lu acquisitions, %lu contended (%.1f%%), %lu failed\n",
+         best->mutex, best->acquisitions, best->contended,
+         best->acquisitions == 0 ? 0 : 100.0 * best->contended / best->acquisitions, best->failed);
+    print_histogram("wait", &best->wait);
+    print_histogram("hold", &best->hold);
+    print_callsite_profiles(best);
+  }
+  fflush(stdout);
+  sem_post(&g_print_lock);
+  sem_post(&g_profile_lock);
+}
+
+////////////////////////////////////////////////////
+/////////////// SYMMETRY REDUCTION /////////////////
+////////////////////////////////////////////////////
+
+// Worker pools start many threads on the same routine and argument, and which of two
+// such threads that did the same number of calls runs first makes no difference. With
+// SYMMETRY=True the earliest created of them always gets the highest priority of the
+// group when one is picked, so seeds that only permute their priorities give the same
+// schedule. The argument is compared by address, whatever it points to.
+#define MAX_SYMMETRY_GROUPS 64
+
+struct symmetry_group {
+  void *(*start_routine) (void *);
+  void *start_arg;
+  int thread_count;
+};
+
+bool g_symmetry = false;
+struct symmetry_group g_symmetry_groups[MAX_SYMMETRY_GROUPS];
+int g_symmetry_group_count = 0;
+// Number of times a symmetric thread was picked instead of the highest priority one
+int g_symmetry_swaps = 0;
+
+void init_symmetry() {
+  char *symmetry_var = getenv("SYMMETRY");
+  g_symmetry = symmetry_var != NULL && strcmp(symmetry_var, "True") == 0;
+}
+
+// Counts a thread created with start_routine and start_arg into its group
+void symmetry_thread_created(void *(*start_routine) (void *), void *start_arg) {
+  if (!g_symmetry || start_routine == NULL) {
+    return;
+  }
+  for (int i = 0; i < g_symmetry_group_count; i++) {
+    if (g_symmetry_groups[i].start_routine == start_routine &&
+        g_symmetry_groups[i].start_arg == start_arg) {
+      g_symmetry_groups[i].thread_count++;
+      return;
+    }
+  }
+  if (g_symmetry_group_count < MAX_SYMMETRY_GROUPS) {
+    g_symmetry_groups[g_symmetry_group_count].start_routine = start_routine;
+    g_symmetry_groups[g_symmetry_group_count].start_arg = start_arg;
+    g_symmetry_groups[g_symmetry_group_count].thread_count = 1;
+    g_symmetry_group_count++;
+  }
+}
+
+bool threads_symmetric(int a, int b) {
+  return (g_threads[a].start_routine != NULL) &&
+         (g_threads[a].start_routine == g_threads[b].start_routine) &&
+         (g_threads[a].start_arg == g_threads[b].start_arg) &&
+         (g_threads[a].steps == g_threads[b].steps) &&
+         !g_threads[a].demoted && !g_threads[b].demoted;
+}
+
+// Returns the runnable thread symmetric to thread_index that was created first, after
+// giving it the priority of thread_index
+int canonical_symmetric_thread(int thread_index) {
+  int canonical = thread_index;
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state == THREAD_RUNNABLE) &&
+        (g_threads[i].thread_number < g_threads[canonical].thread_number) &&
+        threads_symmetric(i, thread_index)) {
+      canonical = i;
+    }
+  }
+  if (canonical != thread_index) {
+    int priority = get_priorities()[canonical];
+    get_priorities()[canonical] = get_priorities()[thread_index];
+    get_priorities()[thread_index] = priority;
+    g_symmetry_swaps++;
+  }
+  return canonical;
+}
+
+// Prints the groups of symmetric threads and an upper bound of how many schedules were
+// collapsed into one: n! per group, as if all n threads always took the same steps
+void report_symmetry() {
+  if (!g_symmetry) {
+    return;
+  }
+  double factor = 1;
+  for (int i = 0; i < g_symmetry_group_count; i++) {
+    for (int k = 2; k <= g_symmetry_groups[i].thread_count; k++) {
+      factor *= k;
+    }
+    if (g_symmetry_groups[i].thread_count > 1) {
+      INFO("SYMMETRY: %d threads run %p(%p)\n", g_symmetry_groups[i].thread_count,
+           (void *)g_symmetry_groups[i].start_routine, g_symmetry_groups[i].start_arg);
+    }
+  }
+  INFO("SYMMETRY: reduction factor at most %.0f, %d symmetric picks\n", factor, g_symmetry_swaps);
+  fflush(stdout);
+}
+
+int find_highest_priority() {
+  // Find the highest priority thread available to be active
+  int highest_priorty = INT_MIN;
+  int thread_index = -1;
+
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state == THREAD_RUNNABLE) && (get_priorities()[i] > highest_priorty)) {
+      thread_index = i;
+      highest_priorty = get_priorities()[thread_index];
+    } 
+  }
+
+  if (g_symmetry && thread_index != -1) {
+    thread_index = canonical_symmetric_thread(thread_index);
+  }
+
+  return thread_index;
+}
+
+// The thread in slot thread_index waits for another thread until unblock_thread()
+void block_thread(int thread_index) {
+  g_threads[thread_index].state = THREAD_BLOCKED;
+  g_runnable_threads--;
+  g_block_threads++;
+  current_strategy()->on_block(thread_index);
+}
+
+void unblock_thread(int thread_index) {
+  g_threads[thread_index].state = THREAD_RUNNABLE;
+  g_runnable_threads++;
+  g_block_threads--;
+  current_strategy()->on_unblock(thread_index);
+}
+
+void forget_cond_waiter(int thread_index);
+void wake_rwlock_waiters(pthread_rwlock_t *rwlock);
+
+// Wakes a thread whose timed wait ran out, the blocked call sees timed_out set
+void wake_timed_out(int thread_index) {
+  struct thread_struct *thread = &g_threads[thread_index];
+  if (thread->waiting_cond != NULL) {
+    forget_cond_waiter(thread_index);
+  }
+  thread->timed_wait = false;
+  thread->timed_out = true;
+  thread->deadline = 0;
+  thread->join_target = -1;
+  sem_wait(&g_deadlock_lock);
+  mutex_remove_waiter(thread_index);
+  sem_post(&g_deadlock_lock);
+  unblock_thread(thread_index);
+
+  thread->waiting_object = NULL;
+  pthread_rwlock_t *rwlock = thread->waiting_rwlock;
+  thread->waiting_rwlock = NULL;
+  if (rwlock != NULL && thread->waiting_write) {
+    // Readers that gave way to this writer can go on
+    wake_rwlock_waiters(rwlock);
+  }
+}
+
+// Wakes the timed waiters whose deadline the virtual clock reached
+void wake_expired_timers() {
+  uint64_t now = virtual_now();
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state == THREAD_BLOCKED) &&
+        g_threads[i].timed_wait &&
+        (g_threads[i].deadline != 0) &&
+        (g_threads[i].deadline <= now)) {
+      wake_timed_out(i);
+    }
+  }
+}
+
+// Called when no thread is runnable. Moves the virtual clock to the earliest
+// deadline and wakes its waiters, or without deadlines wakes the timed waiter
+// with the highest priority. Returns the slot to run next, -1 if there is no timed waiter.
+int expire_timed_wait() {
+  uint64_t earliest = UINT64_MAX;
+  int highest_priorty = INT_MIN;
+  int thread_index = -1;
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state != THREAD_BLOCKED) || !g_threads[i].timed_wait) {
+      continue;
+    }
+    if (g_threads[i].deadline != 0 && g_threads[i].deadline < earliest) {
+      earliest = g_threads[i].deadline;
+    }
+    if (get_priorities()[i] > highest_priorty) {
+      thread_index = i;
+      highest_priorty = get_priorities()[thread_index];
+    }
+  }
+  if (earliest != UINT64_MAX) {
+    virtual_time_advance_to(earliest);
+    wake_expired_timers();
+    return find_highest_priority();
+  }
+  if (thread_index != -1) {
+    wake_timed_out(thread_index);
+  }
+  return thread_index;
+}
+
+void run_highest_priority() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER run_highest_priority() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  if (g_virtual_time) {
+    // Threads polling the clock move it past the deadlines of sleeping threads
+    wake_expired_timers();
+  }
+
+  // Unblock the highest priority thread
+  int next_thread = current_strategy()->pick_next();
+  if (next_thread == -1 && g_block_threads > 0) {
+    // Nothing else will ever happen, so a timed wait would run out
+    next_thread = expire_timed_wait();
+  }
+
+  stats_decision(t_thread_index, next_thread);
+
+  if (next_thread == -1) {
+    if (g_block_threads > 0) {
+      // Every thread that is still alive waits for another one
+      report_PCT_deadlock();
+    }
+    g_current_thread = -1;
+  } else if (next_thread != t_thread_index) {
+    if (DEBUG) {
+      sem_wait(&g_print_lock);
+      INFO("POSTING THREAD: %d\n", next_thread);
+      fflush(stdout);
+      sem_post(&g_print_lock);
+    }
+    g_current_thread = next_thread;
+    // Let PCT_wait_for_turn() of that thread return
+    sem_post(&(g_semaphores[g_current_thread]));
+    if (t_thread_index != -1 && g_threads[t_thread_index].state != THREAD_DEAD) {
+      t_PCT_must_wait = true;
+    }
+  }
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXIT run_highest_priority() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+int find_next_available_thread() {
+  // Find the highest priority thread available to be active
+  int highest_priorty = INT_MIN;
+  int thread_index = -1;
+
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state == THREAD_DEAD) && (get_priorities()[i] > highest_priorty)) {
+      thread_index = i;
+      highest_priorty = get_priorities()[i];
+    } 
+  }
+
+  return thread_index;
+}
+
+void PCT_init_main() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_init_main() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  // Randomly choose priority for the main thread per a piazza post -
+  // Therefore choosing thread index 0
+  int thread_index = 0;
+  // This is the thread_id for the main thread
+  g_threads[thread_index].thread_id = gettid();
+  g_threads[thread_index].state = THREAD_RUNNABLE;
+  g_threads[thread_index].thread_number = 0;
+  g_threads[thread_index].handle = pthread_self();
+  t_thread_index = thread_index;
+  // main starts out with the turn, no need to post its semaphore
+  g_current_thread = thread_index;
+
+  // thread count = 0 per section 4.2 top of page 6
+  g_runnable_threads++;
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_init_main() - g_runnable_threads = %d - g_current_thread = %d - priority = %d - proccess id = %ld - thread_number = %d\n", 
+         g_runnable_threads,
+         g_current_thread,
+         get_priorities()[g_current_thread],
+         g_threads[g_current_thread].thread_id,
+         g_threads[g_current_thread].thread_number);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+void PCT_thread_start() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_start() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  // Store the thread_id for the current thread for later use maybe in mutexes
+  g_threads[t_thread_index].thread_id = gettid();
+  // A new thread never has the turn yet, whoever hands it over posts our semaphore
+  t_PCT_must_wait = true;
+  current_strategy()->on_thread_start(t_thread_index);
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_start() - g_runnable_threads = %d - new_thread = %d - priority = %d - proccess id = %ld - thread_number = %d\n", 
+         g_runnable_threads,
+         t_thread_index,
+         get_priorities()[t_thread_index],
+         g_threads[t_thread_index].thread_id,
+         g_threads[t_thread_index].thread_number);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+void PCT_thread_after_create() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_after_create() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  // The new thread waits for its turn in PCT_thread_start(), so it cannot have exited yet
+  g_threads[t_new_thread_index].handle = t_new_thread_handle;
+  // The new thread may have a higher priority than its creator
+  run_highest_priority();
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_after_create() - g_runnable_threads = %d - new_thread = %d - priority = %d \n", 
+         g_runnable_threads, g_current_thread, get_priorities()[g_current_thread]);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+void PCT_thread_before_create() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_before_create() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  // Mark thread is runnable
+  // Find the priority for this thread - from highest priority where thread is not active yet (ie DEAD)
+  t_new_thread_index = find_next_available_thread();
+  assert(t_new_thread_index != -1);
+  reset_thread_slot(t_new_thread_index);
+  g_threads[t_new_thread_index].state = THREAD_RUNNABLE;
+  // interpose_start_routine() reads g_thread_count under g_count_lock
+  g_threads[t_new_thread_index].thread_number =
+    __atomic_add_fetch(&g_thread_count, 1, __ATOMIC_RELAXED);
+  g_threads[t_new_thread_index].start_routine = t_current_start_routine;
+  g_threads[t_new_thread_index].start_arg = t_current_start_arg;
+  symmetry_thread_created(t_current_start_routine, t_current_start_arg);
+  current_strategy()->on_thread_create(t_new_thread_index);
+  // the thread_id cannot be assigned until PCT_thread_start() when the thread has actually start
+  // PCT_thread_start is called indirectly from interpose start routine through run_algorithm()
+  g_runnable_threads++;
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_before_create() - g_runnable_threads = %d - new_thread = %d - priority = %d - thread_number = %d\n", 
+         g_runnable_threads,
+         t_new_thread_index,
+         get_priorities()[t_new_thread_index],
+         g_threads[t_new_thread_index].thread_number);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+void PCT_thread_terminate() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_terminate() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  // pthread_exit - or termination of thread
+  // set g_current thread to be the next runnable thread
+  lock_graph_thread_exit();
+  g_threads[t_thread_index].state = THREAD_DEAD;
+  g_threads[t_thread_index].thread_number = 0;
+  g_runnable_threads--;
+  current_strategy()->on_exit(t_thread_index);
+
+  // Threads in pthread_join on this one can go on
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state == THREAD_BLOCKED) &&
+        (g_threads[i].join_target == t_thread_index)) {
+      g_threads[i].join_target = -1;
+      g_threads[i].timed_wait = false;
+      g_threads[i].deadline = 0;
+      unblock_thread(i);
+    }
+  }
+
+  run_highest_priority();
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_terminate() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+// Priority change point: the current thread drops below every other thread, like
+// the d-1 change points of the PCT paper. Lowered priorities are negative so they
+// stay below everything get_priorities() hands out.
+int g_PCT_lowest_priority = 0;
+
+////////////////////////////////////////////////////
+//////////////// FAIR SCHEDULING ///////////////////
+////////////////////////////////////////////////////
+
+// A thread that keeps failing try-lock calls or yielding waits for another thread to
+// make progress, and PCT would run it forever if it has the highest priority. Like the
+// fair scheduler of CHESS, after FAIR_SPIN_LIMIT spins in a row the thread drops below
+// every other thread, and its next call that is not a spin gives it its priority back.
+#define DEFAULT_FAIR_SPIN_LIMIT 3
+
+int g_fair_spin_limit = DEFAULT_FAIR_SPIN_LIMIT;
+
+// FAIR_SPIN_LIMIT=0 disables fair scheduling
+void init_fair_scheduling() {
+  char *limit_var = getenv("FAIR_SPIN_LIMIT");
+  if (limit_var != NULL) {
+    int limit = atoi(limit_var);
+    g_fair_spin_limit = limit < 0 ? 0 : limit;
+  }
+}
+
+// Counts a spin of the calling thread and demotes it once it reached the limit.
+// Returns true if it was demoted.
+bool count_spin() {
+  if (g_fair_spin_limit == 0 || t_thread_index == -1) {
+    return false;
+  }
+  struct thread_struct *self = &g_threads[t_thread_index];
+  if (++self->spin_count < g_fair_spin_limit) {
+    return false;
+  }
+  self->spin_count = 0;
+  if (!self->demoted) {
+    self->demoted = true;
+    self->undemoted_priority = get_priorities()[t_thread_index];
+  }
+  self->demoted_priority = --g_PCT_lowest_priority;
+  get_priorities()[t_thread_index] = self->demoted_priority;
+
+  sem_wait(&g_print_lock);
+  INFO("FAIR: thread %d demoted after %d spins\n", self->thread_number, g_fair_spin_limit);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+  return true;
+}
+
+// The calling thread made progress, so it stops counting as a spinner
+void end_spin() {
+  if (t_thread_index == -1) {
+    return;
+  }
+  struct thread_struct *self = &g_threads[t_thread_index];
+  self->spin_count = 0;
+  if (self->demoted) {
+    // A preemption point may have moved it since, then that priority stays
+    if (get_priorities()[t_thread_index] == self->demoted_priority) {
+      get_priorities()[t_thread_index] = self->undemoted_priority;
+    }
+    self->demoted = false;
+  }
+}
+
+// Whether a call of this kind can be part of a spin loop waiting for another thread
+bool is_spin_state(int pct_thread_state) {
+  return (pct_thread_state == PCT_THREAD_CALL) ||
+         (pct_thread_state == PCT_THREAD_YIELD) ||
+         (pct_thread_state == PCT_THREAD_TRY_LOCK) ||
+         (pct_thread_state == PCT_THREAD_RWLOCK_TRY) ||
+         (pct_thread_state == PCT_THREAD_TRY_JOIN) ||
+         (pct_thread_state == PCT_THREAD_PREEMPT) ||
+         (pct_thread_state == PCT_THREAD_SPIN);
+}
+
+// Called after a try-lock call failed
+void PCT_thread_spin() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_spin() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  if (count_spin()) {
+    run_highest_priority();
+  }
+
+  return;
+}
+
+void PCT_thread_yield() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_yield() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  // Yielding over and over waits for another thread, let the others go first
+  count_spin();
+
+  // Current thread is stopped - no threads should be running
+  // Let the strategy pick among the other threads, hiding the current thread from it
+  // without the on_block() hook
+  g_threads[t_thread_index].state = THREAD_BLOCKED;
+  int thread_index = current_strategy()->pick_next();
+  g_threads[t_thread_index].state = THREAD_RUNNABLE;
+
+  stats_decision(t_thread_index, thread_index == -1 ? t_thread_index : thread_index);
+
+  // Check that no other thread is able to run
+  if (thread_index != -1) {
+    // start the second highest thread
+    g_current_thread = thread_index;
+    sem_post(&(g_semaphores[g_current_thread]));
+    // suspend the old thread once PCT() released its locks
+    t_PCT_must_wait = true;
+  }
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("g_current_thread = %d \n", g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_yield() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+void PCT_thread_preempt() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_preempt() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  get_priorities()[t_thread_index] = --g_PCT_lowest_priority;
+  run_highest_priority();
+
+  return;
+}
+
+// Error the pthread_join family returns without calling the original function, 0 if it should be called
+__thread int t_PCT_join_error = 0;
+
+// Slot of the live thread created with handle, -1 if it already terminated
+int find_thread_by_handle(pthread_t handle) {
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state != THREAD_DEAD) && pthread_equal(g_threads[i].handle, handle)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Returns true once the thread in t_current_join_thread terminated (the original
+// pthread_join will not block for long) or t_PCT_join_error was set, false if
+// the caller was blocked and has to retry once it gets its turn back.
+bool PCT_thread_join() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_join() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  struct thread_struct *self = &g_threads[t_thread_index];
+  int target = find_thread_by_handle(t_current_join_thread);
+  bool finished = true;
+  t_PCT_join_error = 0;
+
+  if (self->timed_out) {
+    self->timed_out = false;
+    t_PCT_join_error = ETIMEDOUT;
+  } else if (target == t_thread_index) {
+    t_PCT_join_error = EDEADLK;
+  } else if (target != -1 && g_threads[target].detached) {
+    t_PCT_join_error = EINVAL;
+  } else if (target != -1) {
+    // Blocked until PCT_thread_terminate() of the target
+    self->wait_stack_depth = capture_stacktrace(self->wait_stack, MAX_STACK_DEPTH);
+    self->join_target = target;
+    self->timed_wait = t_current_timed;
+    self->deadline = t_current_deadline;
+    block_thread(t_thread_index);
+    run_highest_priority();
+    finished = false;
+  }
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_join() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return finished;
+}
+
+// pthread_tryjoin_np never blocks, it fails with EBUSY while the target is alive.
+// The caller is most likely polling, so it lets another thread run like pthread_yield.
+void PCT_thread_try_join() {
+  int target = find_thread_by_handle(t_current_join_thread);
+  if (target == -1) {
+    t_PCT_join_error = 0;
+  } else if (target == t_thread_index) {
+    t_PCT_join_error = EDEADLK;
+  } else if (g_threads[target].detached) {
+    t_PCT_join_error = EINVAL;
+  } else {
+    t_PCT_join_error = EBUSY;
+    PCT_thread_yield();
+  }
+
+  return;
+}
+
+void PCT_thread_detach() {
+  int target = find_thread_by_handle(t_current_join_thread);
+  if (target != -1) {
+    g_threads[target].detached = true;
+  }
+
+  return;
+}
+
+// Returns true if the calling thread may go on and call the original pthread_mutex_lock,
+// false if it was blocked and has to retry once it gets its turn back.
+bool PCT_thread_lock() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_lock() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+  // pthread_mutex_lock algorithm defined on page 9
+  sem_wait(&g_deadlock_lock);
+  int owner = find_mutex_owner(t_current_mutex);
+  sem_post(&g_deadlock_lock);
+  struct thread_struct *self = &g_threads[t_thread_index];
+  // pthread_mutex_timedlock gives up, the caller finds timed_out set
+  bool acquired = (owner == -1 || owner == t_thread_index || self->timed_out);
+
+  if (!acquired) {
+    self->timed_wait = t_current_timed;
+    self->deadline = t_current_deadline;
+    self->wait_stack_depth = capture_stacktrace(self->wait_stack, MAX_STACK_DEPTH);
+
+    // 1. Store the mutex object used by the pthread_mutex_lock function in a global array, but do not call the original
+    // pthread function at this point.
+    sem_wait(&g_deadlock_lock);
+    mutex_add_waiter(t_thread_index, t_current_mutex);
+    sem_post(&g_deadlock_lock);
+
+    // 2. Identify which is the thread that should be allowed to run next.
+    block_thread(t_thread_index);
+
+    // 3. Unblock the thread that should run next (e.g., sem_post).
+    // 4. Block the current thread using a per-thread testing semaphore (done by PCT()).
+    run_highest_priority();
+
+    // 5. Call the original pthread_mutex_lock functions.
+    // completed in pthread_mutex_lock once PCT_thread_unlock() woke us up
+  }
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_lock() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return acquired;
+}
+
+// Unblock all threads that were locking on mutex, they compete for it again.
+// Threads blocked in the original pthread_mutex_lock stay queued.
+void wake_mutex_waiters(pthread_mutex_t *mutex) {
+  sem_wait(&g_deadlock_lock);
+  struct mutex_entry *entry = find_mutex_entry(mutex);
+  if (entry == NULL) {
+    // The registry is full, so the waiters were not queued
+    for (int i = 0; i < MAX_THREADS; i++) {
+      if ((g_threads[i].state == THREAD_BLOCKED) && (g_threads[i].waiting_mutex == mutex)) {
+        g_threads[i].waiting_mutex = NULL;
+        g_threads[i].timed_wait = false;
+        g_threads[i].deadline = 0;
+        unblock_thread(i);
+      }
+    }
+  }
+  int next = entry == NULL ? -1 : entry->first_waiter;
+  while (next != -1) {
+    int i = next;
+    next = g_threads[i].next_mutex_waiter;
+    if (g_threads[i].state == THREAD_BLOCKED) {
+      mutex_remove_waiter(i);
+      g_threads[i].timed_wait = false;
+      g_threads[i].deadline = 0;
+      unblock_thread(i);
+    }
+  }
+  sem_post(&g_deadlock_lock);
+}
+
+void PCT_thread_unlock() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_unlock() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  wake_mutex_waiters(t_current_mutex);
+
+  // find the highest priority thread to run
+  run_highest_priority();
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_unlock() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+void PCT_thread_trylock() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_trylock() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  if (g_threads[t_thread_index].waiting_mutex == t_current_mutex) {
+    g_mutex_locked = 0;
+  } else {
+    g_mutex_locked = 1;
+  }
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_trylock() - g_runnable_threads = %d - g_current_thread = %d \n", 
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+// Condition variables are modeled instead of calling the original functions, so
+// a waiter is never parked in the kernel where PCT cannot wake it. Every
+// condition variable with waiters has a queue of their slots in wait order.
+// A thread waits on one condition variable at a time, so there are never more
+// queues in use than slots.
+#define MAX_PCT_CONDS MAX_THREADS
+
+struct PCT_cond {
+  pthread_cond_t *cond;
+  int waiters[MAX_THREADS];
+  int waiter_count;
+};
+
+struct PCT_cond g_PCT_conds[MAX_PCT_CONDS];
+
+// Returns the queue of cond, a free one if create is set and cond has none, or NULL
+struct PCT_cond *find_PCT_cond(pthread_cond_t *cond, bool create) {
+  struct PCT_cond *free_entry = NULL;
+  for (int i = 0; i < MAX_PCT_CONDS; i++) {
+    if (g_PCT_conds[i].cond == cond) {
+      return &g_PCT_conds[i];
+    }
+    if (g_PCT_conds[i].cond == NULL && free_entry == NULL) {
+      free_entry = &g_PCT_conds[i];
+    }
+  }
+  if (create && free_entry != NULL) {
+    free_entry->cond = cond;
+    free_entry->waiter_count = 0;
+    return free_entry;
+  }
+  return NULL;
+}
+
+// Position in waiters of the waiter a signal wakes, the pick_waiter hook of the
+// strategies. PCT wakes the waiter with the highest priority, like it picks which
+// runnable thread goes next.
+int pick_cond_waiter(const int *waiters, int waiter_count) {
+  int position = 0;
+  for (int i = 1; i < waiter_count; i++) {
+    if (get_priorities()[waiters[i]] > get_priorities()[waiters[position]]) {
+      position = i;
+    }
+  }
+  return position;
+}
+
+void wake_cond_waiter(struct PCT_cond *queue, int position) {
+  int thread_index = queue->waiters[position];
+  memmove(&queue->waiters[position], &queue->waiters[position + 1],
+          (queue->waiter_count - position - 1) * sizeof(int));
+  queue->waiter_count--;
+  if (queue->waiter_count == 0) {
+    queue->cond = NULL;
+  }
+  g_threads[thread_index].waiting_cond = NULL;
+  g_threads[thread_index].timed_wait = false;
+  g_threads[thread_index].deadline = 0;
+  unblock_thread(thread_index);
+}
+
+// Takes a thread whose timed wait ran out off the queue of its condition variable
+void forget_cond_waiter(int thread_index) {
+  struct PCT_cond *queue = find_PCT_cond(g_threads[thread_index].waiting_cond, false);
+  g_threads[thread_index].waiting_cond = NULL;
+  if (queue == NULL) {
+    return;
+  }
+  for (int i = 0; i < queue->waiter_count; i++) {
+    if (queue->waiters[i] == thread_index) {
+      memmove(&queue->waiters[i], &queue->waiters[i + 1],
+              (queue->waiter_count - i - 1) * sizeof(int));
+      queue->waiter_count--;
+      break;
+    }
+  }
+  if (queue->waiter_count == 0) {
+    queue->cond = NULL;
+  }
+}
+
+// The caller already released t_current_mutex. Queues the calling thread on
+// t_current_cond and blocks it, PCT() returns once it was woken up and has its
+// turn again. The mutex is then reacquired like in pthread_mutex_lock.
+void PCT_thread_cond_wait() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_cond_wait() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  struct thread_struct *self = &g_threads[t_thread_index];
+  struct PCT_cond *queue = find_PCT_cond(t_current_cond, true);
+  if (queue != NULL) {
+    queue->waiters[queue->waiter_count++] = t_thread_index;
+
+    self->wait_stack_depth = capture_stacktrace(self->wait_stack, MAX_STACK_DEPTH);
+    self->waiting_cond = t_current_cond;
+    self->timed_wait = t_current_timed;
+    self->deadline = t_current_deadline;
+    block_thread(t_thread_index);
+  }
+  // Without a queue the thread stays runnable, a spurious wakeup POSIX allows
+
+  // Releasing the mutex may unblock threads waiting for it
+  wake_mutex_waiters(t_current_mutex);
+  run_highest_priority();
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_cond_wait() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+void PCT_thread_cond_signal(bool broadcast) {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_cond_signal() - broadcast = %d - g_current_thread = %d \n",
+         broadcast, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  struct PCT_cond *queue = find_PCT_cond(t_current_cond, false);
+  if (queue != NULL && broadcast) {
+    while (queue->waiter_count > 0) {
+      wake_cond_waiter(queue, 0);
+    }
+  } else if (queue != NULL) {
+    int position = current_strategy()->pick_waiter(queue->waiters, queue->waiter_count);
+    wake_cond_waiter(queue, position);
+  }
+
+  // A woken waiter may have a higher priority than the signaling thread
+  run_highest_priority();
+
+  return;
+}
+
+// Read-write locks are modeled as well, the original functions are only called
+// once the model granted the lock. The model knows the readers and the writer of
+// every held rwlock. A thread that cannot get one is blocked with waiting_rwlock
+// set, and every unlock lets all its waiters compete again. Like in glibc a
+// reader only gives way to waiting writers on rwlocks created with
+// PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP, so PCT can starve writers.
+#define MAX_PCT_RWLOCKS 64
+
+struct PCT_rwlock {
+  pthread_rwlock_t *rwlock;
+  // Slot of the thread holding it for writing, -1 if none
+  int writer;
+  // Read locks each slot holds
+  int readers[MAX_THREADS];
+  int reader_count;
+};
+
+struct PCT_rwlock g_PCT_rwlocks[MAX_PCT_RWLOCKS];
+
+// EBUSY if the last try of the calling thread could not get the rwlock under PCT
+__thread int t_PCT_rwlock_error = 0;
+
+// Returns the model of rwlock, a free one if create is set and rwlock is not held, or NULL
+struct PCT_rwlock *find_PCT_rwlock(pthread_rwlock_t *rwlock, bool create) {
+  struct PCT_rwlock *free_entry = NULL;
+  for (int i = 0; i < MAX_PCT_RWLOCKS; i++) {
+    if (g_PCT_rwlocks[i].rwlock == rwlock) {
+      return &g_PCT_rwlocks[i];
+    }
+    if (g_PCT_rwlocks[i].rwlock == NULL && free_entry == NULL) {
+      free_entry = &g_PCT_rwlocks[i];
+    }
+  }
+  if (create && free_entry != NULL) {
+    free_entry->rwlock = rwlock;
+    free_entry->writer = -1;
+    memset(free_entry->readers, 0, sizeof(free_entry->readers));
+    free_entry->reader_count = 0;
+    return free_entry;
+  }
+  return NULL;
+}
+
+// Entries are only kept while the rwlock is held, waiters are recorded in their slots
+void release_PCT_rwlock_if_free(struct PCT_rwlock *entry) {
+  if (entry->writer == -1 && entry->reader_count == 0) {
+    entry->rwlock = NULL;
+  }
+}
+
+bool rwlock_writer_waiting(pthread_rwlock_t *rwlock) {
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state == THREAD_BLOCKED) &&
+        (g_threads[i].waiting_rwlock == rwlock) &&
+        g_threads[i].waiting_write) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the calling thread can lock entry for writing (write) or reading right now
+bool rwlock_available(struct PCT_rwlock *entry, bool write) {
+  if (entry->writer == t_thread_index) {
+    // Relocking makes the original function fail with EDEADLK
+    return true;
+  }
+  if (write) {
+    return entry->writer == -1 && entry->reader_count == 0;
+  }
+  if (entry->writer != -1) {
+    return false;
+  }
+  if (entry->rwlock->__data.__flags == PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP) {
+    return !rwlock_writer_waiting(entry->rwlock);
+  }
+  return true;
+}
+
+// Unblock all threads waiting for rwlock, they compete for it again
+void wake_rwlock_waiters(pthread_rwlock_t *rwlock) {
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state == THREAD_BLOCKED) &&
+        (g_threads[i].waiting_rwlock == rwlock)) {
+      g_threads[i].waiting_rwlock = NULL;
+      g_threads[i].timed_wait = false;
+      g_threads[i].deadline = 0;
+      unblock_thread(i);
+    }
+  }
+}
+
+// Locks t_current_rwlock in the model, for writing if t_current_rwlock_write is set.
+// Returns false if the caller was blocked and has to retry once it gets its turn
+// back. A try (try_lock) sets t_PCT_rwlock_error to EBUSY instead of blocking.
+bool PCT_thread_rwlock(bool try_lock) {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_rwlock() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  struct thread_struct *self = &g_threads[t_thread_index];
+  struct PCT_rwlock *entry = find_PCT_rwlock(t_current_rwlock, true);
+  assert(entry != NULL);
+  bool finished = true;
+  t_PCT_rwlock_error = 0;
+
+  if (self->timed_out) {
+    // pthread_rwlock_timed*lock gives up, the caller finds timed_out set
+  } else if (rwlock_available(entry, t_current_rwlock_write)) {
+    if (entry->writer == t_thread_index) {
+      // Not granted again, the original function reports EDEADLK
+    } else if (t_current_rwlock_write) {
+      entry->writer = t_thread_index;
+    } else {
+      entry->readers[t_thread_index]++;
+      entry->reader_count++;
+    }
+  } else if (try_lock) {
+    t_PCT_rwlock_error = EBUSY;
+  } else {
+    self->wait_stack_depth = capture_stacktrace(self->wait_stack, MAX_STACK_DEPTH);
+    self->waiting_rwlock = t_current_rwlock;
+    self->waiting_write = t_current_rwlock_write;
+    self->timed_wait = t_current_timed;
+    self->deadline = t_current_deadline;
+    block_thread(t_thread_index);
+    run_highest_priority();
+    finished = false;
+  }
+  release_PCT_rwlock_if_free(entry);
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_rwlock() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return finished;
+}
+
+// The caller already released t_current_rwlock with the original function
+void PCT_thread_rwlock_unlock() {
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER PCT_thread_rwlock_unlock() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  struct PCT_rwlock *entry = find_PCT_rwlock(t_current_rwlock, false);
+  if (entry != NULL) {
+    if (entry->writer == t_thread_index) {
+      entry->writer = -1;
+    } else if (entry->readers[t_thread_index] > 0) {
+      entry->readers[t_thread_index]--;
+      entry->reader_count--;
+    }
+    release_PCT_rwlock_if_free(entry);
+  }
+
+  wake_rwlock_waiters(t_current_rwlock);
+  run_highest_priority();
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("EXITING PCT_thread_rwlock_unlock() - g_runnable_threads = %d - g_current_thread = %d \n",
+         g_runnable_threads, g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return;
+}
+
+// Semaphores, spin locks and barriers are modeled with the same blocking: a
+// thread that cannot go on is blocked on the object, and every sem_post or
+// pthread_spin_unlock lets all threads blocked on it compete again. Spinning
+// threads are never scheduled, so PCT does not run their busy loops.
+
+// Blocks the calling thread until wake_object_waiters(object). kind names the object in deadlock reports.
+void block_on_object(void *object, const char *kind) {
+  struct thread_struct *self = &g_threads[t_thread_index];
+  self->wait_stack_depth = capture_stacktrace(self->wait_stack, MAX_STACK_DEPTH);
+  self->waiting_object = object;
+  self->waiting_kind = kind;
+  self->timed_wait = t_current_timed;
+  self->deadline = t_current_deadline;
+  block_thread(t_thread_index);
+  run_highest_priority();
+}
+
+void wake_object_waiters(void *object) {
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if ((g_threads[i].state == THREAD_BLOCKED) &&
+        (g_threads[i].waiting_object == object)) {
+      g_threads[i].waiting_object = NULL;
+      g_threads[i].timed_wait = false;
+      g_threads[i].deadline = 0;
+      unblock_thread(i);
+    }
+  }
+}
+
+// Decrements t_current_object, a sem_t, with the original sem_trywait. Returns
+// false if the caller was blocked and has to retry once it gets its turn back.
+bool PCT_thread_sem_wait() {
+  struct thread_struct *self = &g_threads[t_thread_index];
+  bool finished = true;
+  if (self->timed_out) {
+    // sem_timedwait gives up, the caller finds timed_out set
+  } else if (sem_trywait((sem_t *)t_current_object) != 0) {
+    block_on_object(t_current_object, "semaphore");
+    finished = false;
+  }
+
+  return finished;
+}
+
+// Takes t_current_object, a pthread_spinlock_t, with the original pthread_spin_trylock
+bool PCT_thread_spin_lock() {
+  pthread_spin_trylock_type orig_spin_trylock;
+  orig_spin_trylock = (pthread_spin_trylock_type)real_symbol(REAL_pthread_spin_trylock);
+
+  bool finished = true;
+  if (orig_spin_trylock((pthread_spinlock_t *)t_current_object) != 0) {
+    block_on_object(t_current_object, "spin lock");
+    finished = false;
+  }
+
+  return finished;
+}
+
+// The caller already posted or unlocked t_current_object with the original function
+void PCT_thread_release_object() {
+  wake_object_waiters(t_current_object);
+  run_highest_priority();
+
+}
+
+// Barriers are modeled entirely, the original pthread_barrier_wait would block
+// the first threads in the kernel. pthread_barrier_init records the count.
+#define MAX_PCT_BARRIERS 64
+
+struct PCT_barrier {
+  pthread_barrier_t *barrier;
+  unsigned int count;
+  unsigned int arrived;
+};
+
+struct PCT_barrier g_PCT_barriers[MAX_PCT_BARRIERS];
+sem_t g_PCT_barriers_lock;
+
+// PTHREAD_BARRIER_SERIAL_THREAD for the last thread PCT_thread_barrier_wait() let through
+__thread int t_PCT_barrier_result = 0;
+
+// Returns the model of barrier, or NULL if pthread_barrier_init was not intercepted for it
+struct PCT_barrier *find_PCT_barrier(pthread_barrier_t *barrier) {
+  for (int i = 0; i < MAX_PCT_BARRIERS; i++) {
+    if (g_PCT_barriers[i].barrier == barrier) {
+      return &g_PCT_barriers[i];
+    }
+  }
+  return NULL;
+}
+
+// The last of count threads releases the others, the earlier ones are blocked until then
+void PCT_thread_barrier_wait() {
+  struct PCT_barrier *entry = find_PCT_barrier((pthread_barrier_t *)t_current_object);
+  assert(entry != NULL);
+  entry->arrived++;
+  if (entry->arrived < entry->count) {
+    t_PCT_barrier_result = 0;
+    block_on_object(t_current_object, "barrier");
+  } else {
+    entry->arrived = 0;
+    t_PCT_barrier_result = PTHREAD_BARRIER_SERIAL_THREAD;
+    wake_object_waiters(t_current_object);
+    run_highest_priority();
+  }
+
+}
+
+// pthread_once is modeled so that a second caller does not wait in the kernel
+// while the first one runs the init routine. It is blocked on the once control
+// until the init routine returned, then the original pthread_once returns
+// right away for it.
+#define MAX_PCT_ONCES 64
+#define ONCE_RUNNING 1
+#define ONCE_DONE 2
+
+struct PCT_once {
+  pthread_once_t *once_control;
+  int state;
+};
+
+struct PCT_once g_PCT_onces[MAX_PCT_ONCES];
+
+// Whether the calling thread runs the init routine of the pthread_once it is in
+__thread bool t_PCT_once_runs = false;
+
+// Returns the model of once_control, a new entry if it has none, or NULL if the table is full
+struct PCT_once *find_PCT_once(pthread_once_t *once_control) {
+  struct PCT_once *free_entry = NULL;
+  for (int i = 0; i < MAX_PCT_ONCES; i++) {
+    if (g_PCT_onces[i].once_control == once_control) {
+      return &g_PCT_onces[i];
+    }
+    if (g_PCT_onces[i].once_control == NULL && free_entry == NULL) {
+      free_entry = &g_PCT_onces[i];
+    }
+  }
+  if (free_entry != NULL) {
+    free_entry->once_control = once_control;
+    free_entry->state = 0;
+  }
+  return free_entry;
+}
+
+// Returns false if another thread runs the init routine of t_current_object and
+// the caller was blocked until it is done
+bool PCT_thread_once() {
+  struct PCT_once *entry = find_PCT_once((pthread_once_t *)t_current_object);
+  bool finished = true;
+  t_PCT_once_runs = false;
+  if (entry == NULL || entry->state == ONCE_DONE) {
+    // Not modeled or already done, the original pthread_once does not block
+  } else if (entry->state == ONCE_RUNNING) {
+    block_on_object(t_current_object, "pthread_once");
+    finished = false;
+  } else {
+    entry->state = ONCE_RUNNING;
+    t_PCT_once_runs = true;
+  }
+
+  return finished;
+}
+
+// The init routine of t_current_object returned, the blocked callers can go on
+void PCT_thread_once_done() {
+  struct PCT_once *entry = find_PCT_once((pthread_once_t *)t_current_object);
+  if (entry != NULL) {
+    entry->state = ONCE_DONE;
+  }
+  wake_object_waiters(t_current_object);
+  run_highest_priority();
+
+}
+
+// Under virtual time a sleeping thread is blocked until the clock reaches
+// t_current_deadline. Returns true once the sleep is over, false if the caller
+// was blocked and has to retry once it gets its turn back.
+bool PCT_thread_sleep() {
+  struct thread_struct *self = &g_threads[t_thread_index];
+  bool finished = true;
+  if (self->timed_out) {
+    self->timed_out = false;
+  } else if (t_current_deadline <= virtual_now()) {
+    // Sleeping for no time still lets a higher priority thread run
+    run_highest_priority();
+  } else {
+    self->wait_stack_depth = capture_stacktrace(self->wait_stack, MAX_STACK_DEPTH);
+    self->timed_wait = true;
+    self->deadline = t_current_deadline;
+    block_thread(t_thread_index);
+    run_highest_priority();
+    finished = false;
+  }
+
+  return finished;
+}
+
+// Returns whether the calling thread's last timed wait under PCT ran out, and resets it
+bool PCT_consume_timeout() {
+  if (t_thread_index == -1 || !g_threads[t_thread_index].timed_out) {
+    return false;
+  }
+  g_threads[t_thread_index].timed_out = false;
+  return true;
+}
+
+// Parks the calling thread until another thread hands it the turn
+void PCT_wait_for_turn() {
+  if (t_PCT_must_wait) {
+    t_PCT_must_wait = false;
+    int previous = overhead_enter(OVERHEAD_WAITING);
+    sem_wait(&(g_semaphores[t_thread_index]));
+    overhead_leave(previous);
+  }
+}
+
+void PCT(int pct_thread_state) {
+  // A blocked lock request is retried every time the thread gets its turn back
+  bool retry = true;
+  while (retry) {
+    retry = false;
+    sem_wait(&g_PCT_main_lock);
+    if (g_stats != NULL) {
+      stats_begin_decision(pct_thread_state);
+    }
+
+    if (!is_spin_state(pct_thread_state)) {
+      end_spin();
+    }
+    // A new thread runs PCT_thread_start() on its own before it was ever picked
+    if (t_thread_index != -1 && pct_thread_state != PCT_THREAD_START) {
+      g_threads[t_thread_index].steps++;
+    }
+
+    if (DEBUG) {
+      sem_wait(&g_print_lock);
+      INFO("======================================================\n");
+      fflush(stdout);
+      sem_post(&g_print_lock);
+    }
+
+    if (pct_thread_state == PCT_INIT_MAIN) {
+      // Create thread for main and give it a random priority
+      PCT_init_main();
+    } else if (pct_thread_state == PCT_THREAD_BEFORE_CREATE) {
+      // Call before orig_pthread_create 
+      PCT_thread_before_create();
+    } else if (pct_thread_state == PCT_THREAD_AFTER_CREATE) {
+      // Call after orig_pthread_create 
+      PCT_thread_after_create();
+    } else if (pct_thread_state == PCT_THREAD_START) {
+      // Call when interpose start routine begins
+      PCT_thread_start();
+    } else if (pct_thread_state == PCT_THREAD_TERMINATE) {
+      // Called when thread terminates or exit has been called
+      PCT_thread_terminate();
+    } else if (pct_thread_state == PCT_THREAD_YIELD) {
+      // Called when pthread_yield is called
+      PCT_thread_yield();
+    } else if (pct_thread_state == PCT_THREAD_LOCK) {
+      // Called when pthread_mutex_lock is called
+      retry = !PCT_thread_lock();
+    } else if (pct_thread_state == PCT_THREAD_UNLOCK) {
+      // Called after the original pthread_mutex_unlock released the mutex
+      PCT_thread_unlock();
+    } else if (pct_thread_state == PCT_THREAD_TRY_LOCK) {
+      // Called when pthread_mutex_trylock is called
+      PCT_thread_trylock();
+    } else if (pct_thread_state == PCT_THREAD_PREEMPT) {
+      // Called from an instrumented code location chosen as a preemption point
+      PCT_thread_preempt();
+    } else if (pct_thread_state == PCT_THREAD_JOIN) {
+      // Called when pthread_join or pthread_timedjoin_np is called
+      retry = !PCT_thread_join();
+    } else if (pct_thread_state == PCT_THREAD_TRY_JOIN) {
+      // Called when pthread_tryjoin_np is called
+      PCT_thread_try_join();
+    } else if (pct_thread_state == PCT_THREAD_DETACH) {
+      // Called when pthread_detach is called
+      PCT_thread_detach();
+    } else if (pct_thread_state == PCT_THREAD_COND_WAIT) {
+      // Called when pthread_cond_wait released the mutex
+      PCT_thread_cond_wait();
+    } else if (pct_thread_state == PCT_THREAD_COND_SIGNAL) {
+      // Called when pthread_cond_signal is called
+      PCT_thread_cond_signal(false);
+    } else if (pct_thread_state == PCT_THREAD_COND_BROADCAST) {
+      // Called when pthread_cond_broadcast is called
+      PCT_thread_cond_signal(true);
+    } else if (pct_thread_state == PCT_THREAD_SLEEP) {
+      // Called when a thread sleeps under virtual time
+      retry = !PCT_thread_sleep();
+    } else if (pct_thread_state == PCT_THREAD_RWLOCK) {
+      // Called when pthread_rwlock_rdlock, wrlock or their timed variants are called
+      retry = !PCT_thread_rwlock(false);
+    } else if (pct_thread_state == PCT_THREAD_RWLOCK_TRY) {
+      // Called when pthread_rwlock_tryrdlock or trywrlock are called
+      PCT_thread_rwlock(true);
+    } else if (pct_thread_state == PCT_THREAD_RWLOCK_UNLOCK) {
+      // Called when pthread_rwlock_unlock is called
+      PCT_thread_rwlock_unlock();
+    } else if (pct_thread_state == PCT_THREAD_SEM_WAIT) {
+      // Called when sem_wait or sem_timedwait is called
+      retry = !PCT_thread_sem_wait();
+    } else if (pct_thread_state == PCT_THREAD_SPIN_LOCK) {
+      // Called when pthread_spin_lock is called
+      retry = !PCT_thread_spin_lock();
+    } else if ((pct_thread_state == PCT_THREAD_SEM_POST) ||
+               (pct_thread_state == PCT_THREAD_SPIN_UNLOCK)) {
+      // Called when sem_post or pthread_spin_unlock is called
+      PCT_thread_release_object();
+    } else if (pct_thread_state == PCT_THREAD_BARRIER_WAIT) {
+      // Called when pthread_barrier_wait is called
+      PCT_thread_barrier_wait();
+    } else if (pct_thread_state == PCT_THREAD_ONCE) {
+      // Called when pthread_once is called
+      retry = !PCT_thread_once();
+    } else if (pct_thread_state == PCT_THREAD_ONCE_DONE) {
+      // Called after the init routine of pthread_once returned
+      PCT_thread_once_done();
+    } else if (pct_thread_state == PCT_THREAD_SPIN) {
+      // Called after pthread_mutex_trylock or another try-lock call failed
+      PCT_thread_spin();
+    }
+    else {
+      if (DEBUG) {
+        sem_wait(&g_print_lock);
+        INFO("PCT_DO_NOTHING\n");
+        fflush(stdout);
+        sem_post(&g_print_lock);
+      }
+    }
+    // else if pct_thread_state == PCT_THREAD_DO_NOTHING
+
+    if (DEBUG) {
+      sem_wait(&g_print_lock);
+      INFO("======================================================\n");
+      fflush(stdout);
+      sem_post(&g_print_lock);
+    }
+
+    if (g_stats != NULL) {
+      stats_end_decision(g_runnable_threads, g_block_threads);
+    }
+    sem_post(&g_PCT_main_lock);
+    PCT_wait_for_turn();
+  }
+  return;
+}
+
+////////////////////////////////////////////////////
+///////////////// RANDOM STREAMS ///////////////////
+////////////////////////////////////////////////////
+
+// rand() is shared by all threads behind a lock, so which thread gets which number
+// depends on the OS interleaving. Every thread draws from its own xoshiro256**
+// stream instead, seeded with splitmix64 from SEED and the thread's stream number.
+// Threads get their numbers in creation order, main has stream 0. The PCT priorities
+// still come from get_priorities(), they are drawn before any thread exists.
+struct random_stream {
+  uint64_t state[4];
+  bool seeded;
+};
+
+__thread struct random_stream t_random_stream;
+// Next stream number handed out by pthread_create
+uint64_t g_random_stream_count = 1;
+
+uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+uint64_t next_random_stream() {
+  return __atomic_fetch_add(&g_random_stream_count, 1, __ATOMIC_RELAXED);
+}
+
+void seed_random_stream(uint64_t stream) {
+  uint64_t state = get_seed() ^ (stream * 0xd1b54a32d192ed03ULL);
+  for (int i = 0; i < 4; i++) {
+    t_random_stream.state[i] = splitmix64(&state);
+  }
+  t_random_stream.seeded = true;
+}
+
+uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+uint64_t random_next() {
+  // Threads testlib did not create take the next free stream
+  if (!t_random_stream.seeded) {
+    seed_random_stream(next_random_stream());
+  }
+  uint64_t *s = t_random_stream.state;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+// Uniform in [0, bound)
+uint32_t random_below(uint32_t bound) {
+  return (uint32_t)(((random_next() >> 32) * bound) >> 32);
+}
+
+// Like rsleep_with_arg() from utils.c, sleeps for a random interval up to mod ms
+void random_sleep(int mod) {
+  assert(mod >= 1);
+  int previous = overhead_enter(OVERHEAD_WAITING);
+  usleep(random_below(mod) * 1000);
+  overhead_leave(previous);
+}
+
+////////////////////////////////////////////////////
+/////////////// SCHEDULING ALGORITHMS //////////////
+////////////////////////////////////////////////////
+
+// The algorithms are strategies, see strategy.h. The hooks other than
+// on_sync_point are only called by the PCT model.
+
+void no_thread_hook(int thread_index) {
+}
+
+void none_sync_point(int pct_thread_state) {
+}
+
+void random_sync_point(int pct_thread_state) {
+  t_real_sleep = true;
+  random_sleep(1000);
+  t_real_sleep = false;
+}
+
+const struct testlib_strategy g_none_strategy = {
+  "none", no_thread_hook, no_thread_hook, none_sync_point,
+  find_highest_priority, no_thread_hook, no_thread_hook, no_thread_hook, pick_cond_waiter
+};
+
+const struct testlib_strategy g_random_strategy = {
+  "random", no_thread_hook, no_thread_hook, random_sync_point,
+  find_highest_priority, no_thread_hook, no_thread_hook, no_thread_hook, pick_cond_waiter
+};
+
+const struct testlib_strategy g_pct_strategy = {
+  "pct", no_thread_hook, no_thread_hook, PCT,
+  find_highest_priority, no_thread_hook, no_thread_hook, no_thread_hook, pick_cond_waiter
+};
+
+#ifndef TESTLIB_ALGORITHM
+// Strategy loaded from STRATEGY, with the hooks it left NULL taken from pct
+struct testlib_strategy g_loaded_strategy;
+// NULL until the first call chose the strategy
+const struct testlib_strategy *g_strategy = NULL;
+// Intercepted calls while the strategy is loaded run unscheduled
+__thread bool t_loading_strategy = false;
+
+// Exits if STRATEGY does not name a shared object defining testlib_strategy
+const struct testlib_strategy *load_strategy(const char *path) {
+#ifdef TESTLIB_STATIC
+  // A statically linked program cannot dlopen a strategy built against libc.so
+  void *handle = NULL;
+  const char *error = "STRATEGY needs testlib.so";
+#else
+  void *handle = dlopen(path, RTLD_NOW);
+  const char *error = handle == NULL ? dlerror() : NULL;
+#endif
+  struct testlib_strategy *loaded = handle == NULL ? NULL :
+    (struct testlib_strategy *)dlsym(handle, "testlib_strategy");
+  if (loaded == NULL) {
+    INFO("Cannot load strategy %s: %s\n", path, error != NULL ? error : dlerror());
+    fflush(stdout);
+    exit(1);
+  }
+
+  g_loaded_strategy = *loaded;
+  if (g_loaded_strategy.name == NULL) {
+    g_loaded_strategy.name = path;
+  }
+  if (g_loaded_strategy.on_thread_create == NULL) {
+    g_loaded_strategy.on_thread_create = no_thread_hook;
+  }
+  if (g_loaded_strategy.on_thread_start == NULL) {
+    g_loaded_strategy.on_thread_start = no_thread_hook;
+  }
+  if (g_loaded_strategy.on_sync_point == NULL) {
+    g_loaded_strategy.on_sync_point = PCT;
+  }
+  if (g_loaded_strategy.pick_next == NULL) {
+    g_loaded_strategy.pick_next = find_highest_priority;
+  }
+  if (g_loaded_strategy.on_block == NULL) {
+    g_loaded_strategy.on_block = no_thread_hook;
+  }
+  if (g_loaded_strategy.on_unblock == NULL) {
+    g_loaded_strategy.on_unblock = no_thread_hook;
+  }
+  if (g_loaded_strategy.on_exit == NULL) {
+    g_loaded_strategy.on_exit = no_thread_hook;
+  }
+  if (g_loaded_strategy.pick_waiter == NULL) {
+    g_loaded_strategy.pick_waiter = pick_cond_waiter;
+  }
+  return &g_loaded_strategy;
+}
+
+const struct testlib_strategy *current_strategy() {
+  const struct testlib_strategy *strategy = __atomic_load_n(&g_strategy, __ATOMIC_ACQUIRE);
+  if (strategy != NULL) {
+    return strategy;
+  }
+  if (t_loading_strategy) {
+    return &g_none_strategy;
+  }
+
+  char *strategy_var = getenv("STRATEGY");
+  if (strategy_var != NULL) {
+    t_loading_strategy = true;
+    strategy = load_strategy(strategy_var);
+    t_loading_strategy = false;
+  } else if (algorithm_ID() == kAlgorithmPCT) {
+    strategy = &g_pct_strategy;
+  } else if (algorithm_ID() == kAlgorithmRandom) {
+    strategy = &g_random_strategy;
+  } else {
+    strategy = &g_none_strategy;
+  }
+  __atomic_store_n(&g_strategy, strategy, __ATOMIC_RELEASE);
+  return strategy;
+}
+#endif
+
+void run_scheduling_algorithm(int pct_thread_state) {
+  int previous = overhead_enter(OVERHEAD_SCHEDULING);
+  stats_count_step();
+  current_strategy()->on_sync_point(pct_thread_state);
+  overhead_leave(previous);
+}
+
+// Exported to loaded strategies, see strategy.h
+
+void testlib_sync_point(int state) {
+  PCT(state);
+}
+
+int testlib_max_threads(void) {
+  return MAX_THREADS;
+}
+
+bool testlib_thread_runnable(int thread_index) {
+  return g_threads[thread_index].state == THREAD_RUNNABLE;
+}
+
+int testlib_current_thread(void) {
+  return g_current_thread;
+}
+
+////////////////////////////////////////////////////
+/////////////// PREEMPTION POINTS //////////////////
+////////////////////////////////////////////////////
+
+// Targets compiled with -fsanitize-coverage=trace-pc (gcc, clang) or
+// trace-pc-guard (clang) call back into testlib.so on every basic block. With
+// PREEMPTION_RATE=n one in n of those callbacks becomes a scheduling point, so
+// random and PCT can switch threads between two plain memory accesses and not
+// only at pthread calls. PREEMPTION_POINTS restricts this to a list of guard
+// numbers (trace-pc-guard) or offsets into the executable (trace-pc).
+
+#define MAX_PREEMPTION_RANGES 32
+// Longest sleep of the random algorithm at a preemption point, in us. Much
+// shorter than random_sleep(1000) since preemption points are far more frequent.
+#define PREEMPTION_SLEEP_US 1000
+
+struct preemption_range {
+  uint64_t first;
+  uint64_t last;
+};
+
+// 0 leaves the coverage callbacks disabled
+int g_preemption_rate = 0;
+// -1 enables every preemption point
+int g_preemption_range_count = -1;
+struct preemption_range g_preemption_ranges[MAX_PREEMPTION_RANGES];
+// Number of guards handed out by __sanitizer_cov_trace_pc_guard_init()
+uint32_t g_preemption_guards = 0;
+// Load address of the executable, subtracted from trace-pc addresses
+uint64_t g_executable_base = 0;
+
+// Returns 0 (preemption points disabled) when PREEMPTION_RATE is not set
+int get_preemption_rate() {
+  char *rate_var = getenv("PREEMPTION_RATE");
+  if (rate_var == NULL) {
+    return 0;
+  }
+  int rate = atoi(rate_var);
+  return rate < 0 ? 0 : rate;
+}
+
+// The executable is always the first object dl_iterate_phdr() reports
+int find_executable_base(struct dl_phdr_info *info, size_t size, void *data) {
+  g_executable_base = info->dlpi_addr;
+  return 1;
+}
+
+// Parses PREEMPTION_POINTS, a comma separated list of numbers and ranges like "3,10-20,0x1189"
+void init_preemption_points() {
+  g_preemption_rate = get_preemption_rate();
+  dl_iterate_phdr(find_executable_base, NULL);
+  char *points_var = getenv("PREEMPTION_POINTS");
+  if (points_var == NULL) {
+    return;
+  }
+  g_preemption_range_count = 0;
+  char *current = points_var;
+  while (*current != '\0' && g_preemption_range_count < MAX_PREEMPTION_RANGES) {
+    char *end;
+    struct preemption_range *range = &g_preemption_ranges[g_preemption_range_count];
+    range->first = strtoull(current, &end, 0);
+    range->last = range->first;
+    if (*end == '-') {
+      range->last = strtoull(end + 1, &end, 0);
+    }
+    if (end == current) {
+      // Not a number, skip to the next entry
+      end = strchr(current, ',');
+      if (end == NULL) {
+        break;
+      }
+    } else {
+      g_preemption_range_count++;
+    }
+    current = *end == ',' ? end + 1 : end;
+  }
+}
+
+bool preemption_point_enabled(uint64_t point) {
+  if (g_preemption_range_count == -1) {
+    return true;
+  }
+  for (int i = 0; i < g_preemption_range_count; i++) {
+    if (point >= g_preemption_ranges[i].first && point <= g_preemption_ranges[i].last) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void preemption_point(uint64_t point) {
+  // Threads testlib does not schedule, like pool workers between jobs, are never preempted
+  if (t_thread_index == -1 || random_below(g_preemption_rate) != 0) {
+    return;
+  }
+  int algorithm = algorithm_ID();
+  if (algorithm == kAlgorithmNone) {
+    return;
+  }
+
+  sem_wait(&g_print_lock);
+  INFO("PREEMPTION POINT 0x%lx\n", (unsigned long)point);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  if (algorithm == kAlgorithmRandom) {
+    t_real_sleep = true;
+    usleep(random_below(PREEMPTION_SLEEP_US));
+    t_real_sleep = false;
+  } else {
+    run_scheduling_algorithm(PCT_THREAD_PREEMPT);
+  }
+}
+
+void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
+  if (start == stop || *start != 0) {
+    return;
+  }
+  // A guard left at 0 is disabled and its callback returns right away
+  for (uint32_t *guard = start; guard < stop; guard++) {
+    uint32_t number = ++g_preemption_guards;
+    *guard = preemption_point_enabled(number) ? number : 0;
+  }
+}
+
+void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
+  if (*guard == 0 || g_preemption_rate == 0) {
+    return;
+  }
+  preemption_point(*guard);
+}
+
+void __sanitizer_cov_trace_pc() {
+  if (g_preemption_rate == 0) {
+    return;
+  }
+  // Offsets into the executable stay the same between runs, unlike addresses under ASLR
+  uint64_t offset = (uint64_t)__builtin_return_address(0) - g_executable_base;
+  if (preemption_point_enabled(offset)) {
+    preemption_point(offset);
+  }
+}
+
+////////////////////////////////////////////////////
+////////////////////////////////////////////////////
+
+// Thread Management
+void *interpose_start_routine(void *argument) {
+  // Deconstruct the struct into [ function to execute, arg ]
+  sem_wait(&g_general_lock);
+  struct arg_struct *arguments = argument;
+  void *(*start_routine) (void *) = arguments->struct_func;
+  void *arg = arguments->struct_arg;
+  // Tell which semaphore this thread should wait on
+  int thread_index = arguments->thread_index;
+  uint64_t random_stream = arguments->random_stream;
+  sem_post(&g_general_lock);
+  t_arg_struct = arguments;
+  // A pooled OS thread runs one start routine after another
+  t_thread_finished = false;
+  overhead_thread_start(OVERHEAD_WRAPPER);
+
+  seed_random_stream(random_stream);
+  
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("ENTER interpose_start_routine() - thread_index = %d - thread_id = %ld - thread_number = %d - waiting on semaphore\n", 
+         thread_index, 
+         g_threads[thread_index].thread_id,
+         g_threads[thread_index].thread_number);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  // Needs to tell pthread_start what semaphores to wait on
+  if (algorithm_ID() == kAlgorithmPCT) {
+    t_thread_index = thread_index;
+  }
+
+  run_scheduling_algorithm(PCT_THREAD_START);
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("interpose_start_routine() - start_routine = %p - thread_number = %d\n",
+         start_routine,
+         g_threads[t_thread_index].thread_number);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  sem_wait(&g_count_lock);
+  if (algorithm_ID() != kAlgorithmPCT) {
+    g_thread_count++;
+  }
+  // High-churn programs can create more than MAX_THREADS threads over their lifetime
+  if (g_thread_count < MAX_THREADS) {
+    g_thread_ids[g_thread_count] = gettid();
+  }
+  sem_post(&g_count_lock);
+
+  int thread_number;
+  if (algorithm_ID() == kAlgorithmPCT) {
+    thread_number = g_threads[t_thread_index].thread_number;
+  } else {
+    thread_number = find_thread_number(gettid());
+    register_thread(thread_number);
+  }
+  race_thread_start(arguments);
+
+  overhead_thread_number(thread_number);
+
+  sem_wait(&g_print_lock);
+  INFO("THREAD CREATED (%d, %ld)\n", thread_number, gettid());
+  fflush(stdout);
+  sem_post(&g_print_lock);
+  
+  // Execute the function for the thread as normal
+  overhead_enter(OVERHEAD_USER);
+  void *return_val = start_routine(arg);
+  overhead_enter(OVERHEAD_WRAPPER);
+
+  race_thread_exit();
+  run_scheduling_algorithm(PCT_THREAD_TERMINATE);
+  if (algorithm_ID() != kAlgorithmPCT) {
+    unregister_thread();
+  }
+  release_thread_arg_struct();
+
+  sem_wait(&g_print_lock);
+  INFO("THREAD EXITED (%d, %ld)\n", thread_number, gettid());
+  fflush(stdout);
+  sem_post(&g_print_lock);
+  overhead_thread_exit();
+  return return_val;
+}
+
+////////////////////////////////////////////////////
+/////////////////// THREAD POOL ////////////////////
+////////////////////////////////////////////////////
+
+// Optional mode (THREAD_POOL=<n>) where pthread_create hands the start routine
+// to one of n OS threads spawned in init_testlib() instead of creating a new one.
+// The pthread_t given back to the program is the address of the pool slot, so
+// pthread_join, pthread_detach, pthread_exit and pthread_self map it back here.
+// pthread_exit inside a pooled thread longjmps back to the worker loop, which
+// means cleanup handlers and TLS destructors of the program do not run, and the
+// __thread variables of the program keep the values of the worker's previous job.
+// The other calls taking a pthread_t reach the worker's OS thread through
+// pool_os_thread(), except pthread_cancel, which would unwind the worker loop.
+#define POOL_IDLE 0
+#define POOL_BUSY 1
+#define POOL_FINISHED 2
+
+struct pool_worker {
+  pthread_t os_thread;
+  int state;
+  bool detached;
+  struct arg_struct *job;
+  void *retval;
+  // Posted by pthread_create when a job is handed to the worker
+  sem_t start_sem;
+  // Posted by the worker when the job is done and can be joined
+  sem_t done_sem;
+  jmp_buf exit_env;
+};
+
+struct pool_worker g_pool_workers[MAX_THREADS];
+int g_pool_size = 0;
+sem_t g_pool_lock;
+
+// Pool slot of the calling OS thread, NULL if it is not a pool worker
+__thread struct pool_worker *t_pool_worker = NULL;
+
+// Returns 0 (pool disabled) when THREAD_POOL is not set
+int get_thread_pool_size() {
+  char *pool_var = getenv("THREAD_POOL");
+  if (pool_var == NULL) {
+    return 0;
+  }
+  int size = atoi(pool_var);
+  if (size < 0) {
+    return 0;
+  }
+  return size > MAX_THREADS ? MAX_THREADS : size;
+}
+
+struct pool_worker *pool_worker_from_handle(pthread_t handle) {
+  if (g_pool_size == 0) {
+    return NULL;
+  }
+  uintptr_t address = (uintptr_t)handle;
+  uintptr_t first = (uintptr_t)&g_pool_workers[0];
+  uintptr_t last = (uintptr_t)&g_pool_workers[g_pool_size - 1];
+  if (address < first || address > last ||
+      (address - first) % sizeof(struct pool_worker) != 0) {
+    return NULL;
+  }
+  return (struct pool_worker *)address;
+}
+
+// Replaces a pool handle in *thread with the OS thread of its worker, other handles
+// are left alone. Returns false once the job was joined, or detached and finished,
+// since the worker may run another job by then. With running_only also once the
+// job finished, for the calls that act on the running thread like pthread_kill.
+bool pool_os_thread(pthread_t *thread, bool running_only) {
+  struct pool_worker *worker = pool_worker_from_handle(*thread);
+  if (worker == NULL) {
+    return true;
+  }
+  sem_wait(&g_pool_lock);
+  int state = worker->state;
+  sem_post(&g_pool_lock);
+  if (state == POOL_IDLE || (running_only && state != POOL_BUSY)) {
+    return false;
+  }
+  *thread = worker->os_thread;
+  return true;
+}
+
+// The kernel tid of a worker is shared by every job it runs, so drop it from
+// g_thread_ids once a job is done or find_thread_number() would return a stale number.
+void pool_forget_thread_id() {
+  long int tid = gettid();
+  sem_wait(&g_count_lock);
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if (g_thread_ids[i] == tid) {
+      g_thread_ids[i] = 0;
+    }
+  }
+  sem_post(&g_count_lock);
+}
+
+void *pool_worker_routine(void *argument) {
+  struct pool_worker *worker = argument;
+  t_pool_worker = worker;
+
+  while (true) {
+    // Parked until pthread_create hands us a job
+    sem_wait(&worker->start_sem);
+
+    if (setjmp(worker->exit_env) == 0) {
+      worker->retval = interpose_start_routine(worker->job);
+    }
+    // else: pthread_exit() already stored retval
+
+    pool_forget_thread_id();
+
+    sem_wait(&g_pool_lock);
+    worker->job = NULL;
+    if (worker->detached) {
+      worker->state = POOL_IDLE;
+    } else {
+      worker->state = POOL_FINISHED;
+      sem_post(&worker->done_sem);
+    }
+    sem_post(&g_pool_lock);
+  }
+  return NULL;
+}
+
+void init_thread_pool() {
+  g_pool_size = get_thread_pool_size();
+  sem_init(&g_pool_lock, 0, 1);
+  if (g_pool_size == 0) {
+    return;
+  }
+
+  pthread_create_type orig_create;
+  orig_create = (pthread_create_type)real_symbol(REAL_pthread_create);
+
+  for (int i = 0; i < g_pool_size; i++) {
+    struct pool_worker *worker = &g_pool_workers[i];
+    worker->state = POOL_IDLE;
+    worker->detached = false;
+    worker->job = NULL;
+    worker->retval = NULL;
+    sem_init(&worker->start_sem, 0, 0);
+    sem_init(&worker->done_sem, 0, 0);
+    if (orig_create(&worker->os_thread, NULL, &pool_worker_routine, (void *)worker) != 0) {
+      // Shrink the pool to the workers we managed to spawn
+      g_pool_size = i;
+      break;
+    }
+  }
+}
+
+// Hands args to an idle worker and stores its handle in *thread.
+// Returns false if the pool is disabled or every worker is busy.
+bool pool_dispatch(pthread_t *thread, struct arg_struct *args) {
+  struct pool_worker *worker = NULL;
+
+  sem_wait(&g_pool_lock);
+  for (int i = 0; i < g_pool_size; i++) {
+    if (g_pool_workers[i].state == POOL_IDLE) {
+      worker = &g_pool_workers[i];
+      worker->state = POOL_BUSY;
+      worker->detached = false;
+      worker->job = args;
+      worker->retval = NULL;
+      break;
+    }
+  }
+  sem_post(&g_pool_lock);
+
+  if (worker == NULL) {
+    return false;
+  }
+  *thread = (pthread_t)worker;
+  sem_post(&worker->start_sem);
+  return true;
+}
+
+// Hands the result of a finished job to the joiner and recycles the worker
+void pool_join_finished(struct pool_worker *worker, void **retval) {
+  if (retval != NULL) {
+    *retval = worker->retval;
+  }
+  sem_wait(&g_pool_lock);
+  worker->state = POOL_IDLE;
+  sem_post(&g_pool_lock);
+}
+
+void pool_join(struct pool_worker *worker, void **retval) {
+  sem_wait(&worker->done_sem);
+  pool_join_finished(worker, retval);
+}
+
+// Like pool_join() but fails with EBUSY if abstime is NULL and the job is not done,
+// or with ETIMEDOUT if it is not done by abstime
+int pool_timedjoin(struct pool_worker *worker, void **retval, const struct timespec *abstime) {
+  if (abstime == NULL && sem_trywait(&worker->done_sem) != 0) {
+    return EBUSY;
+  }
+  if (abstime != NULL && sem_timedwait(&worker->done_sem, abstime) != 0) {
+    return errno;
+  }
+  pool_join_finished(worker, retval);
+  return 0;
+}
+
+void pool_detach(struct pool_worker *worker) {
+  sem_wait(&g_pool_lock);
+  worker->detached = true;
+  if (worker->state == POOL_FINISHED) {
+    // Nobody will join it, recycle the slot now
+    sem_wait(&worker->done_sem);
+    worker->state = POOL_IDLE;
+  }
+  sem_post(&g_pool_lock);
+}
+
+////////////////////////////////////////////////////
+///////////////// FAULT INJECTION //////////////////
+////////////////////////////////////////////////////
+
+// Seeded failures that are legal but rare in real runs: pthread_cond_wait
+// returning without a signal (SPURIOUS_WAKEUP_RATE=n) and pthread_mutex_trylock
+// failing with EBUSY (TRYLOCK_FAILURE_RATE=n), each for one in n calls.
+// Every call that could fail gets a sequence number and each injected fault is
+// logged as "FAULT <n>". INJECT_FAULTS=<n>,<n>,... injects exactly those faults
+// again, which replays a run together with its SEED under PCT.
+
+#define FAULT_SPURIOUS_WAKEUP 0
+#define FAULT_TRYLOCK_BUSY 1
+#define FAULT_KINDS 2
+#define MAX_REPLAYED_FAULTS 64
+
+// 0 disables a kind of fault
+int g_fault_rates[FAULT_KINDS] = { 0 };
+bool g_faults_enabled = false;
+int g_fault_sequence = 0;
+// -1 injects faults by rate instead of replaying INJECT_FAULTS
+int g_replayed_fault_count = -1;
+int g_replayed_faults[MAX_REPLAYED_FAULTS];
+sem_t g_fault_lock;
+
+// Returns 0 (fault disabled) when the variable is not set
+int get_fault_rate(const char *name) {
+  char *rate_var = getenv(name);
+  if (rate_var == NULL) {
+    return 0;
+  }
+  int rate = atoi(rate_var);
+  return rate < 0 ? 0 : rate;
+}
+
+void init_fault_injection() {
+  sem_init(&g_fault_lock, 0, 1);
+  g_fault_rates[FAULT_SPURIOUS_WAKEUP] = get_fault_rate("SPURIOUS_WAKEUP_RATE");
+  g_fault_rates[FAULT_TRYLOCK_BUSY] = get_fault_rate("TRYLOCK_FAILURE_RATE");
+
+  char *replay_var = getenv("INJECT_FAULTS");
+  if (replay_var != NULL) {
+    g_replayed_fault_count = 0;
+    char *current = replay_var;
+    while (*current != '\0' && g_replayed_fault_count < MAX_REPLAYED_FAULTS) {
+      char *end;
+      int sequence = strtol(current, &end, 10);
+      if (end == current) {
+        break;
+      }
+      g_replayed_faults[g_replayed_fault_count++] = sequence;
+      current = *end == ',' ? end + 1 : end;
+    }
+  }
+  g_faults_enabled = g_replayed_fault_count != -1 ||
+                     g_fault_rates[FAULT_SPURIOUS_WAKEUP] > 0 ||
+                     g_fault_rates[FAULT_TRYLOCK_BUSY] > 0;
+}
+
+// Returns the sequence number of the fault if the calling function should fail, -1 otherwise
+int inject_fault(int fault) {
+  if (!g_faults_enabled) {
+    return -1;
+  }
+  sem_wait(&g_fault_lock);
+  int sequence = g_fault_sequence++;
+  bool inject = false;
+  if (g_replayed_fault_count != -1) {
+    for (int i = 0; i < g_replayed_fault_count; i++) {
+      inject = inject || g_replayed_faults[i] == sequence;
+    }
+  } else if (g_fault_rates[fault] > 0) {
+    inject = random_below(g_fault_rates[fault]) == 0;
+  }
+  sem_post(&g_fault_lock);
+  return inject ? sequence : -1;
+}
+
+// pthread_cond_wait returning without a signal still releases the mutex and
+// gives other threads a chance to take it before reacquiring it
+int spurious_cond_wait(pthread_mutex_t *mutex) {
+  real_mutex_unlock(mutex);
+
+  t_current_mutex = mutex;
+
+  run_scheduling_algorithm(PCT_THREAD_UNLOCK);
+
+  t_current_mutex = mutex;
+
+  run_scheduling_algorithm(PCT_THREAD_LOCK);
+  return real_mutex_lock(mutex);
+}
+
+////////////////////////////////////////////////////
+////////// BEGINNING OF PTHREAD FUNCTIONS //////////
+////////////////////////////////////////////////////
+
+int WRAPPER(pthread_create)(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine) (void *), void *arg) {
+  PASS_THROUGH(pthread_create, thread, attr, start_routine, arg);
+  ENTER_WRAPPER(REAL_pthread_create);
+  pthread_create_type orig_create;
+  orig_create = (pthread_create_type)real_symbol(REAL_pthread_create);
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("======================================================\n");
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  t_current_start_routine = start_routine;
+  t_current_start_arg = arg;
+  run_scheduling_algorithm(PCT_THREAD_BEFORE_CREATE);
+
+  // Struct for multiple args
+  struct arg_struct *args = alloc_arg_struct();
+  args->struct_func = start_routine;
+  args->struct_arg = arg;
+  args->random_stream = next_random_stream();
+  // t_new_thread_index is set in PCT_thread_before_create() to be this thread
+  // that is about to be created
+  args->thread_index = t_new_thread_index;
+  race_thread_create(args, attr);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_create(%p, %p, %p, %p)\n", thread, attr, start_routine, arg);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = 0;
+  // Pool workers are spawned with default attributes, so only default threads use them
+  if (attr != NULL || !pool_dispatch(thread, args)) {
+    return_val = orig_create(thread, attr, &interpose_start_routine, (void *)args);
+  }
+  if (return_val != 0) {
+    free_arg_struct(args);
+  }
+
+  t_new_thread_handle = return_val == 0 ? *thread : 0;
+  run_scheduling_algorithm(PCT_THREAD_AFTER_CREATE);
+
+  sem_wait(&g_print_lock);  
+  INFO("RETURN pthread_create(%p, %p, %p, %p) = %d\n", thread, attr, start_routine, arg, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("======================================================\n");
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  return return_val;
+}
+
+void WRAPPER(pthread_exit)(void *retval) {
+  if (fixed_algorithm_none()) {
+    ((pthread_exit_type)real_symbol(REAL_pthread_exit))(retval);
+  }
+  ENTER_WRAPPER(REAL_pthread_exit);
+  pthread_exit_type orig_exit;
+  orig_exit = (pthread_exit_type)real_symbol(REAL_pthread_exit);
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("======================================================\n");
+    fflush(stdout);
+    INFO("ENTER pthread_exit - g_current_thread = %d\n", g_current_thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);  
+  INFO("CALL pthread_exit(%p)\n", retval);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  // Only logged, unused without logging
+  __attribute__((unused)) int thread_number;
+  if (algorithm_ID() == kAlgorithmPCT) {
+    sem_wait(&g_general_lock);
+    thread_number = g_threads[t_thread_index].thread_number;
+    sem_post(&g_general_lock);
+  }
+
+  race_thread_exit();
+  run_scheduling_algorithm(PCT_THREAD_TERMINATE);
+  if (algorithm_ID() != kAlgorithmPCT) {
+    unregister_thread();
+  }
+  release_thread_arg_struct();
+
+  sem_wait(&g_print_lock);
+
+  if (algorithm_ID() != kAlgorithmPCT) {
+    thread_number = find_thread_number(gettid());
+  }
+  INFO("THREAD EXITED (%d, %ld)\n", thread_number, gettid());
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("======================================================\n");
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  overhead_thread_exit();
+  if (t_pool_worker != NULL) {
+    // Hand the slot back to the worker loop instead of killing the pooled OS thread
+    t_pool_worker->retval = retval;
+    longjmp(t_pool_worker->exit_env, 1);
+  }
+
+  orig_exit(retval);
+}
+
+// Joins thread once the scheduler let the caller go on. try_join selects
+// pthread_tryjoin_np, abstime pthread_timedjoin_np. Under PCT the target already
+// terminated in the model and has no scheduling point left, so a blocking join
+// keeps the outcome independent of how fast the kernel reaps it.
+int join_thread(pthread_t thread, void **retval, bool try_join, const struct timespec *abstime) {
+  bool blocking = algorithm_ID() == kAlgorithmPCT || (!try_join && abstime == NULL);
+  int return_val;
+
+  struct pool_worker *worker = pool_worker_from_handle(thread);
+  if (worker != NULL && blocking) {
+    pool_join(worker, retval);
+    return_val = 0;
+  } else if (worker != NULL) {
+    struct timespec real;
+    return_val = pool_timedjoin(worker, retval, real_abstime(abstime, &real));
+  } else if (blocking) {
+    pthread_join_type orig_join;
+    orig_join = (pthread_join_type)real_symbol(REAL_pthread_join);
+    return_val = BLOCKING_ORIGINAL(orig_join(thread, retval));
+  } else if (try_join) {
+    pthread_tryjoin_np_type orig_tryjoin;
+    orig_tryjoin = (pthread_tryjoin_np_type)real_symbol(REAL_pthread_tryjoin_np);
+    return_val = orig_tryjoin(thread, retval);
+  } else {
+    pthread_timedjoin_np_type orig_timedjoin;
+    orig_timedjoin = (pthread_timedjoin_np_type)real_symbol(REAL_pthread_timedjoin_np);
+    struct timespec real;
+    return_val = BLOCKING_ORIGINAL(orig_timedjoin(thread, retval, real_abstime(abstime, &real)));
+  }
+
+  if (return_val == ETIMEDOUT && abstime != NULL) {
+    virtual_timeout_expired(abstime);
+  }
+
+  if (return_val == 0) {
+    race_thread_join(thread);
+  }
+  return return_val;
+}
+
+int WRAPPER(pthread_join)(pthread_t thread, void **retval) {
+  PASS_THROUGH(pthread_join, thread, retval);
+  ENTER_WRAPPER(REAL_pthread_join);
+  t_current_join_thread = thread;
+  t_current_timed = false;
+
+  // Under PCT the caller is blocked here until the thread terminated
+  run_scheduling_algorithm(PCT_THREAD_JOIN);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_join(%lu, %p)\n", (unsigned long)thread, retval);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = t_PCT_join_error;
+  t_PCT_join_error = 0;
+  if (return_val == 0) {
+    return_val = join_thread(thread, retval, false, NULL);
+  }
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_join(%lu, %p) = %d\n", (unsigned long)thread, retval, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_tryjoin_np)(pthread_t thread, void **retval) {
+  PASS_THROUGH(pthread_tryjoin_np, thread, retval);
+  ENTER_WRAPPER(REAL_pthread_tryjoin_np);
+  t_current_join_thread = thread;
+
+  run_scheduling_algorithm(PCT_THREAD_TRY_JOIN);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_tryjoin_np(%lu, %p)\n", (unsigned long)thread, retval);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = t_PCT_join_error;
+  t_PCT_join_error = 0;
+  if (return_val == 0) {
+    return_val = join_thread(thread, retval, true, NULL);
+  }
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_tryjoin_np(%lu, %p) = %d\n", (unsigned long)thread, retval, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_timedjoin_np)(pthread_t thread, void **retval, const struct timespec *abstime) {
+  PASS_THROUGH(pthread_timedjoin_np, thread, retval, abstime);
+  ENTER_WRAPPER(REAL_pthread_timedjoin_np);
+  t_current_join_thread = thread;
+  t_current_timed = true;
+  t_current_deadline = timed_wait_deadline(abstime);
+
+  // Under PCT the timeout only expires once no other thread can run
+  run_scheduling_algorithm(PCT_THREAD_JOIN);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_timedjoin_np(%lu, %p, %p)\n", (unsigned long)thread, retval, abstime);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = t_PCT_join_error;
+  t_PCT_join_error = 0;
+  if (return_val == 0) {
+    return_val = join_thread(thread, retval, false, abstime);
+  }
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_timedjoin_np(%lu, %p, %p) = %d\n",
+       (unsigned long)thread, retval, abstime, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_detach)(pthread_t thread) {
+  PASS_THROUGH(pthread_detach, thread);
+  ENTER_WRAPPER(REAL_pthread_detach);
+  t_current_join_thread = thread;
+
+  run_scheduling_algorithm(PCT_THREAD_DETACH);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_detach(%lu)\n", (unsigned long)thread);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = 0;
+  struct pool_worker *worker = pool_worker_from_handle(thread);
+  if (worker != NULL) {
+    pool_detach(worker);
+  } else {
+    pthread_detach_type orig_detach;
+    orig_detach = (pthread_detach_type)real_symbol(REAL_pthread_detach);
+    return_val = orig_detach(thread);
+  }
+  if (return_val == 0) {
+    race_thread_detach(thread);
+  }
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_detach(%lu) = %d\n", (unsigned long)thread, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+pthread_t WRAPPER(pthread_self)(void) {
+  PASS_THROUGH(pthread_self);
+  ENTER_WRAPPER(REAL_pthread_self);
+  if (t_pool_worker != NULL && t_pool_worker->state == POOL_BUSY) {
+    return (pthread_t)t_pool_worker;
+  }
+
+  pthread_self_type orig_self;
+  orig_self = (pthread_self_type)real_symbol(REAL_pthread_self);
+  return orig_self();
+}
+
+// Thread handles: the calls below take a pthread_t but are no scheduling points,
+// they are only intercepted to map the handles of THREAD_POOL jobs to OS threads
+int WRAPPER(pthread_kill)(pthread_t thread, int sig) {
+  PASS_THROUGH(pthread_kill, thread, sig);
+  ENTER_WRAPPER(REAL_pthread_kill);
+  if (!pool_os_thread(&thread, true)) {
+    return ESRCH;
+  }
+  pthread_kill_type orig_kill;
+  orig_kill = (pthread_kill_type)real_symbol(REAL_pthread_kill);
+  return orig_kill(thread, sig);
+}
+
+int WRAPPER(pthread_sigqueue)(pthread_t thread, int sig, const union sigval value) {
+  PASS_THROUGH(pthread_sigqueue, thread, sig, value);
+  ENTER_WRAPPER(REAL_pthread_sigqueue);
+  if (!pool_os_thread(&thread, true)) {
+    return ESRCH;
+  }
+  pthread_sigqueue_type orig_sigqueue;
+  orig_sigqueue = (pthread_sigqueue_type)real_symbol(REAL_pthread_sigqueue);
+  return orig_sigqueue(thread, sig, value);
+}
+
+int WRAPPER(pthread_cancel)(pthread_t thread) {
+  PASS_THROUGH(pthread_cancel, thread);
+  ENTER_WRAPPER(REAL_pthread_cancel);
+  if (pool_worker_from_handle(thread) != NULL) {
+    sem_wait(&g_print_lock);
+    INFO("pthread_cancel(%lu) is not supported on THREAD_POOL threads\n", (unsigned long)thread);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+    return ENOTSUP;
+  }
+  pthread_cancel_type orig_cancel;
+  orig_cancel = (pthread_cancel_type)real_symbol(REAL_pthread_cancel);
+  return orig_cancel(thread);
+}
+
+int WRAPPER(pthread_setname_np)(pthread_t thread, const char *name) {
+  PASS_THROUGH(pthread_setname_np, thread, name);
+  ENTER_WRAPPER(REAL_pthread_setname_np);
+  if (!pool_os_thread(&thread, false)) {
+    return ESRCH;
+  }
+  pthread_name_np_type orig_setname;
+  orig_setname = (pthread_name_np_type)real_symbol(REAL_pthread_setname_np);
+  return orig_setname(thread, name);
+}
+
+int WRAPPER(pthread_getname_np)(pthread_t thread, char *name, size_t length) {
+  PASS_THROUGH(pthread_getname_np, thread, name, length);
+  ENTER_WRAPPER(REAL_pthread_getname_np);
+  if (!pool_os_thread(&thread, false)) {
+    return ESRCH;
+  }
+  pthread_name_np_type orig_getname;
+  orig_getname = (pthread_name_np_type)real_symbol(REAL_pthread_getname_np);
+  return orig_getname(thread, name, length);
+}
+
+int WRAPPER(pthread_getattr_np)(pthread_t thread, pthread_attr_t *attr) {
+  PASS_THROUGH(pthread_getattr_np, thread, attr);
+  ENTER_WRAPPER(REAL_pthread_getattr_np);
+  if (!pool_os_thread(&thread, false)) {
+    return ESRCH;
+  }
+  pthread_getattr_np_type orig_getattr;
+  orig_getattr = (pthread_getattr_np_type)real_symbol(REAL_pthread_getattr_np);
+  return orig_getattr(thread, attr);
+}
+
+int WRAPPER(pthread_getschedparam)(pthread_t thread, int *policy, struct sched_param *param) {
+  PASS_THROUGH(pthread_getschedparam, thread, policy, param);
+  ENTER_WRAPPER(REAL_pthread_getschedparam);
+  if (!pool_os_thread(&thread, false)) {
+    return ESRCH;
+  }
+  pthread_schedparam_type orig_getschedparam;
+  orig_getschedparam = (pthread_schedparam_type)real_symbol(REAL_pthread_getschedparam);
+  return orig_getschedparam(thread, policy, param);
+}
+
+int WRAPPER(pthread_setschedparam)(pthread_t thread, int policy, const struct sched_param *param) {
+  PASS_THROUGH(pthread_setschedparam, thread, policy, param);
+  ENTER_WRAPPER(REAL_pthread_setschedparam);
+  if (!pool_os_thread(&thread, false)) {
+    return ESRCH;
+  }
+  pthread_schedparam_type orig_setschedparam;
+  orig_setschedparam = (pthread_schedparam_type)real_symbol(REAL_pthread_setschedparam);
+  return orig_setschedparam(thread, policy, param);
+}
+
+int WRAPPER(pthread_setschedprio)(pthread_t thread, int priority) {
+  PASS_THROUGH(pthread_setschedprio, thread, priority);
+  ENTER_WRAPPER(REAL_pthread_setschedprio);
+  if (!pool_os_thread(&thread, false)) {
+    return ESRCH;
+  }
+  pthread_setschedprio_type orig_setschedprio;
+  orig_setschedprio = (pthread_setschedprio_type)real_symbol(REAL_pthread_setschedprio);
+  return orig_setschedprio(thread, priority);
+}
+
+int WRAPPER(pthread_getaffinity_np)(pthread_t thread, size_t size, cpu_set_t *cpuset) {
+  PASS_THROUGH(pthread_getaffinity_np, thread, size, cpuset);
+  ENTER_WRAPPER(REAL_pthread_getaffinity_np);
+  if (!pool_os_thread(&thread, false)) {
+    return ESRCH;
+  }
+  pthread_affinity_np_type orig_getaffinity;
+  orig_getaffinity = (pthread_affinity_np_type)real_symbol(REAL_pthread_getaffinity_np);
+  return orig_getaffinity(thread, size, cpuset);
+}
+
+int WRAPPER(pthread_setaffinity_np)(pthread_t thread, size_t size, const cpu_set_t *cpuset) {
+  PASS_THROUGH(pthread_setaffinity_np, thread, size, cpuset);
+  ENTER_WRAPPER(REAL_pthread_setaffinity_np);
+  if (!pool_os_thread(&thread, false)) {
+    return ESRCH;
+  }
+  pthread_affinity_np_type orig_setaffinity;
+  orig_setaffinity = (pthread_affinity_np_type)real_symbol(REAL_pthread_setaffinity_np);
+  return orig_setaffinity(thread, size, cpuset);
+}
+
+int WRAPPER(pthread_getcpuclockid)(pthread_t thread, clockid_t *clock) {
+  PASS_THROUGH(pthread_getcpuclockid, thread, clock);
+  ENTER_WRAPPER(REAL_pthread_getcpuclockid);
+  if (!pool_os_thread(&thread, false)) {
+    return ESRCH;
+  }
+  pthread_getcpuclockid_type orig_getcpuclockid;
+  orig_getcpuclockid = (pthread_getcpuclockid_type)real_symbol(REAL_pthread_getcpuclockid);
+  return orig_getcpuclockid(thread, clock);
+}
+
+// Since glibc 2.34 pthread.h redirects pthread_yield to sched_yield, so this is
+// defined as sched_yield and std::this_thread::yield ends up here as well. The
+// pthread_yield of libc calls sched_yield again, so the original is sched_yield.
+int WRAPPER(sched_yield)(void) {
+  PASS_THROUGH(sched_yield);
+  ENTER_WRAPPER(REAL_sched_yield);
+  pthread_yield_type orig_yield;
+  orig_yield = (pthread_yield_type)real_symbol(REAL_sched_yield);
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("======================================================\n");
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+
+  // PCT_DO_NOTHING would end the spin, and a yield loop would never be demoted
+  run_scheduling_algorithm(PCT_THREAD_CALL);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_yield()\n");
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = orig_yield();
+
+  run_scheduling_algorithm(PCT_THREAD_YIELD);
+
+  sem_wait(&g_print_lock);  
+  INFO("RETURN pthread_yield() = %d\n", return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  if (DEBUG) {
+    sem_wait(&g_print_lock);
+    INFO("======================================================\n");
+    fflush(stdout);
+    sem_post(&g_print_lock);
+  }
+  return return_val;
+}
+
+// Condition variables
+
+// pthread_cond_wait under PCT, see PCT_thread_cond_wait(). With abstime it is
+// pthread_cond_timedwait and returns ETIMEDOUT if nobody signaled in time.
+int PCT_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime) {
+  real_mutex_unlock(mutex);
+
+  t_current_cond = cond;
+  t_current_mutex = mutex;
+  t_current_timed = abstime != NULL;
+  t_current_deadline = abstime != NULL ? timed_wait_deadline(abstime) : 0;
+
+  run_scheduling_algorithm(PCT_THREAD_COND_WAIT);
+  int return_val = PCT_consume_timeout() ? ETIMEDOUT : 0;
+
+  // Getting the mutex back has no timeout
+  t_current_mutex = mutex;
+  t_current_timed = false;
+
+  run_scheduling_algorithm(PCT_THREAD_LOCK);
+  real_mutex_lock(mutex);
+  return return_val;
+}
+
+int WRAPPER(pthread_cond_wait)(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+  PASS_THROUGH(pthread_cond_wait, cond, mutex);
+  ENTER_WRAPPER(REAL_pthread_cond_wait);
+  pthread_cond_wait_type orig_cond_wait;
+  orig_cond_wait = (pthread_cond_wait_type)real_symbol(REAL_pthread_cond_wait);
+
+  run_scheduling_algorithm(PCT_THREAD_CALL);
+
+  sem_wait(&g_print_lock);  
+  INFO("CALL pthread_cond_wait(%p, %p)\n", cond, mutex);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  // The mutex is released while waiting and held again when orig_cond_wait returns
+  lock_graph_released(mutex);
+  profile_lock_released(mutex);
+  race_release(mutex);
+  int return_val;
+  int fault = inject_fault(FAULT_SPURIOUS_WAKEUP);
+  if (fault != -1) {
+    sem_wait(&g_print_lock);
+    INFO("FAULT %d: spurious wakeup in pthread_cond_wait(%p, %p)\n", fault, cond, mutex);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+    return_val = spurious_cond_wait(mutex);
+  } else if (algorithm_ID() == kAlgorithmPCT) {
+    return_val = PCT_cond_wait(cond, mutex, NULL);
+  } else {
+    return_val = BLOCKING_ORIGINAL(orig_cond_wait(cond, mutex));
+  }
+  // An injected spurious wakeup had no signal, so nothing is ordered before it
+  if (fault == -1) {
+    race_acquire(cond);
+  }
+  race_acquire(mutex);
+  lock_graph_acquired(mutex);
+  profile_lock_reacquired(mutex);
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);  
+  INFO("RETURN pthread_cond_wait(%p, %p) = %d\n", cond, mutex, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_cond_timedwait)(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime) {
+  PASS_THROUGH(pthread_cond_timedwait, cond, mutex, abstime);
+  ENTER_WRAPPER(REAL_pthread_cond_timedwait);
+  pthread_cond_timedwait_type orig_cond_timedwait;
+  orig_cond_timedwait = (pthread_cond_timedwait_type)real_symbol(REAL_pthread_cond_timedwait);
+
+  run_scheduling_algorithm(PCT_THREAD_CALL);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_cond_timedwait(%p, %p, %p)\n", cond, mutex, abstime);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  lock_graph_released(mutex);
+  profile_lock_released(mutex);
+  race_release(mutex);
+  int return_val;
+  int fault = inject_fault(FAULT_SPURIOUS_WAKEUP);
+  if (fault != -1) {
+    sem_wait(&g_print_lock);
+    INFO("FAULT %d: spurious wakeup in pthread_cond_timedwait(%p, %p)\n", fault, cond, mutex);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+    return_val = spurious_cond_wait(mutex);
+  } else if (algorithm_ID() == kAlgorithmPCT) {
+    return_val = PCT_cond_wait(cond, mutex, abstime);
+  } else {
+    struct timespec real;
+    return_val = BLOCKING_ORIGINAL(orig_cond_timedwait(cond, mutex, real_abstime(abstime, &real)));
+    if (return_val == ETIMEDOUT) {
+      virtual_timeout_expired(abstime);
+    }
+  }
+  if (return_val == 0 && fault == -1) {
+    race_acquire(cond);
+  }
+  race_acquire(mutex);
+  lock_graph_acquired(mutex);
+  profile_lock_reacquired(mutex);
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_cond_timedwait(%p, %p, %p) = %d\n", cond, mutex, abstime, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_cond_signal)(pthread_cond_t *cond) {
+  PASS_THROUGH(pthread_cond_signal, cond);
+  ENTER_WRAPPER(REAL_pthread_cond_signal);
+  pthread_cond_signal_type orig_cond_signal;
+  orig_cond_signal = (pthread_cond_signal_type)real_symbol(REAL_pthread_cond_signal);
+
+  run_scheduling_algorithm(PCT_THREAD_CALL);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_cond_signal(%p)\n", cond);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  race_release(cond);
+  int return_val = 0;
+  if (algorithm_ID() == kAlgorithmPCT) {
+    t_current_cond = cond;
+    run_scheduling_algorithm(PCT_THREAD_COND_SIGNAL);
+  } else {
+    return_val = orig_cond_signal(cond);
+  }
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_cond_signal(%p) = %d\n", cond, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_cond_broadcast)(pthread_cond_t *cond) {
+  PASS_THROUGH(pthread_cond_broadcast, cond);
+  ENTER_WRAPPER(REAL_pthread_cond_broadcast);
+  pthread_cond_broadcast_type orig_cond_broadcast;
+  orig_cond_broadcast = (pthread_cond_broadcast_type)real_symbol(REAL_pthread_cond_broadcast);
+  
+  run_scheduling_algorithm(PCT_THREAD_CALL);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_cond_broadcast(%p)\n", cond);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  race_release(cond);
+  int return_val = 0;
+  if (algorithm_ID() == kAlgorithmPCT) {
+    t_current_cond = cond;
+    run_scheduling_algorithm(PCT_THREAD_COND_BROADCAST);
+  } else {
+    return_val = orig_cond_broadcast(cond);
+  }
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_cond_broadcast(%p) = %d\n", cond, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+// Mutexes
+int WRAPPER(pthread_mutex_init)(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
+  PASS_THROUGH(pthread_mutex_init, mutex, attr);
+  ENTER_WRAPPER(REAL_pthread_mutex_init);
+  pthread_mutex_init_type orig_mutex_init;
+  orig_mutex_init = (pthread_mutex_init_type)real_symbol(REAL_pthread_mutex_init);
+
+  int return_val = orig_mutex_init(mutex, attr);
+  if (return_val == 0 && !use_original_functions()) {
+    // The memory may have held another mutex that was never destroyed
+    forget_mutex(mutex);
+  }
+  return return_val;
+}
+
+int WRAPPER(pthread_mutex_destroy)(pthread_mutex_t *mutex) {
+  PASS_THROUGH(pthread_mutex_destroy, mutex);
+  ENTER_WRAPPER(REAL_pthread_mutex_destroy);
+  pthread_mutex_destroy_type orig_mutex_destroy;
+  orig_mutex_destroy = (pthread_mutex_destroy_type)real_symbol(REAL_pthread_mutex_destroy);
+
+  int return_val = orig_mutex_destroy(mutex);
+  if (return_val == 0 && !use_original_functions()) {
+    forget_mutex(mutex);
+  }
+  return return_val;
+}
+
+int WRAPPER(pthread_mutex_lock)(pthread_mutex_t *mutex) {
+  PASS_THROUGH(pthread_mutex_lock, mutex);
+  ENTER_WRAPPER(REAL_pthread_mutex_lock);
+  pthread_mutex_lock_type orig_mutex_lock;
+  orig_mutex_lock = (pthread_mutex_lock_type)real_symbol(REAL_pthread_mutex_lock);
+  
+  if (use_original_functions()) {
+    // If this thread is currently printing the stacktrace or exiting, allow it to use the original function.
+    return orig_mutex_lock(mutex);
+  } 
+
+  profile_lock_request(mutex);
+  t_current_mutex = mutex;
+  t_current_timed = false;
+
+  run_scheduling_algorithm(PCT_THREAD_LOCK);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_mutex_lock(%p)\n", mutex);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+  
+  pthread_mutex_trylock_type orig_mutex_trylock;
+  orig_mutex_trylock = (pthread_mutex_trylock_type)real_symbol(REAL_pthread_mutex_trylock);
+
+  lock_order_check(mutex);
+  int return_val = orig_mutex_trylock(mutex);
+  bool busy = return_val == EBUSY;
+  if (busy) {
+    // The mutex is taken, add the wait-for edge before actually blocking on it
+    lock_graph_begin_wait(mutex);
+    return_val = BLOCKING_ORIGINAL(orig_mutex_lock(mutex));
+    lock_graph_end_wait();
+  }
+  if (return_val == 0) {
+    lock_graph_acquired(mutex);
+    profile_lock_acquired(mutex, __builtin_return_address(0), busy);
+    race_acquire(mutex);
+  }
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_mutex_lock(%p) = %d\n", mutex, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_mutex_timedlock)(pthread_mutex_t *mutex, const struct timespec *abstime) {
+  PASS_THROUGH(pthread_mutex_timedlock, mutex, abstime);
+  ENTER_WRAPPER(REAL_pthread_mutex_timedlock);
+  pthread_mutex_timedlock_type orig_mutex_timedlock;
+  orig_mutex_timedlock = (pthread_mutex_timedlock_type)real_symbol(REAL_pthread_mutex_timedlock);
+
+  profile_lock_request(mutex);
+  t_current_mutex = mutex;
+  t_current_timed = true;
+  t_current_deadline = timed_wait_deadline(abstime);
+
+  // Under PCT the timeout only expires once no other thread can run
+  run_scheduling_algorithm(PCT_THREAD_LOCK);
+  t_current_timed = false;
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_mutex_timedlock(%p, %p)\n", mutex, abstime);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  // Like pthread_mutex_trylock it adds no wait-for edge, the timeout breaks any cycle
+  int return_val;
+  if (PCT_consume_timeout()) {
+    return_val = ETIMEDOUT;
+  } else {
+    struct timespec real;
+    return_val = BLOCKING_ORIGINAL(orig_mutex_timedlock(mutex, real_abstime(abstime, &real)));
+    if (return_val == ETIMEDOUT) {
+      virtual_timeout_expired(abstime);
+    }
+  }
+  if (return_val == 0) {
+    lock_graph_acquired(mutex);
+    profile_lock_acquired(mutex, __builtin_return_address(0), false);
+    race_acquire(mutex);
+  } else {
+    profile_lock_failed(mutex, __builtin_return_address(0));
+  }
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_mutex_timedlock(%p, %p) = %d\n", mutex, abstime, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_mutex_unlock)(pthread_mutex_t *mutex) {
+  PASS_THROUGH(pthread_mutex_unlock, mutex);
+  ENTER_WRAPPER(REAL_pthread_mutex_unlock);
+  pthread_mutex_unlock_type orig_mutex_unlock = NULL;
+  orig_mutex_unlock = (pthread_mutex_unlock_type)real_symbol(REAL_pthread_mutex_unlock);
+
+  if (use_original_functions()) {
+    // If this thread is currently printing the stacktrace or exiting, allow it to use the original function.
+    return orig_mutex_unlock(mutex);
+  }
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_mutex_unlock(%p)\n", mutex);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  lock_graph_released(mutex);
+  profile_lock_released(mutex);
+  race_release(mutex);
+  int return_val = orig_mutex_unlock(mutex);
+
+  t_current_mutex = mutex;
+
+  // Switching threads has to wait until the mutex is really free, or the
+  // next thread would block inside the original pthread_mutex_lock
+  run_scheduling_algorithm(PCT_THREAD_UNLOCK);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_mutex_unlock(%p) = %d\n", mutex, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_mutex_trylock)(pthread_mutex_t *mutex) {
+  PASS_THROUGH(pthread_mutex_trylock, mutex);
+  ENTER_WRAPPER(REAL_pthread_mutex_trylock);
+  pthread_mutex_trylock_type orig_mutex_trylock;
+  orig_mutex_trylock = (pthread_mutex_trylock_type)real_symbol(REAL_pthread_mutex_trylock);
+
+  profile_lock_request(mutex);
+  t_current_mutex = mutex;
+
+  run_scheduling_algorithm(PCT_THREAD_TRY_LOCK);
+  sem_wait(&g_print_lock);
+
+  INFO("CALL pthread_mutex_trylock(%p)\n", mutex);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val;
+  int fault = inject_fault(FAULT_TRYLOCK_BUSY);
+  if (fault != -1) {
+    sem_wait(&g_print_lock);
+    INFO("FAULT %d: EBUSY from pthread_mutex_trylock(%p)\n", fault, mutex);
+    fflush(stdout);
+    sem_post(&g_print_lock);
+    return_val = EBUSY;
+  } else {
+    return_val = orig_mutex_trylock(mutex);
+  }
+  if (return_val == 0) {
+    lock_graph_acquired(mutex);
+    profile_lock_acquired(mutex, __builtin_return_address(0), false);
+    race_acquire(mutex);
+  } else {
+    profile_lock_failed(mutex, __builtin_return_address(0));
+  }
+
+  run_scheduling_algorithm(return_val == 0 ? PCT_DO_NOTHING : PCT_THREAD_SPIN);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_mutex_trylock(%p) = %d\n", mutex, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+// Read-write locks
+
+// Readers release into their own clock, so two readers are not ordered with each other
+void *rwlock_read_clock(pthread_rwlock_t *rwlock) {
+  return (char *)rwlock + 1;
+}
+
+// Locks rwlock once the scheduler let the caller go on, for writing if write is
+// set. try_lock selects the try variants, abstime the timed ones. Under PCT the
+// model already granted the lock, so the original function does not block.
+int rwlock_acquire(pthread_rwlock_t *rwlock, bool write, bool try_lock, const struct timespec *abstime) {
+  if (PCT_consume_timeout()) {
+    return ETIMEDOUT;
+  }
+  if (t_PCT_rwlock_error != 0) {
+    int error = t_PCT_rwlock_error;
+    t_PCT_rwlock_error = 0;
+    return error;
+  }
+
+  enum real_symbol symbol;
+  if (try_lock) {
+    symbol = write ? REAL_pthread_rwlock_trywrlock : REAL_pthread_rwlock_tryrdlock;
+  } else if (abstime != NULL) {
+    symbol = write ? REAL_pthread_rwlock_timedwrlock : REAL_pthread_rwlock_timedrdlock;
+  } else {
+    symbol = write ? REAL_pthread_rwlock_wrlock : REAL_pthread_rwlock_rdlock;
+  }
+  pthread_rwlock_lock_type orig_rwlock_lock;
+  orig_rwlock_lock = (pthread_rwlock_lock_type)real_symbol(symbol);
+
+  int return_val;
+  if (abstime != NULL) {
+    struct timespec real;
+    return_val = BLOCKING_ORIGINAL(orig_rwlock_lock(rwlock, real_abstime(abstime, &real)));
+    if (return_val == ETIMEDOUT) {
+      virtual_timeout_expired(abstime);
+    }
+  } else {
+    return_val = BLOCKING_ORIGINAL(orig_rwlock_lock(rwlock));
+  }
+
+  if (return_val == 0) {
+    race_acquire(rwlock);
+    if (write) {
+      race_acquire(rwlock_read_clock(rwlock));
+    }
+  }
+  return return_val;
+}
+
+int WRAPPER(pthread_rwlock_rdlock)(pthread_rwlock_t *rwlock) {
+  PASS_THROUGH(pthread_rwlock_rdlock, rwlock);
+  ENTER_WRAPPER(REAL_pthread_rwlock_rdlock);
+  if (use_original_functions()) {
+    // If this thread is currently printing the stacktrace or exiting, allow it to use the original function.
+    return rwlock_acquire(rwlock, false, false, NULL);
+  }
+
+  t_current_rwlock = rwlock;
+  t_current_rwlock_write = false;
+  t_current_timed = false;
+
+  run_scheduling_algorithm(PCT_THREAD_RWLOCK);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_rwlock_rdlock(%p)\n", rwlock);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = rwlock_acquire(rwlock, false, false, NULL);
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_rwlock_rdlock(%p) = %d\n", rwlock, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_rwlock_wrlock)(pthread_rwlock_t *rwlock) {
+  PASS_THROUGH(pthread_rwlock_wrlock, rwlock);
+  ENTER_WRAPPER(REAL_pthread_rwlock_wrlock);
+  if (use_original_functions()) {
+    // If this thread is currently printing the stacktrace or exiting, allow it to use the original function.
+    return rwlock_acquire(rwlock, true, false, NULL);
+  }
+
+  t_current_rwlock = rwlock;
+  t_current_rwlock_write = true;
+  t_current_timed = false;
+
+  run_scheduling_algorithm(PCT_THREAD_RWLOCK);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_rwlock_wrlock(%p)\n", rwlock);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = rwlock_acquire(rwlock, true, false, NULL);
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_rwlock_wrlock(%p) = %d\n", rwlock, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_rwlock_tryrdlock)(pthread_rwlock_t *rwlock) {
+  PASS_THROUGH(pthread_rwlock_tryrdlock, rwlock);
+  ENTER_WRAPPER(REAL_pthread_rwlock_tryrdlock);
+  if (use_original_functions()) {
+    // If this thread is currently printing the stacktrace or exiting, allow it to use the original function.
+    return rwlock_acquire(rwlock, false, true, NULL);
+  }
+
+  t_current_rwlock = rwlock;
+  t_current_rwlock_write = false;
+
+  run_scheduling_algorithm(PCT_THREAD_RWLOCK_TRY);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_rwlock_tryrdlock(%p)\n", rwlock);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = rwlock_acquire(rwlock, false, true, NULL);
+
+  run_scheduling_algorithm(return_val == 0 ? PCT_DO_NOTHING : PCT_THREAD_SPIN);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_rwlock_tryrdlock(%p) = %d\n", rwlock, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_rwlock_trywrlock)(pthread_rwlock_t *rwlock) {
+  PASS_THROUGH(pthread_rwlock_trywrlock, rwlock);
+  ENTER_WRAPPER(REAL_pthread_rwlock_trywrlock);
+  if (use_original_functions()) {
+    // If this thread is currently printing the stacktrace or exiting, allow it to use the original function.
+    return rwlock_acquire(rwlock, true, true, NULL);
+  }
+
+  t_current_rwlock = rwlock;
+  t_current_rwlock_write = true;
+
+  run_scheduling_algorithm(PCT_THREAD_RWLOCK_TRY);
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_rwlock_trywrlock(%p)\n", rwlock);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = rwlock_acquire(rwlock, true, true, NULL);
+
+  run_scheduling_algorithm(return_val == 0 ? PCT_DO_NOTHING : PCT_THREAD_SPIN);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_rwlock_trywrlock(%p) = %d\n", rwlock, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_rwlock_timedrdlock)(pthread_rwlock_t *rwlock, const struct timespec *abstime) {
+  PASS_THROUGH(pthread_rwlock_timedrdlock, rwlock, abstime);
+  ENTER_WRAPPER(REAL_pthread_rwlock_timedrdlock);
+  if (use_original_functions()) {
+    // If this thread is currently printing the stacktrace or exiting, allow it to use the original function.
+    return rwlock_acquire(rwlock, false, false, abstime);
+  }
+
+  t_current_rwlock = rwlock;
+  t_current_rwlock_write = false;
+  t_current_timed = true;
+  t_current_deadline = timed_wait_deadline(abstime);
+
+  // Under PCT the timeout only expires once no other thread can run
+  run_scheduling_algorithm(PCT_THREAD_RWLOCK);
+  t_current_timed = false;
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_rwlock_timedrdlock(%p, %p)\n", rwlock, abstime);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = rwlock_acquire(rwlock, false, false, abstime);
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_rwlock_timedrdlock(%p, %p) = %d\n", rwlock, abstime, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_rwlock_timedwrlock)(pthread_rwlock_t *rwlock, const struct timespec *abstime) {
+  PASS_THROUGH(pthread_rwlock_timedwrlock, rwlock, abstime);
+  ENTER_WRAPPER(REAL_pthread_rwlock_timedwrlock);
+  if (use_original_functions()) {
+    // If this thread is currently printing the stacktrace or exiting, allow it to use the original function.
+    return rwlock_acquire(rwlock, true, false, abstime);
+  }
+
+  t_current_rwlock = rwlock;
+  t_current_rwlock_write = true;
+  t_current_timed = true;
+  t_current_deadline = timed_wait_deadline(abstime);
+
+  // Under PCT the timeout only expires once no other thread can run
+  run_scheduling_algorithm(PCT_THREAD_RWLOCK);
+  t_current_timed = false;
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_rwlock_timedwrlock(%p, %p)\n", rwlock, abstime);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = rwlock_acquire(rwlock, true, false, abstime);
+
+  run_scheduling_algorithm(PCT_DO_NOTHING);
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_rwlock_timedwrlock(%p, %p) = %d\n", rwlock, abstime, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int WRAPPER(pthread_rwlock_unlock)(pthread_rwlock_t *rwlock) {
+  PASS_THROUGH(pthread_rwlock_unlock, rwlock);
+  ENTER_WRAPPER(REAL_pthread_rwlock_unlock);
+  pthread_rwlock_unlock_type orig_rwlock_unlock;
+  orig_rwlock_unlock = (pthread_rwlock_unlock_type)real_symbol(REAL_pthread_rwlock_unlock);
+
+  if (use_original_functions()) {
+    // If this thread is currently printing the stacktrace or exiting, allow it to use the original function.
+    return orig_rwlock_unlock(rwlock);
+  }
+
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_rwlock_unlock(%p)\n", rwlock);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
   sem_post(&g_print_lock);
-  
-  // Execute the function for the thread as normal
-  void *return_val = start_routine(arg);
 
-  // Need to tell PCT_thread_terminate() which thread is terminating
-  sem_wait(&g_general_lock);
-  g_current_thread = thread_index;
-  sem_post(&g_general_lock);
+  // glibc records the thread holding it for writing, any other caller is a reader
+  bool writer = rwlock->__data.__cur_writer == gettid();
+  race_release(writer ? (void *)rwlock : rwlock_read_clock(rwlock));
+  int return_val = orig_rwlock_unlock(rwlock);
 
-  run_scheduling_algorithm(PCT_THREAD_TERMINATE);
+  t_current_rwlock = rwlock;
+
+  // Like pthread_mutex_unlock, switch threads only once the rwlock is really free
+  run_scheduling_algorithm(PCT_THREAD_RWLOCK_UNLOCK);
 
   sem_wait(&g_print_lock);
-  INFO("THREAD EXITED (%d, %ld)\n", thread_number, gettid());
+  INFO("RETURN pthread_rwlock_unlock(%p) = %d\n", rwlock, return_val);
   fflush(stdout);
   sem_post(&g_print_lock);
+
   return return_val;
 }
 
-////////////////////////////////////////////////////
-////////// BEGINNING OF PTHREAD FUNCTIONS //////////
-////////////////////////////////////////////////////
+// Semaphores
+// The target reaches these through the exported sem_* functions at the end of
+// this group, testlib.c itself calls the originals through internal_sem_*.
 
-int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
-                   void *(*start_routine) (void *), void *arg) {
-  pthread_create_type orig_create;
-  orig_create = (pthread_create_type)dlsym(RTLD_NEXT, "pthread_create");
+int target_sem_wait(sem_t *sem) {
+  t_current_object = sem;
+  t_current_timed = false;
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("======================================================\n");
-    fflush(stdout);
-    sem_post(&g_print_lock);
-  }
+  // Under PCT the semaphore was already decremented when this returns
+  run_scheduling_algorithm(PCT_THREAD_SEM_WAIT);
 
-  if (get_algorithm_ID() == kAlgorithmPCT) {
-    sem_wait(&g_general_lock);
-    g_thread_count++;
-    sem_post(&g_general_lock);
+  sem_wait(&g_print_lock);
+  INFO("CALL sem_wait(%p)\n", sem);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = 0;
+  if (algorithm_ID() != kAlgorithmPCT) {
+    return_val = BLOCKING_ORIGINAL(internal_sem_wait(sem));
+  }
+  if (return_val == 0) {
+    race_acquire(sem);
   }
 
-  run_scheduling_algorithm(PCT_THREAD_BEFORE_CREATE);
+  run_scheduling_algorithm(PCT_DO_NOTHING);
 
-  // Struct for multiple args
-  struct arg_struct *args = malloc(sizeof(arg_struct));
-  args->struct_func = start_routine;
-  args->struct_arg = arg;
-  // g_current_thread is set in PCT_thread_before_create() to be this thread
-  // that is about to be created
-  sem_wait(&g_general_lock);
-  args->thread_index = g_current_thread;
-  sem_post(&g_general_lock);
+  sem_wait(&g_print_lock);
+  INFO("RETURN sem_wait(%p) = %d\n", sem, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int target_sem_timedwait(sem_t *sem, const struct timespec *abstime) {
+  t_current_object = sem;
+  t_current_timed = true;
+  t_current_deadline = timed_wait_deadline(abstime);
+
+  // Under PCT the timeout only expires once no other thread can run
+  run_scheduling_algorithm(PCT_THREAD_SEM_WAIT);
+  t_current_timed = false;
 
   sem_wait(&g_print_lock);
-  INFO("CALL pthread_create(%p, %p, %p, %p)\n", thread, attr, start_routine, arg);
+  INFO("CALL sem_timedwait(%p, %p)\n", sem, abstime);
   fflush(stdout);
   STACKTRACE_THREAD_ID = gettid();
   stacktrace();
   sem_post(&g_print_lock);
 
-  int return_val = orig_create(thread, attr, &interpose_start_routine, (void *)args);
+  int return_val = 0;
+  if (algorithm_ID() == kAlgorithmPCT) {
+    if (PCT_consume_timeout()) {
+      errno = ETIMEDOUT;
+      return_val = -1;
+    }
+  } else {
+    struct timespec real;
+    return_val = BLOCKING_ORIGINAL(internal_sem_timedwait(sem, real_abstime(abstime, &real)));
+    if (return_val != 0 && errno == ETIMEDOUT) {
+      virtual_timeout_expired(abstime);
+    }
+  }
+  if (return_val == 0) {
+    race_acquire(sem);
+  }
 
-  run_scheduling_algorithm(PCT_THREAD_AFTER_CREATE);
+  run_scheduling_algorithm(PCT_DO_NOTHING);
 
-  sem_wait(&g_print_lock);  
-  INFO("RETURN pthread_create(%p, %p, %p, %p) = %d\n", thread, attr, start_routine, arg, return_val);
+  sem_wait(&g_print_lock);
+  INFO("RETURN sem_timedwait(%p, %p) = %d\n", sem, abstime, return_val);
   fflush(stdout);
   sem_post(&g_print_lock);
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("======================================================\n");
-    fflush(stdout);
-    sem_post(&g_print_lock);
-  }
-
   return return_val;
 }
 
-void pthread_exit(void *retval) {
-  pthread_exit_type orig_exit;
-  orig_exit = (pthread_exit_type)dlsym(RTLD_NEXT, "pthread_exit");
+int target_sem_trywait(sem_t *sem) {
+  run_scheduling_algorithm(PCT_THREAD_CALL);
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("======================================================\n");
-    fflush(stdout);
-    INFO("ENTER pthread_exit - g_current_thread = %d\n", g_current_thread);
-    fflush(stdout);
-    sem_post(&g_print_lock);
+  sem_wait(&g_print_lock);
+  INFO("CALL sem_trywait(%p)\n", sem);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  int return_val = internal_sem_trywait(sem);
+  if (return_val == 0) {
+    race_acquire(sem);
   }
 
-  run_scheduling_algorithm(PCT_DO_NOTHING);
+  run_scheduling_algorithm(return_val == 0 ? PCT_DO_NOTHING : PCT_THREAD_SPIN);
 
-  sem_wait(&g_print_lock);  
-  INFO("CALL pthread_exit(%p)\n", retval);
+  sem_wait(&g_print_lock);
+  INFO("RETURN sem_trywait(%p) = %d\n", sem, return_val);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return return_val;
+}
+
+int target_sem_post(sem_t *sem) {
+  sem_wait(&g_print_lock);
+  INFO("CALL sem_post(%p)\n", sem);
   fflush(stdout);
   STACKTRACE_THREAD_ID = gettid();
   stacktrace();
   sem_post(&g_print_lock);
 
-  int thread_number;
-  if (get_algorithm_ID() == kAlgorithmPCT) {
-    sem_wait(&g_general_lock);
-    thread_number = g_threads[g_current_thread].thread_number;
-    sem_post(&g_general_lock);
-  }
+  race_release(sem);
+  int return_val = internal_sem_post(sem);
 
-  run_scheduling_algorithm(PCT_THREAD_TERMINATE);
+  t_current_object = sem;
 
-  sem_wait(&g_print_lock);
+  // Like pthread_mutex_unlock, switch threads only once the semaphore was posted
+  run_scheduling_algorithm(PCT_THREAD_SEM_POST);
 
-  if (get_algorithm_ID() != kAlgorithmPCT) {
-    thread_number = find_thread_number(gettid());
-  }
-  INFO("THREAD EXITED (%d, %ld)\n", thread_number, gettid());
+  sem_wait(&g_print_lock);
+  INFO("RETURN sem_post(%p) = %d\n", sem, return_val);
   fflush(stdout);
   sem_post(&g_print_lock);
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("======================================================\n");
-    fflush(stdout);
-    sem_post(&g_print_lock);
-  }
+  return return_val;
+}
 
-  orig_exit(retval);
-  return;
+#undef sem_wait
+#undef sem_post
+#undef sem_trywait
+#undef sem_timedwait
+
+int WRAPPER(sem_wait)(sem_t *sem) {
+  PASS_THROUGH(sem_wait, sem);
+  ENTER_WRAPPER(REAL_sem_wait);
+  return target_sem_wait(sem);
 }
 
-int pthread_yield(void) {
-  pthread_yield_type orig_yield;
-  orig_yield = (pthread_yield_type)dlsym(RTLD_NEXT, "pthread_yield");
+int WRAPPER(sem_timedwait)(sem_t *sem, const struct timespec *abstime) {
+  PASS_THROUGH(sem_timedwait, sem, abstime);
+  ENTER_WRAPPER(REAL_sem_timedwait);
+  return target_sem_timedwait(sem, abstime);
+}
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("======================================================\n");
-    fflush(stdout);
-    sem_post(&g_print_lock);
-  }
+int WRAPPER(sem_trywait)(sem_t *sem) {
+  PASS_THROUGH(sem_trywait, sem);
+  ENTER_WRAPPER(REAL_sem_trywait);
+  return target_sem_trywait(sem);
+}
 
-  run_scheduling_algorithm(PCT_DO_NOTHING);
+int WRAPPER(sem_post)(sem_t *sem) {
+  PASS_THROUGH(sem_post, sem);
+  ENTER_WRAPPER(REAL_sem_post);
+  return target_sem_post(sem);
+}
+
+#define sem_wait internal_sem_wait
+#define sem_post internal_sem_post
+#define sem_trywait internal_sem_trywait
+#define sem_timedwait internal_sem_timedwait
+
+// Spin locks
+
+int WRAPPER(pthread_spin_lock)(pthread_spinlock_t *lock) {
+  PASS_THROUGH(pthread_spin_lock, lock);
+  ENTER_WRAPPER(REAL_pthread_spin_lock);
+  pthread_spin_lock_type orig_spin_lock;
+  orig_spin_lock = (pthread_spin_lock_type)real_symbol(REAL_pthread_spin_lock);
+
+  t_current_object = (void *)lock;
+  t_current_timed = false;
+
+  // Under PCT a thread that would spin is blocked instead, and the lock is
+  // already taken when this returns
+  run_scheduling_algorithm(PCT_THREAD_SPIN_LOCK);
 
   sem_wait(&g_print_lock);
-  INFO("CALL pthread_yield()\n");
+  INFO("CALL pthread_spin_lock(%p)\n", (void *)lock);
   fflush(stdout);
   STACKTRACE_THREAD_ID = gettid();
   stacktrace();
   sem_post(&g_print_lock);
 
-  int return_val = orig_yield();
+  int return_val = 0;
+  if (algorithm_ID() != kAlgorithmPCT) {
+    return_val = BLOCKING_ORIGINAL(orig_spin_lock(lock));
+  }
+  if (return_val == 0) {
+    race_acquire((void *)lock);
+  }
 
-  run_scheduling_algorithm(PCT_THREAD_YIELD);
+  run_scheduling_algorithm(PCT_DO_NOTHING);
 
-  sem_wait(&g_print_lock);  
-  INFO("RETURN pthread_yield() = %d\n", return_val);
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_spin_lock(%p) = %d\n", (void *)lock, return_val);
   fflush(stdout);
   sem_post(&g_print_lock);
 
-  if (DEBUG) {
-    sem_wait(&g_print_lock);
-    INFO("======================================================\n");
-    fflush(stdout);
-    sem_post(&g_print_lock);
-  }
   return return_val;
 }
 
-// Condition variables
-int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
-  pthread_cond_wait_type orig_cond_wait;
-  orig_cond_wait = (pthread_cond_wait_type)dlsym(RTLD_NEXT, "pthread_cond_wait");
+int WRAPPER(pthread_spin_trylock)(pthread_spinlock_t *lock) {
+  PASS_THROUGH(pthread_spin_trylock, lock);
+  ENTER_WRAPPER(REAL_pthread_spin_trylock);
+  pthread_spin_trylock_type orig_spin_trylock;
+  orig_spin_trylock = (pthread_spin_trylock_type)real_symbol(REAL_pthread_spin_trylock);
 
   run_scheduling_algorithm(PCT_THREAD_CALL);
 
-  sem_wait(&g_print_lock);  
-  INFO("CALL pthread_cond_wait(%p, %p)\n", cond, mutex);
+  sem_wait(&g_print_lock);
+  INFO("CALL pthread_spin_trylock(%p)\n", (void *)lock);
   fflush(stdout);
   STACKTRACE_THREAD_ID = gettid();
   stacktrace();
   sem_post(&g_print_lock);
 
-  int return_val = orig_cond_wait(cond, mutex);
+  int return_val = orig_spin_trylock(lock);
+  if (return_val == 0) {
+    race_acquire((void *)lock);
+  }
 
-  run_scheduling_algorithm(PCT_DO_NOTHING);
+  run_scheduling_algorithm(return_val == 0 ? PCT_DO_NOTHING : PCT_THREAD_SPIN);
 
-  sem_wait(&g_print_lock);  
-  INFO("RETURN pthread_cond_wait(%p, %p) = %d\n", cond, mutex, return_val);
+  sem_wait(&g_print_lock);
+  INFO("RETURN pthread_spin_trylock(%p) = %d\n", (void *)lock, return_val);
   fflush(stdout);
   sem_post(&g_print_lock);
 
   return return_val;
 }
 
-int pthread_cond_signal(pthread_cond_t *cond) {
-  pthread_cond_signal_type orig_cond_signal;
-  orig_cond_signal = (pthread_cond_signal_type)dlsym(RTLD_NEXT, "pthread_cond_signal");
-
-  run_scheduling_algorithm(PCT_THREAD_CALL);
+int WRAPPER(pthread_spin_unlock)(pthread_spinlock_t *lock) {
+  PASS_THROUGH(pthread_spin_unlock, lock);
+  ENTER_WRAPPER(REAL_pthread_spin_unlock);
+  pthread_spin_unlock_type orig_spin_unlock;
+  orig_spin_unlock = (pthread_spin_unlock_type)real_symbol(REAL_pthread_spin_unlock);
 
   sem_wait(&g_print_lock);
-  INFO("CALL pthread_cond_signal(%p)\n", cond);
+  INFO("CALL pthread_spin_unlock(%p)\n", (void *)lock);
   fflush(stdout);
   STACKTRACE_THREAD_ID = gettid();
   stacktrace();
   sem_post(&g_print_lock);
 
-  int return_val = orig_cond_signal(cond);
+  race_release((void *)lock);
+  int return_val = orig_spin_unlock(lock);
 
-  run_scheduling_algorithm(PCT_DO_NOTHING);
+  t_current_object = (void *)lock;
+
+  run_scheduling_algorithm(PCT_THREAD_SPIN_UNLOCK);
 
   sem_wait(&g_print_lock);
-  INFO("RETURN pthread_cond_signal(%p) = %d\n", cond, return_val);
+  INFO("RETURN pthread_spin_unlock(%p) = %d\n", (void *)lock, return_val);
   fflush(stdout);
   sem_post(&g_print_lock);
 
   return return_val;
 }
 
-int pthread_cond_broadcast(pthread_cond_t *cond) {
-  pthread_cond_broadcast_type orig_cond_broadcast;
-  orig_cond_broadcast = (pthread_cond_broadcast_type)dlsym(RTLD_NEXT, "pthread_cond_broadcast");
-  
+// Barriers
+
+int WRAPPER(pthread_barrier_init)(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr,
+                         unsigned int count) {
+  PASS_THROUGH(pthread_barrier_init, barrier, attr, count);
+  ENTER_WRAPPER(REAL_pthread_barrier_init);
+  pthread_barrier_init_type orig_barrier_init;
+  orig_barrier_init = (pthread_barrier_init_type)real_symbol(REAL_pthread_barrier_init);
+
+  int return_val = orig_barrier_init(barrier, attr, count);
+  if (return_val == 0) {
+    // Reinitializing a barrier reuses its entry
+    sem_wait(&g_PCT_barriers_lock);
+    struct PCT_barrier *entry = find_PCT_barrier(barrier);
+    if (entry == NULL) {
+      entry = find_PCT_barrier(NULL);
+    }
+    if (entry != NULL) {
+      entry->barrier = barrier;
+      entry->count = count;
+      entry->arrived = 0;
+    }
+    sem_post(&g_PCT_barriers_lock);
+  }
+  return return_val;
+}
+
+int WRAPPER(pthread_barrier_destroy)(pthread_barrier_t *barrier) {
+  PASS_THROUGH(pthread_barrier_destroy, barrier);
+  ENTER_WRAPPER(REAL_pthread_barrier_destroy);
+  pthread_barrier_destroy_type orig_barrier_destroy;
+  orig_barrier_destroy = (pthread_barrier_destroy_type)real_symbol(REAL_pthread_barrier_destroy);
+
+  sem_wait(&g_PCT_barriers_lock);
+  struct PCT_barrier *entry = find_PCT_barrier(barrier);
+  if (entry != NULL) {
+    entry->barrier = NULL;
+  }
+  sem_post(&g_PCT_barriers_lock);
+
+  return orig_barrier_destroy(barrier);
+}
+
+int WRAPPER(pthread_barrier_wait)(pthread_barrier_t *barrier) {
+  PASS_THROUGH(pthread_barrier_wait, barrier);
+  ENTER_WRAPPER(REAL_pthread_barrier_wait);
+  pthread_barrier_wait_type orig_barrier_wait;
+  orig_barrier_wait = (pthread_barrier_wait_type)real_symbol(REAL_pthread_barrier_wait);
+
   run_scheduling_algorithm(PCT_THREAD_CALL);
 
   sem_wait(&g_print_lock);
-  INFO("CALL pthread_cond_broadcast(%p)\n", cond);
+  INFO("CALL pthread_barrier_wait(%p)\n", barrier);
   fflush(stdout);
   STACKTRACE_THREAD_ID = gettid();
   stacktrace();
   sem_post(&g_print_lock);
 
-  int return_val = orig_cond_broadcast(cond);
+  // Every thread arriving happens before every thread leaving
+  race_release(barrier);
+  int return_val;
+  sem_wait(&g_PCT_barriers_lock);
+  bool modeled = find_PCT_barrier(barrier) != NULL;
+  sem_post(&g_PCT_barriers_lock);
+  if (algorithm_ID() == kAlgorithmPCT && modeled) {
+    t_current_object = barrier;
+    run_scheduling_algorithm(PCT_THREAD_BARRIER_WAIT);
+    return_val = t_PCT_barrier_result;
+  } else {
+    return_val = BLOCKING_ORIGINAL(orig_barrier_wait(barrier));
+  }
+  race_acquire(barrier);
 
   run_scheduling_algorithm(PCT_DO_NOTHING);
 
   sem_wait(&g_print_lock);
-  INFO("RETURN pthread_cond_broadcast(%p) = %d\n", cond, return_val);
+  INFO("RETURN pthread_barrier_wait(%p) = %d\n", barrier, return_val);
   fflush(stdout);
   sem_post(&g_print_lock);
 
   return return_val;
 }
 
-// Mutexes
-int pthread_mutex_lock(pthread_mutex_t *mutex) {
-  pthread_mutex_lock_type orig_mutex_lock;
-  orig_mutex_lock = (pthread_mutex_lock_type)dlsym(RTLD_NEXT, "pthread_mutex_lock");
-  
-  if (STACKTRACE_THREAD_ID == gettid()) {
-    // If this thread is currently printing the stacktrace, allow it to use the original function.
-    return orig_mutex_lock(mutex);
-  } 
+// Once
 
-  sem_wait(&g_general_lock);
-  g_current_mutex = mutex;
-  sem_post(&g_general_lock);
+// pthread_once only takes a function without arguments, the wrapper passes the
+// init routine and its control through these
+__thread void (*t_once_routine)(void) = NULL;
+__thread pthread_once_t *t_once_control = NULL;
 
-  run_scheduling_algorithm(PCT_THREAD_LOCK);
+// Runs the init routine, everything it did happens before every pthread_once returns
+void once_trampoline(void) {
+  pthread_once_t *once_control = t_once_control;
+  int previous = overhead_enter(OVERHEAD_USER);
+  t_once_routine();
+  overhead_leave(previous);
+  race_release(once_control);
+}
+
+int WRAPPER(pthread_once)(pthread_once_t *once_control, void (*init_routine)(void)) {
+  PASS_THROUGH(pthread_once, once_control, init_routine);
+  ENTER_WRAPPER(REAL_pthread_once);
+  pthread_once_type orig_once;
+  orig_once = (pthread_once_type)real_symbol(REAL_pthread_once);
+
+  // libgcc_s calls pthread_once while pthread_exit unwinds, after PCT_THREAD_TERMINATE
+  // retired the slot of the thread
+  if (use_original_functions() || called_from_testlib(__builtin_return_address(0))) {
+    return orig_once(once_control, init_routine);
+  }
+
+  t_current_object = once_control;
+  t_current_timed = false;
+
+  // Under PCT the caller waits here while another thread runs the init routine
+  run_scheduling_algorithm(PCT_THREAD_ONCE);
+  bool runs = t_PCT_once_runs;
+  t_PCT_once_runs = false;
 
   sem_wait(&g_print_lock);
-  INFO("CALL pthread_mutex_lock(%p)\n", mutex);
+  INFO("CALL pthread_once(%p, %p)\n", (void *)once_control, init_routine);
   fflush(stdout);
   STACKTRACE_THREAD_ID = gettid();
   stacktrace();
   sem_post(&g_print_lock);
-  
-  int return_val = orig_mutex_lock(mutex);
 
-  run_scheduling_algorithm(PCT_DO_NOTHING);
+  // The init routine may call pthread_once for another control
+  void (*outer_routine)(void) = t_once_routine;
+  pthread_once_t *outer_control = t_once_control;
+  t_once_routine = init_routine;
+  t_once_control = once_control;
+  int return_val = orig_once(once_control, once_trampoline);
+  t_once_routine = outer_routine;
+  t_once_control = outer_control;
+  race_acquire(once_control);
+
+  if (runs) {
+    t_current_object = once_control;
+    run_scheduling_algorithm(PCT_THREAD_ONCE_DONE);
+  } else {
+    run_scheduling_algorithm(PCT_DO_NOTHING);
+  }
 
   sem_wait(&g_print_lock);
-  INFO("RETURN pthread_mutex_lock(%p) = %d\n", mutex, return_val);
+  INFO("RETURN pthread_once(%p, %p) = %d\n", (void *)once_control, init_routine, return_val);
   fflush(stdout);
   sem_post(&g_print_lock);
 
   return return_val;
 }
 
-int pthread_mutex_unlock(pthread_mutex_t *mutex) {
-  pthread_mutex_unlock_type orig_mutex_unlock = NULL;
-  orig_mutex_unlock = (pthread_mutex_unlock_type)dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+// Time
 
-  if (STACKTRACE_THREAD_ID == gettid()) {
-    // If this thread is currently printing the stacktrace, allow it to use the original function.
-    return orig_mutex_unlock(mutex);
+// Sleeps for ns nanoseconds of virtual time. Under PCT the thread waits in the
+// timer queue, otherwise it only moves the clock.
+void virtual_sleep(uint64_t ns) {
+  uint64_t deadline = virtual_now() + ns;
+  if (algorithm_ID() == kAlgorithmPCT) {
+    t_current_deadline = deadline;
+    run_scheduling_algorithm(PCT_THREAD_SLEEP);
   }
+  virtual_time_advance_to(deadline);
+}
 
-  sem_wait(&g_general_lock);
-  g_current_mutex = mutex;
-  sem_post(&g_general_lock);
-  
-  run_scheduling_algorithm(PCT_THREAD_UNLOCK);
+int WRAPPER(clock_gettime)(clockid_t clock, struct timespec *time) {
+  PASS_THROUGH(clock_gettime, clock, time);
+  ENTER_WRAPPER(REAL_clock_gettime);
+  clock_gettime_type orig_clock_gettime;
+  orig_clock_gettime = (clock_gettime_type)real_symbol(REAL_clock_gettime);
+
+  if (!g_virtual_time || (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC)) {
+    return orig_clock_gettime(clock, time);
+  }
+
+  uint64_t now = __atomic_add_fetch(&g_virtual_elapsed, VIRTUAL_TIME_TICK_NS, __ATOMIC_ACQ_REL);
+  uint64_t base = clock == CLOCK_REALTIME ? g_virtual_base_realtime : g_virtual_base_monotonic;
+  ns_to_timespec(base + now, time);
+  return 0;
+}
+
+unsigned int WRAPPER(sleep)(unsigned int seconds) {
+  PASS_THROUGH(sleep, seconds);
+  ENTER_WRAPPER(REAL_sleep);
+  sleep_type orig_sleep;
+  orig_sleep = (sleep_type)real_symbol(REAL_sleep);
+
+  if (!g_virtual_time || t_real_sleep) {
+    return BLOCKING_ORIGINAL(orig_sleep(seconds));
+  }
 
   sem_wait(&g_print_lock);
-  INFO("CALL pthread_mutex_unlock(%p)\n", mutex);
+  INFO("CALL sleep(%u)\n", seconds);
   fflush(stdout);
   STACKTRACE_THREAD_ID = gettid();
   stacktrace();
   sem_post(&g_print_lock);
 
-  int return_val = orig_mutex_unlock(mutex);
-
-  run_scheduling_algorithm(PCT_DO_NOTHING);
+  virtual_sleep((uint64_t)seconds * NS_PER_SECOND);
 
   sem_wait(&g_print_lock);
-  INFO("RETURN pthread_mutex_unlock(%p) = %d\n", mutex, return_val);
+  INFO("RETURN sleep(%u) = 0\n", seconds);
   fflush(stdout);
   sem_post(&g_print_lock);
 
-  return return_val;
+  return 0;
 }
 
-int pthread_mutex_trylock(pthread_mutex_t *mutex) {
-  pthread_mutex_trylock_type orig_mutex_trylock;
-  orig_mutex_trylock = (pthread_mutex_trylock_type)dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+int WRAPPER(usleep)(useconds_t usec) {
+  PASS_THROUGH(usleep, usec);
+  ENTER_WRAPPER(REAL_usleep);
+  usleep_type orig_usleep;
+  orig_usleep = (usleep_type)real_symbol(REAL_usleep);
 
-  sem_wait(&g_general_lock);
-  g_current_mutex = mutex;
-  sem_post(&g_general_lock);
+  if (!g_virtual_time || t_real_sleep) {
+    return BLOCKING_ORIGINAL(orig_usleep(usec));
+  }
 
-  run_scheduling_algorithm(PCT_THREAD_TRY_LOCK);
-  sem_wait(&g_general_lock);
-  //int my_retval = g_mutex_locked;
   sem_wait(&g_print_lock);
-
-  INFO("CALL pthread_mutex_trylock(%p)\n", mutex);
+  INFO("CALL usleep(%u)\n", usec);
   fflush(stdout);
   STACKTRACE_THREAD_ID = gettid();
   stacktrace();
   sem_post(&g_print_lock);
 
-  int return_val = orig_mutex_trylock(mutex);
+  virtual_sleep((uint64_t)usec * 1000);
 
-  run_scheduling_algorithm(PCT_DO_NOTHING);
+  sem_wait(&g_print_lock);
+  INFO("RETURN usleep(%u) = 0\n", usec);
+  fflush(stdout);
+  sem_post(&g_print_lock);
+
+  return 0;
+}
+
+int WRAPPER(nanosleep)(const struct timespec *req, struct timespec *rem) {
+  PASS_THROUGH(nanosleep, req, rem);
+  ENTER_WRAPPER(REAL_nanosleep);
+  nanosleep_type orig_nanosleep;
+  orig_nanosleep = (nanosleep_type)real_symbol(REAL_nanosleep);
+
+  if (!g_virtual_time || t_real_sleep) {
+    return BLOCKING_ORIGINAL(orig_nanosleep(req, rem));
+  }
+
+  if (req->tv_nsec < 0 || req->tv_nsec >= (long)NS_PER_SECOND || req->tv_sec < 0) {
+    errno = EINVAL;
+    return -1;
+  }
 
   sem_wait(&g_print_lock);
-  INFO("RETURN pthread_mutex_trylock(%p) = %d\n", mutex, return_val);
+  INFO("CALL nanosleep(%p, %p)\n", req, rem);
+  fflush(stdout);
+  STACKTRACE_THREAD_ID = gettid();
+  stacktrace();
+  sem_post(&g_print_lock);
+
+  // A virtual sleep is never interrupted by a signal
+  virtual_sleep(timespec_to_ns(req));
+  if (rem != NULL) {
+    rem->tv_sec = 0;
+    rem->tv_nsec = 0;
+  }
+
+  sem_wait(&g_print_lock);
+  INFO("RETURN nanosleep(%p, %p) = 0\n", req, rem);
   fflush(stdout);
   sem_post(&g_print_lock);
 
-  return return_val;
+  return 0;
+}
+
+// Reports the symmetry reduction, the lock profile and the overhead, and like ThreadSanitizer
+// fails a run that reported a data race or a potential deadlock even if main returned 0
+static __attribute__((destructor)) void fini_testlib(void) {
+  report_symmetry();
+  report_lock_profile();
+  report_overhead();
+  fini_stats();
+  if (g_races_reported > 0) {
+    fflush(NULL);
+    _exit(RACE_EXIT_CODE);
+  }
+  if (g_lock_order_cycles > 0) {
+    fflush(NULL);
+    _exit(LOCK_ORDER_EXIT_CODE);
+  }
 }
 
 // This will get called at the start of the target programs main function
 static __attribute__((constructor (200))) void init_testlib(void) {
-  // Used in PCT
-  g_orig_mutex_lock = (pthread_mutex_lock_type)dlsym(RTLD_NEXT, "pthread_mutex_lock");
-  g_orig_mutex_unlock = (pthread_mutex_unlock_type)dlsym(RTLD_NEXT, "pthread_mutex_unlock");
-  
-  pthread_mutex_t init_lock;
-  g_orig_mutex_lock(&init_lock);
+  pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+  real_mutex_lock(&init_lock);
 
 
   // You can initialize stuff here
   INFO("Testlib loaded!\n");
   fflush(stdout);
-  INFO("Stacktraces is %i\n", get_stacktraces());
+  INFO("Stacktraces is %i\n", stacktraces_enabled());
+  fflush(stdout);
+  INFO("Algorithm ID is %i\n", algorithm_ID());
   fflush(stdout);
-  INFO("Algorithm ID is %i\n", get_algorithm_ID());
+  INFO("Strategy is %s\n", current_strategy()->name);
   fflush(stdout);
   INFO("Seed is %i\n",(int) get_seed());
   fflush(stdout);
@@ -1160,36 +6763,40 @@ static __attribute__((constructor (200))) void init_testlib(void) {
   
   sem_init(&g_PCT_lock, 0, 1);
   sem_init(&g_PCT_main_lock, 0, 1);
-  sem_init(&g_PCT_thread_start_lock, 0, 1);
-  sem_init(&g_PCT_thread_after_create_lock, 0, 1);
-  sem_init(&g_PCT_thread_before_create_lock, 0, 1);
-  sem_init(&g_PCT_thread_terminate_lock, 0, 1);
-  sem_init(&g_PCT_thread_yield_lock, 0, 1);
-  sem_init(&g_PCT_thread_lock_lock, 0, 1);
-  sem_init(&g_PCT_thread_unlock_lock, 0, 1);
-  sem_init(&g_PCT_thread_trylock_lock, 0, 1);
-  sem_init(&g_PCT_find_highest_priority_lock, 0, 1);
-  sem_init(&g_PCT_run_highest_priority_lock, 0, 1);
-  sem_init(&g_PCT_find_next_available_thread, 0, 1);
-  sem_init(&g_PCT_main_init_lock, 0, 1);
+  sem_init(&g_PCT_barriers_lock, 0, 1);
 
   sem_wait(&g_PCT_lock);
 
+  // Needed for deadlock detection
+  sem_init(&g_deadlock_lock, 0, 1);
+  sem_init(&g_lock_order_lock, 0, 1);
+
   // Needed for PCT
-  g_threads = (struct thread_struct*) malloc(MAX_THREADS * sizeof(struct thread_struct));
-  g_semaphores = (sem_t *) malloc(MAX_THREADS * sizeof(sem_t));
+  g_threads = arena_alloc(MAX_THREADS * sizeof(struct thread_struct));
+  g_semaphores = arena_alloc(MAX_THREADS * sizeof(sem_t));
 
   for (int i = 0; i < MAX_THREADS; i++) {
     g_threads[i].state = THREAD_DEAD;
     g_threads[i].thread_number = -1;
+    reset_thread_slot(i);
     // Initialize array of semaphores for PCT
     sem_init(&g_semaphores[i], 0, 0);
-    // Initialize the array of mutexes
-    g_thread_mutexes[i] = NULL;
   }
 
   sem_post(&g_PCT_lock);
 
+  init_thread_pool();
+  init_preemption_points();
+  // main draws from stream 0
+  seed_random_stream(0);
+  init_fault_injection();
+  init_virtual_time();
+  init_fair_scheduling();
+  init_symmetry();
+  init_stats();
+  init_lock_profile();
+  init_overhead();
+
   sem_wait(&g_print_lock);
   INFO("Calling PCT init_main\n");
   fflush(stdout);
@@ -1203,6 +6810,8 @@ static __attribute__((constructor (200))) void init_testlib(void) {
   fflush(stdout);
   sem_post(&g_print_lock);
 
-  g_orig_mutex_unlock(&init_lock);
+  real_mutex_unlock(&init_lock);
 
+  // main runs program code from here on
+  overhead_enter(OVERHEAD_USER);
 }
@@ -0,0 +1,60 @@
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * C++ CALL_ONCE AND SHARED_MUTEX TEST
+ * Four threads call std::call_once on the same flag, its init routine yields in the middle, so
+ * the other callers have to wait for it instead of seeing a half initialized table. Then each
+ * thread updates the table under a unique lock of a std::shared_mutex and checks it under a
+ * shared lock. std::call_once is pthread_once and std::shared_mutex is a pthread rwlock.
+ * This program should always return 0.
+ */
+
+std::once_flag table_once;
+std::shared_mutex table_lock;
+int g_table[4];
+int g_init_calls = 0;
+int g_bad_reads = 0;
+std::mutex bad_reads_lock;
+
+void init_table() {
+  g_init_calls++;
+  g_table[0] = 1;
+  std::this_thread::yield();
+  for (int i = 1; i < 4; i++) {
+    g_table[i] = 1;
+  }
+}
+
+void worker(int id) {
+  std::call_once(table_once, init_table);
+
+  {
+    std::unique_lock<std::shared_mutex> guard(table_lock);
+    for (int i = 0; i < 4; i++) {
+      g_table[i]++;
+    }
+  }
+
+  std::shared_lock<std::shared_mutex> guard(table_lock);
+  for (int i = 1; i < 4; i++) {
+    if (g_table[i] != g_table[0]) {
+      std::lock_guard<std::mutex> bad_guard(bad_reads_lock);
+      g_bad_reads++;
+    }
+  }
+}
+
+int main() {
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back(worker, i);
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  bool ok = g_init_calls == 1 && g_bad_reads == 0 && g_table[0] == 5;
+  return ok ? 0 : 1;
+}
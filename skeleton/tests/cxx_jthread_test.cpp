@@ -0,0 +1,52 @@
+#include <condition_variable>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+
+/*
+ * C++ JTHREAD TEST
+ * Two std::jthreads take jobs from main until they are asked to stop. They wait on a
+ * std::condition_variable_any with their stop token, so a stop request wakes them up through
+ * the stop callback of the condition variable. main stops the first one explicitly, the second
+ * one is stopped and joined by its destructor. The workers must have done all 10 jobs.
+ * This program should always return 0.
+ */
+
+std::mutex lock;
+std::condition_variable_any job_ready;
+int g_jobs = 0;
+int g_done = 0;
+
+void work(std::stop_token stop) {
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    if (!job_ready.wait(guard, stop, [] { return g_jobs > 0; })) {
+      // Stop requested and no job left
+      return;
+    }
+    g_jobs--;
+    if (++g_done == 10) {
+      job_ready.notify_all();
+    }
+  }
+}
+
+int main() {
+  {
+    std::jthread first(work);
+    std::jthread second(work);
+    for (int i = 0; i < 10; i++) {
+      std::lock_guard<std::mutex> guard(lock);
+      g_jobs++;
+      job_ready.notify_one();
+    }
+    // Wait until the workers finished the jobs before stopping them
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      job_ready.wait(guard, [] { return g_done == 10; });
+    }
+    first.request_stop();
+    first.join();
+  }
+  return g_done == 10 ? 0 : 1;
+}
@@ -0,0 +1,55 @@
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/*
+ * C++ THREAD, MUTEX AND CONDITION VARIABLE TEST
+ * Two producers push 1..10 into a std::queue guarded by a std::mutex and signal a
+ * std::condition_variable, two consumers pop until they got all 20 numbers. std::thread and
+ * join, the mutex and the condition variable all reach testlib.so through libstdc++.
+ * This program should always return 0.
+ */
+
+std::mutex lock;
+std::condition_variable not_empty;
+std::queue<int> items;
+int g_sum = 0;
+int g_consumed = 0;
+
+void producer() {
+  for (int i = 1; i <= 10; i++) {
+    std::lock_guard<std::mutex> guard(lock);
+    items.push(i);
+    not_empty.notify_one();
+  }
+}
+
+void consumer() {
+  while (true) {
+    std::unique_lock<std::mutex> guard(lock);
+    not_empty.wait(guard, [] { return !items.empty() || g_consumed == 20; });
+    if (items.empty()) {
+      return;
+    }
+    g_sum += items.front();
+    items.pop();
+    if (++g_consumed == 20) {
+      // Let the other consumer see that nothing is left
+      not_empty.notify_all();
+    }
+  }
+}
+
+int main() {
+  std::vector<std::thread> threads;
+  threads.emplace_back(producer);
+  threads.emplace_back(producer);
+  threads.emplace_back(consumer);
+  threads.emplace_back(consumer);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return g_sum == 110 ? 0 : 1;
+}
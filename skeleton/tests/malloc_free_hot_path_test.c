@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<semaphore.h>
+#include<sched.h>
+#include<unistd.h>
+#include<malloc.h>
+
+#define NUM_THREADS 2
+#define ROUNDS 20
+
+// The real allocator of glibc, malloc and calloc below only count the calls
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+sem_t sem;
+sem_t ready;
+sem_t start;
+sem_t done;
+int g_counting = 0;
+int g_allocations = 0;
+int g_counter = 0;
+
+/*
+ * MALLOC FREE HOT PATH TEST
+ * The program defines malloc and calloc itself, so it sees every allocation made by
+ * testlib.so too. A first round of mutex, trylock, condition variable, rwlock, semaphore
+ * and yield calls lets everything that is set up lazily (stdio buffers, symbol lookups)
+ * allocate. NUM_THREADS threads are created and started before the counting begins,
+ * since glibc allocates for a new thread itself, then they repeat the same calls ROUNDS
+ * times. Intercepted functions must not allocate at all.
+ * This program should always return 0.
+ */
+
+void *malloc(size_t size) {
+  if (__atomic_load_n(&g_counting, __ATOMIC_RELAXED)) {
+    __atomic_fetch_add(&g_allocations, 1, __ATOMIC_RELAXED);
+  }
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  if (__atomic_load_n(&g_counting, __ATOMIC_RELAXED)) {
+    __atomic_fetch_add(&g_allocations, 1, __ATOMIC_RELAXED);
+  }
+  return __libc_calloc(count, size);
+}
+
+void operations() {
+  pthread_mutex_lock(&lock);
+  g_counter++;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+
+  if (pthread_mutex_trylock(&lock) == 0) {
+    pthread_mutex_unlock(&lock);
+  }
+
+  pthread_rwlock_rdlock(&rwlock);
+  pthread_rwlock_unlock(&rwlock);
+  pthread_rwlock_wrlock(&rwlock);
+  pthread_rwlock_unlock(&rwlock);
+
+  sem_post(&sem);
+  sem_wait(&sem);
+
+  sched_yield();
+}
+
+void *worker(void *arg) {
+  sem_post(&ready);
+  sem_wait(&start);
+  for (int i = 0; i < ROUNDS; i++) {
+    operations();
+  }
+
+  // Wait on the condition variable until every worker is done
+  pthread_mutex_lock(&lock);
+  while (g_counter < NUM_THREADS * ROUNDS + 1) {
+    pthread_cond_wait(&cond, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+  sem_post(&done);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t threads[NUM_THREADS];
+
+  sem_init(&sem, 0, 0);
+  sem_init(&ready, 0, 0);
+  sem_init(&start, 0, 0);
+  sem_init(&done, 0, 0);
+  operations();
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    sem_wait(&ready);
+  }
+
+  __atomic_store_n(&g_counting, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < NUM_THREADS; i++) {
+    sem_post(&start);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    sem_wait(&done);
+  }
+  __atomic_store_n(&g_counting, 0, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  printf("%d allocations\n", g_allocations);
+  return g_allocations == 0 ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+
+pthread_mutex_t lock1 = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * MUTEX ORPHANED TEST
+ * The owner locks lock1 and exits without unlocking it. The waiter usually starts waiting
+ * for lock1 while the owner is still alive, so it blocks forever once the owner exits.
+ * The deadlock detection must catch this, exiting with 3 instead of hanging.
+ */
+
+void *owner(void * args) {
+  pthread_mutex_lock(&lock1);
+  usleep(100000);
+  pthread_exit(NULL);
+}
+
+void *waiter(void * args) {
+  pthread_mutex_lock(&lock1);
+  pthread_mutex_unlock(&lock1);
+  pthread_exit(NULL);
+}
+
+int main() {
+  pthread_t thread1;
+  pthread_t thread2;
+
+  pthread_create(&thread1, NULL, &owner, NULL);
+  usleep(10000);
+  pthread_create(&thread2, NULL, &waiter, NULL);
+
+  pthread_join(thread1, NULL);
+  pthread_join(thread2, NULL);
+
+  // Only reached if the waiter got the mutex, which it never can
+  return 0;
+}
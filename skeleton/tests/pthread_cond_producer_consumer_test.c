@@ -0,0 +1,71 @@
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+
+#define BUFFER_SIZE 2
+#define ITEMS_PER_PRODUCER 8
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+
+int buffer[BUFFER_SIZE];
+int count = 0;
+int consumed_sum = 0;
+
+/*
+ * PTHREAD_COND PRODUCER CONSUMER TEST
+ * 2 producers and 2 consumers share a bounded buffer with room for 2 items. Both sides re-check
+ * their condition in a while loop, so whichever waiter a signal wakes, every item is consumed once.
+ * The sum of the consumed items should always be 2 * (1 + 2 + ... + 8) = 72.
+ */
+
+void *producer(void * args) {
+  for (int i = 1; i <= ITEMS_PER_PRODUCER; i++) {
+    pthread_mutex_lock(&lock);
+    while (count == BUFFER_SIZE) {
+      pthread_cond_wait(&not_full, &lock);
+    }
+    buffer[count++] = i;
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+void *consumer(void * args) {
+  for (int i = 0; i < ITEMS_PER_PRODUCER; i++) {
+    pthread_mutex_lock(&lock);
+    while (count == 0) {
+      pthread_cond_wait(&not_empty, &lock);
+    }
+    consumed_sum += buffer[--count];
+    pthread_cond_signal(&not_full);
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+int main() {
+  pthread_t producers[2];
+  pthread_t consumers[2];
+
+  for (int i = 0; i < 2; i++) {
+    pthread_create(&consumers[i], NULL, &consumer, NULL);
+    pthread_create(&producers[i], NULL, &producer, NULL);
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_join(producers[i], NULL);
+    pthread_join(consumers[i], NULL);
+  }
+
+  printf("consumed_sum = %d\n", consumed_sum);
+  if (consumed_sum == 72) {
+    return 0;
+  }
+  else {
+    return 1;
+  }
+}
@@ -0,0 +1,45 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+
+#define NUM_DETACHED 3
+
+int g_shared_var = 0;
+
+/*
+ * PTHREAD DETACH REUSE TEST
+ * Main creates NUM_DETACHED threads that do nothing, detaches them and sleeps so they exit.
+ * glibc hands the handle of a finished detached thread to the next thread it creates, so the
+ * writer created afterwards usually gets one of them. Main joins the writer and reads what it
+ * wrote, which is ordered by the join no matter which handle the writer got. Built with
+ * `make tsan_tests`, no data race may be reported.
+ * This program should always return 0.
+ */
+
+void *nothing(void *arg) {
+  return NULL;
+}
+
+void *writer(void *arg) {
+  g_shared_var = 1;
+  return NULL;
+}
+
+int main() {
+  pthread_t detached[NUM_DETACHED];
+  pthread_t thread;
+
+  for (int i = 0; i < NUM_DETACHED; i++) {
+    pthread_create(&detached[i], NULL, nothing, NULL);
+    pthread_detach(detached[i]);
+  }
+  usleep(10000);
+
+  pthread_create(&thread, NULL, writer, NULL);
+  pthread_join(thread, NULL);
+  printf("g_shared_var = %d\n", g_shared_var);
+  return g_shared_var == 1 ? 0 : 1;
+}
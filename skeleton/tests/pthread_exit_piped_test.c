@@ -0,0 +1,69 @@
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+#include<sys/wait.h>
+
+#define THREAD_NUM 8
+
+/*
+ * PTHREAD EXIT PIPED TEST
+ * Main sends its stdout through a pipe to a child process that copies it to the real
+ * stdout, then THREAD_NUM threads print and leave through pthread_exit. The first
+ * pthread_exit loads libgcc_s to unwind the thread, which calls pthread_once after
+ * the thread already terminated in the scheduler. Run it with and without THREAD_POOL.
+ * This program should always return 0.
+ */
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int g_exited = 0;
+
+void *t1(void * args) {
+  int id = *(int *)args;
+
+  pthread_mutex_lock(&lock);
+  printf("Thread %d exiting\n", id);
+  g_exited++;
+  pthread_mutex_unlock(&lock);
+  pthread_exit(NULL);
+}
+
+int main() {
+  pthread_t threads[THREAD_NUM];
+  int ids[THREAD_NUM];
+  int pipe_fds[2];
+
+  fflush(stdout);
+  if (pipe(pipe_fds) != 0) {
+    return 1;
+  }
+  pid_t reader = fork();
+  if (reader == 0) {
+    // Copies the pipe to the real stdout until main closes its end
+    close(pipe_fds[1]);
+    char buffer[4096];
+    ssize_t length;
+    while ((length = read(pipe_fds[0], buffer, sizeof(buffer))) > 0) {
+      write(STDOUT_FILENO, buffer, length);
+    }
+    _exit(0);
+  }
+  close(pipe_fds[0]);
+  dup2(pipe_fds[1], STDOUT_FILENO);
+  close(pipe_fds[1]);
+
+  for (int i = 0; i < THREAD_NUM; i++) {
+    ids[i] = i + 1;
+    pthread_create(&threads[i], NULL, &t1, (void *)&ids[i]);
+  }
+  for (int i = 0; i < THREAD_NUM; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  printf("%d threads exited\n", g_exited);
+  fflush(stdout);
+  close(STDOUT_FILENO);
+  waitpid(reader, NULL, 0);
+  return g_exited == THREAD_NUM ? 0 : 1;
+}
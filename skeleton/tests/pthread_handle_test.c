@@ -0,0 +1,51 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<signal.h>
+#include<unistd.h>
+#include<malloc.h>
+
+pthread_mutex_t lock1 = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * PTHREAD HANDLE TEST
+ * Main holds lock1 so the worker stays alive, then passes the worker's handle to
+ * pthread_kill, pthread_setname_np, pthread_getname_np, pthread_getattr_np and
+ * pthread_getschedparam. With THREAD_POOL=n the handle belongs to a pool slot,
+ * and testlib must hand these calls the OS thread running the worker.
+ * This program should always return 0.
+ */
+
+void *worker(void *arg) {
+  pthread_mutex_lock(&lock1);
+  pthread_mutex_unlock(&lock1);
+  return NULL;
+}
+
+int main() {
+  pthread_t thread;
+  char name[16];
+  pthread_attr_t attr;
+  struct sched_param param;
+  int policy;
+  int failures = 0;
+
+  pthread_mutex_lock(&lock1);
+  pthread_create(&thread, NULL, worker, NULL);
+
+  failures += pthread_kill(thread, 0) != 0;
+  failures += pthread_setname_np(thread, "worker") != 0;
+  failures += pthread_getname_np(thread, name, sizeof(name)) != 0 || strcmp(name, "worker") != 0;
+  if (pthread_getattr_np(thread, &attr) == 0) {
+    pthread_attr_destroy(&attr);
+  } else {
+    failures++;
+  }
+  failures += pthread_getschedparam(thread, &policy, &param) != 0;
+
+  pthread_mutex_unlock(&lock1);
+  pthread_join(thread, NULL);
+  printf("failures = %d\n", failures);
+  return failures == 0 ? 0 : 1;
+}
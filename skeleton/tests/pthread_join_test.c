@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+#include<errno.h>
+#include<time.h>
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int g_shared_var = 0;
+
+/*
+ * PTHREAD_JOIN TEST
+ * Main polls t1 with pthread_tryjoin_np until it finished, waits for t2 with pthread_timedjoin_np
+ * and detaches t3. Every thread adds to a shared variable under a mutex before main reads it.
+ * Under PCT main has to be blocked in the joins until the threads it waits for terminated,
+ * so this program should never hang and always return 0.
+ */
+
+void *add(void * args) {
+  pthread_mutex_lock(&lock);
+  g_shared_var += (long)args;
+  pthread_mutex_unlock(&lock);
+  return args;
+}
+
+int main() {
+  pthread_t thread1;
+  pthread_t thread2;
+  pthread_t thread3;
+  void *result1 = NULL;
+  void *result2 = NULL;
+
+  pthread_create(&thread1, NULL, &add, (void *)1);
+  pthread_create(&thread2, NULL, &add, (void *)2);
+  pthread_create(&thread3, NULL, &add, (void *)4);
+  pthread_detach(thread3);
+
+  while (pthread_tryjoin_np(thread1, &result1) == EBUSY);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += 5;
+  if (pthread_timedjoin_np(thread2, &result2, &deadline) != 0) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&lock);
+  int value = g_shared_var;
+  pthread_mutex_unlock(&lock);
+
+  printf("g_shared_var = %d\n", value);
+  if ((long)result1 != 1 || (long)result2 != 2 || (value & 3) != 3) {
+    return 1;
+  }
+  return 0;
+}
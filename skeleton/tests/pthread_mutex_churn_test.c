@@ -0,0 +1,51 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+
+#define THREAD_NUM 2
+#define MUTEX_NUM 2048
+
+/*
+ * PTHREAD MUTEX CHURN TEST
+ * Each thread allocates MUTEX_NUM heap mutexes, then initializes, locks, unlocks and
+ * destroys them one after another under a shared lock. Together the mutexes outnumber the
+ * mutex registry of testlib, which must reuse the entries of destroyed mutexes.
+ * This program should always return 0.
+ */
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int g_counter = 0;
+
+void *t1(void * args) {
+  // Kept until the end, so every mutex has its own address
+  pthread_mutex_t *mutexes = malloc(MUTEX_NUM * sizeof(pthread_mutex_t));
+  for (int i = 0; i < MUTEX_NUM; i++) {
+    pthread_mutex_t *mutex = &mutexes[i];
+    pthread_mutex_init(mutex, NULL);
+    pthread_mutex_lock(&lock);
+    pthread_mutex_lock(mutex);
+    g_counter++;
+    pthread_mutex_unlock(mutex);
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_destroy(mutex);
+  }
+  free(mutexes);
+  pthread_exit(NULL);
+}
+
+int main() {
+  pthread_t threads[THREAD_NUM];
+
+  for (int i = 0; i < THREAD_NUM; i++) {
+    pthread_create(&threads[i], NULL, &t1, NULL);
+  }
+  for (int i = 0; i < THREAD_NUM; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  printf("g_counter = %d\n", g_counter);
+  return g_counter == THREAD_NUM * MUTEX_NUM ? 0 : 1;
+}
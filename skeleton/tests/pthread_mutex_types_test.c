@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+#include<errno.h>
+
+#define NUM_THREADS 3
+
+pthread_mutex_t recursive;
+pthread_mutex_t errorcheck;
+int g_depth = 0;
+int g_bad = 0;
+
+/*
+ * PTHREAD MUTEX TYPES TEST
+ * NUM_THREADS threads lock a recursive mutex three levels deep and release it one level at
+ * a time, checking that no other thread got in while they still held one level. Each also
+ * locks an error checking mutex twice, where the second lock has to fail with EDEADLK
+ * instead of deadlocking, and unlocks it twice, where the second unlock fails with EPERM.
+ * This program should always return 0.
+ */
+
+void lock_levels(int level) {
+  pthread_mutex_lock(&recursive);
+  if (g_depth != 3 - level) {
+    g_bad++;
+  }
+  g_depth++;
+  if (level > 1) {
+    lock_levels(level - 1);
+  }
+  g_depth--;
+  pthread_mutex_unlock(&recursive);
+}
+
+void *worker(void *arg) {
+  for (int i = 0; i < 2; i++) {
+    lock_levels(3);
+  }
+
+  pthread_mutex_lock(&errorcheck);
+  if (pthread_mutex_lock(&errorcheck) != EDEADLK) {
+    g_bad++;
+  }
+  pthread_mutex_unlock(&errorcheck);
+  if (pthread_mutex_unlock(&errorcheck) != EPERM) {
+    g_bad++;
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t threads[NUM_THREADS];
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&recursive, &attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+  pthread_mutex_init(&errorcheck, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&recursive);
+  pthread_mutex_destroy(&errorcheck);
+  return g_bad == 0 ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+#include<errno.h>
+#include<time.h>
+
+pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+int g_value = 0;
+int g_torn_reads = 0;
+pthread_mutex_t torn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * PTHREAD_RWLOCK TEST
+ * Two writers add 2 to a shared value 5 times each, one step at a time with a scheduling point
+ * (a mutex unlock) in between, while holding the rwlock for writing. Two readers check under
+ * the read lock that they never see an odd value, the tryrdlock reader also adds 2 itself with
+ * pthread_rwlock_trywrlock whenever the rwlock is free.
+ * Main finally takes the write lock with pthread_rwlock_timedwrlock.
+ * This program should always return 0.
+ */
+
+void scheduling_point() {
+  pthread_mutex_lock(&torn_lock);
+  pthread_mutex_unlock(&torn_lock);
+}
+
+void *writer(void *arg) {
+  for (int i = 0; i < 5; i++) {
+    pthread_rwlock_wrlock(&rwlock);
+    g_value++;
+    scheduling_point();
+    g_value++;
+    pthread_rwlock_unlock(&rwlock);
+  }
+  return NULL;
+}
+
+void *reader(void *arg) {
+  int try_lock = *(int *)arg;
+  for (int i = 0; i < 5; i++) {
+    if (try_lock) {
+      if (pthread_rwlock_tryrdlock(&rwlock) != 0) {
+        scheduling_point();
+        continue;
+      }
+    } else {
+      pthread_rwlock_rdlock(&rwlock);
+    }
+    int odd = g_value % 2;
+    pthread_rwlock_unlock(&rwlock);
+    if (odd) {
+      pthread_mutex_lock(&torn_lock);
+      g_torn_reads++;
+      pthread_mutex_unlock(&torn_lock);
+    }
+    if (try_lock && pthread_rwlock_trywrlock(&rwlock) == 0) {
+      g_value += 2;
+      pthread_rwlock_unlock(&rwlock);
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t writers[2], readers[2];
+  int try_lock[2] = { 0, 1 };
+
+  for (int i = 0; i < 2; i++) {
+    pthread_create(&writers[i], NULL, writer, NULL);
+    pthread_create(&readers[i], NULL, reader, &try_lock[i]);
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_join(writers[i], NULL);
+    pthread_join(readers[i], NULL);
+  }
+
+  struct timespec abstime;
+  clock_gettime(CLOCK_REALTIME, &abstime);
+  abstime.tv_sec += 5;
+  if (pthread_rwlock_timedwrlock(&rwlock, &abstime) != 0) {
+    return 1;
+  }
+  int value = g_value;
+  pthread_rwlock_unlock(&rwlock);
+
+  if (g_torn_reads != 0 || value < 20 || value % 2 != 0) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+#include<errno.h>
+#include<time.h>
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t busy = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+int g_items = 0;
+int g_done = 0;
+
+/*
+ * PTHREAD TIMED WAIT TEST
+ * A producer sleeps one second before each of 3 items, a consumer waits for them with
+ * pthread_cond_timedwait and a 100ms timeout, so it times out in between. t3 holds a mutex
+ * over a sleep while main gives up on it with pthread_mutex_timedlock, then takes it blocking.
+ * With VIRTUAL_TIME=True the sleeps and timeouts only move the virtual clock, so this
+ * program finishes in milliseconds instead of seconds. It should always return 0.
+ */
+
+void deadline_in(struct timespec *abstime, long ms) {
+  clock_gettime(CLOCK_REALTIME, abstime);
+  abstime->tv_sec += ms / 1000;
+  abstime->tv_nsec += (ms % 1000) * 1000000;
+  if (abstime->tv_nsec >= 1000000000) {
+    abstime->tv_sec++;
+    abstime->tv_nsec -= 1000000000;
+  }
+}
+
+void *producer(void *arg) {
+  for (int i = 0; i < 3; i++) {
+    sleep(1);
+    pthread_mutex_lock(&lock);
+    g_items++;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+void *consumer(void *arg) {
+  int consumed = 0;
+  pthread_mutex_lock(&lock);
+  while (consumed < 3) {
+    if (g_items == 0) {
+      struct timespec abstime;
+      deadline_in(&abstime, 100);
+      int ret = pthread_cond_timedwait(&cond, &lock, &abstime);
+      if (ret != 0 && ret != ETIMEDOUT) {
+        break;
+      }
+      continue;
+    }
+    g_items--;
+    consumed++;
+  }
+  g_done = consumed;
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void *holder(void *arg) {
+  pthread_mutex_lock(&busy);
+  usleep(500000);
+  pthread_mutex_unlock(&busy);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t t1, t2, t3;
+  int status = 0;
+
+  pthread_create(&t1, NULL, producer, NULL);
+  pthread_create(&t2, NULL, consumer, NULL);
+  pthread_create(&t3, NULL, holder, NULL);
+
+  // Make sure t3 got the mutex first
+  struct timespec nap = { 0, 100000000 };
+  nanosleep(&nap, NULL);
+
+  struct timespec abstime;
+  deadline_in(&abstime, 10);
+  int ret = pthread_mutex_timedlock(&busy, &abstime);
+  if (ret == 0) {
+    pthread_mutex_unlock(&busy);
+  } else if (ret != ETIMEDOUT) {
+    status = 1;
+  }
+
+  deadline_in(&abstime, 5000);
+  if (pthread_mutex_timedlock(&busy, &abstime) != 0) {
+    status = 1;
+  } else {
+    pthread_mutex_unlock(&busy);
+  }
+
+  pthread_join(t1, NULL);
+  pthread_join(t2, NULL);
+  pthread_join(t3, NULL);
+
+  if (g_done != 3) {
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<semaphore.h>
+#include<sched.h>
+#include<unistd.h>
+#include<malloc.h>
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+sem_t ready;
+int g_flag = 0;
+int g_counter = 0;
+
+/*
+ * PTHREAD TRYLOCK SPIN TEST
+ * main holds a mutex while it creates four threads that busy-wait for it: one spins on
+ * pthread_mutex_trylock, one on sem_trywait of a semaphore main posts later, and two call
+ * sched_yield until main sets a flag. Under PCT a spinner with a higher priority than main
+ * would run forever unless it is demoted by the fair scheduler (FAIR_SPIN_LIMIT). The two
+ * yield spinners hand the turn to each other, so neither gives main a chance on its own.
+ * This program should always return 0.
+ */
+
+void *trylock_spinner(void *arg) {
+  while (pthread_mutex_trylock(&lock) != 0) {
+  }
+  g_counter++;
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void *trywait_spinner(void *arg) {
+  while (sem_trywait(&ready) != 0) {
+  }
+  pthread_mutex_lock(&lock);
+  g_counter++;
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void *yield_spinner(void *arg) {
+  while (!__atomic_load_n(&g_flag, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+  pthread_mutex_lock(&lock);
+  g_counter++;
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t t1, t2, t3, t4;
+
+  sem_init(&ready, 0, 0);
+
+  pthread_mutex_lock(&lock);
+  pthread_create(&t1, NULL, trylock_spinner, NULL);
+  pthread_create(&t2, NULL, trywait_spinner, NULL);
+  pthread_create(&t3, NULL, yield_spinner, NULL);
+  pthread_create(&t4, NULL, yield_spinner, NULL);
+  pthread_mutex_unlock(&lock);
+
+  sem_post(&ready);
+  __atomic_store_n(&g_flag, 1, __ATOMIC_RELEASE);
+
+  pthread_join(t1, NULL);
+  pthread_join(t2, NULL);
+  pthread_join(t3, NULL);
+  pthread_join(t4, NULL);
+
+  return g_counter == 4 ? 0 : 1;
+}
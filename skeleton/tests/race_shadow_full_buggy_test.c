@@ -0,0 +1,45 @@
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<malloc.h>
+
+#define BIG_WORDS 100000
+#define INCREMENTS 1000
+
+/*
+ * BUGGY RACE SHADOW FULL TEST
+ * main first writes every word of an array larger than the shadow table of the race
+ * detection, then two threads increment a shared counter without a lock. Built with
+ * `make tsan_tests`, the race on the counter must still be reported (exit code 5)
+ * although the shadow table was full when the threads started.
+ * Without race detection it returns 1 whenever an increment was lost.
+ */
+
+long big[BIG_WORDS];
+int g_shared = 0;
+
+void *t1(void * args) {
+  for (int i = 0; i < INCREMENTS; i++) {
+    g_shared++;
+  }
+  pthread_exit(NULL);
+}
+
+int main() {
+  pthread_t thread1;
+  pthread_t thread2;
+
+  for (int i = 0; i < BIG_WORDS; i++) {
+    big[i] = i;
+  }
+
+  pthread_create(&thread1, NULL, &t1, NULL);
+  pthread_create(&thread2, NULL, &t1, NULL);
+
+  pthread_join(thread1, NULL);
+  pthread_join(thread2, NULL);
+
+  printf("g_shared = %d\n", g_shared);
+  return g_shared == 2 * INCREMENTS ? 0 : 1;
+}
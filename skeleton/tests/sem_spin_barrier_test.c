@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<pthread.h>
+#include<semaphore.h>
+#include<unistd.h>
+#include<malloc.h>
+#include<errno.h>
+#include<time.h>
+
+#define NUM_THREADS 3
+#define NUM_ROUNDS 4
+
+pthread_spinlock_t spin;
+pthread_barrier_t barrier;
+sem_t slots, items;
+int g_counter = 0;
+int g_bad_rounds = 0;
+int g_buffer[2];
+int g_in = 0;
+int g_out = 0;
+
+/*
+ * SEMAPHORE, SPIN LOCK AND BARRIER TEST
+ * NUM_THREADS workers increment a counter under a spin lock once per round and meet at a barrier,
+ * where the serial thread checks that every worker incremented it. Meanwhile a producer hands
+ * 6 numbers to main through a buffer of 2 guarded by two semaphores. Finally main waits on an
+ * empty semaphore with sem_timedwait, which has to time out.
+ * This program should always return 0.
+ */
+
+void *worker(void *arg) {
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    pthread_spin_lock(&spin);
+    g_counter++;
+    pthread_spin_unlock(&spin);
+
+    if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+      if (g_counter != NUM_THREADS * (round + 1)) {
+        g_bad_rounds++;
+      }
+    }
+    // Nobody increments the counter before the serial thread checked it
+    pthread_barrier_wait(&barrier);
+  }
+  return NULL;
+}
+
+void *producer(void *arg) {
+  for (int i = 1; i <= 6; i++) {
+    sem_wait(&slots);
+    g_buffer[g_in] = i;
+    g_in = (g_in + 1) % 2;
+    sem_post(&items);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t workers[NUM_THREADS], t;
+  int status = 0;
+
+  pthread_spin_init(&spin, PTHREAD_PROCESS_PRIVATE);
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  sem_init(&slots, 0, 2);
+  sem_init(&items, 0, 0);
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&workers[i], NULL, worker, NULL);
+  }
+  pthread_create(&t, NULL, producer, NULL);
+
+  int sum = 0;
+  for (int i = 0; i < 6; i++) {
+    sem_wait(&items);
+    sum += g_buffer[g_out];
+    g_out = (g_out + 1) % 2;
+    sem_post(&slots);
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  pthread_join(t, NULL);
+
+  struct timespec abstime;
+  clock_gettime(CLOCK_REALTIME, &abstime);
+  abstime.tv_nsec += 50000000;
+  if (abstime.tv_nsec >= 1000000000) {
+    abstime.tv_sec++;
+    abstime.tv_nsec -= 1000000000;
+  }
+  if (sem_timedwait(&items, &abstime) != -1 || errno != ETIMEDOUT) {
+    status = 1;
+  }
+
+  if (sum != 21 || g_counter != NUM_THREADS * NUM_ROUNDS || g_bad_rounds != 0) {
+    status = 1;
+  }
+
+  pthread_barrier_destroy(&barrier);
+  pthread_spin_destroy(&spin);
+  return status;
+}
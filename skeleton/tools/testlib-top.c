@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/*
+ * TESTLIB-TOP
+ * Samples the statistics page of a program running under testlib.so with
+ * STATS=True, see stats.h.
+ *
+ *   tools/testlib-top [-i <ms>] [-n <samples>] [pid]
+ *
+ * Without a pid it watches the newest /dev/shm/testlib-* page. Every interval
+ * (1000 ms by default) it prints the step number, context switches, threads,
+ * the share of time spent in the scheduler, the last decision and the most
+ * called functions with their rates. It stops after -n samples or when the
+ * program exited.
+ */
+
+#define TOP_FUNCTIONS 10
+#define NS_PER_SECOND 1000000000ull
+
+uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+// pid of the most recently modified page, -1 if there is none
+int newest_page() {
+  DIR *shm = opendir("/dev/shm");
+  if (shm == NULL) {
+    return -1;
+  }
+  int newest = -1;
+  time_t newest_time = 0;
+  struct dirent *entry;
+  while ((entry = readdir(shm)) != NULL) {
+    int pid;
+    if (sscanf(entry->d_name, "testlib-%d", &pid) != 1) {
+      continue;
+    }
+    char path[64];
+    struct stat info;
+    snprintf(path, sizeof(path), TESTLIB_STATS_PATH, pid);
+    if (stat(path, &info) == 0 && (newest == -1 || info.st_mtime >= newest_time)) {
+      newest = pid;
+      newest_time = info.st_mtime;
+    }
+  }
+  closedir(shm);
+  return newest;
+}
+
+const struct testlib_stats *map_page(int pid) {
+  char path[64];
+  snprintf(path, sizeof(path), TESTLIB_STATS_PATH, pid);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "testlib-top: cannot open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  void *page = mmap(NULL, sizeof(struct testlib_stats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    fprintf(stderr, "testlib-top: cannot map %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  return page;
+}
+
+uint64_t load(const uint64_t *field) {
+  return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+int load_int(const int32_t *field) {
+  return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+double per_second(uint64_t delta, uint64_t elapsed_ns) {
+  return elapsed_ns == 0 ? 0 : (double)delta * NS_PER_SECOND / elapsed_ns;
+}
+
+void print_sample(const struct testlib_stats *stats, const uint64_t *previous_calls,
+                  uint64_t previous_steps, uint64_t previous_switches,
+                  uint64_t previous_scheduler_ns, uint64_t elapsed_ns) {
+  uint64_t now = now_ns();
+  uint64_t steps = load(&stats->steps);
+  uint64_t switches = load(&stats->context_switches);
+  uint64_t scheduler_ns = load(&stats->scheduler_ns);
+
+  if (isatty(STDOUT_FILENO)) {
+    printf("\033[H\033[J");
+  }
+  printf("pid %d  algorithm %d (%s)  running %.1fs%s\n",
+         stats->pid, stats->algorithm, stats->strategy,
+         (double)(now - stats->start_ns) / NS_PER_SECOND,
+         load_int(&stats->finished) ? "  finished" : "");
+  printf("steps %lu (%.0f/s)  context switches %lu (%.0f/s)  scheduler %.1f%%\n",
+         steps, per_second(steps - previous_steps, elapsed_ns),
+         switches, per_second(switches - previous_switches, elapsed_ns),
+         elapsed_ns == 0 ? 0 : 100.0 * (scheduler_ns - previous_scheduler_ns) / elapsed_ns);
+  printf("threads runnable %d  blocked %d\n",
+         load_int(&stats->runnable_threads), load_int(&stats->blocked_threads));
+
+  uint64_t last_decision_ns = load(&stats->last_decision_ns);
+  if (last_decision_ns != 0) {
+    printf("last decision at step %lu, %.1fs ago: state %d, thread %d -> %d\n",
+           load(&stats->last_step), (double)(now - last_decision_ns) / NS_PER_SECOND,
+           load_int(&stats->last_state), load_int(&stats->last_from),
+           load_int(&stats->last_to));
+  }
+  if (elapsed_ns != 0 && steps == previous_steps && !load_int(&stats->finished)) {
+    printf("no scheduling point since the last sample\n");
+  }
+
+  // The functions with the most calls since the last sample, then the most calls overall
+  int count = stats->function_count < TESTLIB_STATS_MAX_FUNCTIONS ?
+              stats->function_count : TESTLIB_STATS_MAX_FUNCTIONS;
+  bool shown[TESTLIB_STATS_MAX_FUNCTIONS] = { false };
+  printf("%-28s %12s %10s\n", "function", "calls", "calls/s");
+  for (int row = 0; row < TOP_FUNCTIONS; row++) {
+    int best = -1;
+    for (int i = 0; i < count; i++) {
+      if (shown[i] || load(&stats->calls[i]) == 0) {
+        continue;
+      }
+      uint64_t delta = load(&stats->calls[i]) - previous_calls[i];
+      uint64_t best_delta = best == -1 ? 0 : load(&stats->calls[best]) - previous_calls[best];
+      if (best == -1 || delta > best_delta ||
+          (delta == best_delta && load(&stats->calls[i]) > load(&stats->calls[best]))) {
+        best = i;
+      }
+    }
+    if (best == -1) {
+      break;
+    }
+    shown[best] = true;
+    uint64_t calls = load(&stats->calls[best]);
+    printf("%-28s %12lu %10.0f\n", stats->function_names[best], calls,
+           per_second(calls - previous_calls[best], elapsed_ns));
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  int interval_ms = 1000;
+  long samples = -1;
+  int option;
+  while ((option = getopt(argc, argv, "i:n:")) != -1) {
+    if (option == 'i') {
+      interval_ms = atoi(optarg);
+    } else if (option == 'n') {
+      samples = atol(optarg);
+    } else {
+      fprintf(stderr, "usage: %s [-i <ms>] [-n <samples>] [pid]\n", argv[0]);
+      return 1;
+    }
+  }
+  int pid = optind < argc ? atoi(argv[optind]) : newest_page();
+  if (pid <= 0) {
+    fprintf(stderr, "testlib-top: no /dev/shm/testlib-* page, run the program with STATS=True\n");
+    return 1;
+  }
+
+  const struct testlib_stats *stats = map_page(pid);
+  if (stats == NULL) {
+    return 1;
+  }
+  // The magic is written last, once the rest of the header is filled in
+  while (__atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != TESTLIB_STATS_MAGIC) {
+    if (kill(pid, 0) == -1 && errno == ESRCH) {
+      fprintf(stderr, "testlib-top: process %d exited\n", pid);
+      return 1;
+    }
+    usleep(10000);
+  }
+
+  uint64_t previous_calls[TESTLIB_STATS_MAX_FUNCTIONS] = { 0 };
+  uint64_t previous_steps = 0;
+  uint64_t previous_switches = 0;
+  uint64_t previous_scheduler_ns = 0;
+  uint64_t previous_ns = stats->start_ns;
+
+  for (long sample = 0; samples < 0 || sample < samples; sample++) {
+    if (sample > 0) {
+      usleep(interval_ms * 1000);
+    }
+    bool exited = load_int(&stats->finished) || (kill(pid, 0) == -1 && errno == ESRCH);
+    uint64_t now = now_ns();
+    print_sample(stats, previous_calls, previous_steps, previous_switches,
+                 previous_scheduler_ns, now - previous_ns);
+    if (exited) {
+      break;
+    }
+
+    for (int i = 0; i < TESTLIB_STATS_MAX_FUNCTIONS; i++) {
+      previous_calls[i] = load(&stats->calls[i]);
+    }
+    previous_steps = load(&stats->steps);
+    previous_switches = load(&stats->context_switches);
+    previous_scheduler_ns = load(&stats->scheduler_ns);
+    previous_ns = now;
+  }
+  return 0;
+}